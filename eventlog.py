@@ -0,0 +1,117 @@
+import os
+import re
+import sys
+
+# Decodes "EVLOG <hex>" lines sent by log_flush() (see src/eventlog.h and src/netlog.h).
+# Usage: python eventlog.py [-s snapshot_file] [syslog files...] (reads stdin if no files are given)
+#   -s  also write the last RTC snapshot (see src/snapshot.h) to snapshot_file, for the native runner to replay with -r
+
+src_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'src')
+
+def main():
+	formats = load_formats(os.path.join(src_dir, 'eventlog.h'))
+	var_names = load_var_names(os.path.join(src_dir, 'ulpdefs.h'))
+	trace_names = load_enum_names(os.path.join(src_dir, 'ulpdefs.h'), 'TRACE_')
+	tick_names = load_enum_names(os.path.join(src_dir, 'ulpdefs.h'), 'TICK_')
+	snap_names = (load_enum_names(os.path.join(src_dir, 'ulpdefs.h'), 'VAR_'), load_enum_names(os.path.join(src_dir, 'snapshot.h'), 'SNAP_'))
+	args = sys.argv[1:]
+	snapshot_path, snapshot = None, None
+	if len(args) >= 2 and args[0] == '-s':
+		snapshot_path, args = args[1], args[2:]
+	files = [open(f) for f in args] or [sys.stdin]
+	for f in files:
+		for line in f:
+			m = re.search(r'EVLOG ([0-9a-fA-F]+)', line)
+			if not m: continue
+			for event, ts, event_args in records(bytes.fromhex(m.group(1))):
+				print('%02d:%02d:%02d  %s' % (ts // 3600, ts // 60 % 60, ts % 60,
+					decode(event, event_args, formats, var_names, trace_names, tick_names, snap_names)))
+				name = formats[event][0] if event < len(formats) else None
+				if name == 'EV_SNAPSHOT':
+					snapshot = (ts, event_args, [])
+				elif name == 'EV_SNAPSHOT_STACK' and snapshot is not None:
+					snapshot[2].extend(event_args)
+	if snapshot_path is not None:
+		if snapshot is None:
+			sys.exit('No RTC snapshot found')
+		ts, header, stack = snapshot
+		with open(snapshot_path, 'w') as out:
+			out.write('# RTC snapshot at %02d:%02d:%02d: EV_SNAPSHOT args, then EV_SNAPSHOT_STACK args (see src/snapshot.h)\n' %
+				(ts // 3600, ts // 60 % 60, ts % 60))
+			out.write(' '.join(str(a) for a in header) + '\n')
+			out.write(' '.join(str(a) for a in stack) + '\n')
+
+# Event formats in order of their IDs, straight from EVENT_TABLE
+def load_formats(path):
+	return [(m.group(1), m.group(2)) for m in re.finditer(r'EVENT\((EV_\w+),\s*"((?:[^"\\]|\\.)*)"\)', open(path).read())]
+
+# Names of VAR_* variables up to VAR_STACK_LIMIT, as logged by log_vars()
+def load_var_names(path):
+	names = []
+	for m in re.finditer(r'^\s*(VAR_\w+)\s*(?:=\s*\d+)?,', open(path).read(), re.M):
+		if m.group(1) == 'VAR_STACK_LIMIT': break
+		names.append(m.group(1)[4:].lower())
+	return ['wcause'] + names + ['stack_hw']
+
+# Names of the members of the enum whose members start with prefix, in order of their values
+def load_enum_names(path, prefix):
+	return [m.group(1).lower() for m in re.finditer(r'^\s*%s(\w+)\s*,' % prefix, open(path).read(), re.M)]
+
+# Trace records of EV_ULP_TRACE, two per arg, oldest first (see src/trace.h)
+def decode_trace(args, trace_names, tick_names):
+	records = [r for arg in args for r in (arg & 0xffff, (arg >> 16) & 0xffff) if r != 0]
+	lines = ['ULP trace: %d records, oldest first' % len(records)]
+	for r in records:
+		point, call, action, diff_ss = r >> 12, (r >> 9) & 7, (r >> 6) & 7, r & 0x3f
+		point = trace_names[point] if point < len(trace_names) else str(point)
+		action = tick_names[action] if action < len(tick_names) else str(action)
+		lines.append('  call=%d  %-22s action=%-7s diff_ss=%d' % (call, point, action, diff_ss))
+	return '\n'.join(lines)
+
+# Version, cause and VAR_* words of EV_SNAPSHOT (see src/snapshot.h)
+def decode_snapshot(args, snap_names):
+	var_names, cause_names = snap_names
+	if len(args) < 3:
+		return 'RTC snapshot: truncated'
+	version, cause, count = args[:3]
+	cause = cause_names[cause] if cause < len(cause_names) else str(cause)
+	names = [var_names[i] if i < len(var_names) else 'var%d' % i for i in range(count)]
+	return 'RTC snapshot v%d (%s): ' % (version, cause) + ', '.join('%s=%d' % (n, a) for n, a in zip(names, args[3:]))
+
+# Event ID, timestamp and args of each record
+def records(data):
+	pos = 0
+	while pos + 4 <= len(data):
+		event, size, ts = data[pos], data[pos+1], data[pos+2] | (data[pos+3] << 8)
+		args = decode_args(data[pos+4:pos+4+size])
+		pos += 4 + size
+		yield event, ts, args
+
+def decode(event, args, formats, var_names, trace_names, tick_names, snap_names):
+	if event >= len(formats):
+		return 'unknown event %d %s' % (event, args)
+	elif formats[event][0] == 'EV_VARS':
+		return 'vars: ' + ', '.join('%s=%d' % (name, arg) for name, arg in zip(var_names, args))
+	elif formats[event][0] == 'EV_ULP_TRACE':
+		return decode_trace(args, trace_names, tick_names)
+	elif formats[event][0] == 'EV_SNAPSHOT':
+		return decode_snapshot(args, snap_names)
+	elif formats[event][0] == 'EV_SNAPSHOT_STACK':
+		return 'RTC snapshot stack: ' + ' '.join('%04x' % a for a in args)
+	try:
+		return formats[event][1] % tuple(args)
+	except TypeError:
+		return '%s %s' % (formats[event][0], args)
+
+# Zigzag varints, see event_log_args()
+def decode_args(data):
+	args, value, shift = [], 0, 0
+	for b in data:
+		value |= (b & 0x7f) << shift
+		shift += 7
+		if b < 0x80:
+			args.append((value >> 1) ^ -(value & 1))
+			value, shift = 0, 0
+	return args
+
+if __name__ == "__main__": main()
@@ -0,0 +1,390 @@
+/*
+ * bench.cpp
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Battery life benchmark for the native build. Each benchmark runs the firmware and the ULP program for
+// weeks of simulated time under a standard scenario and reports where the energy goes: ULP active time,
+// tick pulse time by tick action, main core wakes, radio-on time, and an estimated mAh/day from the
+// current model below. Results are compared against a baseline file (one line per benchmark and length),
+// and the run fails if any cost has grown by more than the tolerance, so that power regressions show up
+// between commits. Each run is a child process as in runner.cpp; -j runs several at once.
+//
+// Usage: espclock_bench [-v] [-d days[,days...]] [-j jobs] [-m name=value] [-b baseline] [-r percent] [-w] [benchmark...]
+//   -d  lengths of each run in days (default 30; the full suite is 30,90,365)
+//   -j  number of runs in parallel
+//   -m  override a figure of the current model, eg. -m radio_ma=120
+//   -b  baseline file (default native/bench_baseline.txt; skipped if missing)
+//   -r  tolerance in percent before an increase counts as a regression (default 2)
+//   -w  write the results into the baseline file instead of comparing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim.h"
+#include "ulpdefs.h"
+
+using namespace sim;
+
+#define HOUR_NS                 (3600*SIM_NS_PER_SEC)
+#define DAY_NS                  SIM_NS_PER_DAY
+#define POWER_ON_HOUR           10                                // env.local_time_s at power on
+#define DEF_BASELINE            "native/bench_baseline.txt"
+#define DEF_TOLERANCE           2.0
+
+typedef struct {
+  const char* name;
+  const char* description;
+  void (*script)(double days);
+} benchmark_t;
+
+// Current drawn from the battery in each state. These are rough datasheet figures; what matters for
+// comparing commits is that the same model is used on both sides.
+typedef struct {
+  const char* name;
+  double value;
+  const char* description;
+} model_t;
+
+static model_t model[] = {
+  { "sleep_ua",    10,   "Deep sleep with RTC memory and the ULP timer powered (uA)" },
+  { "ulp_ma",      1.5,  "Extra while the ULP is executing (mA)" },
+  { "pulse_ma",    15,   "Extra while a tick pin drives the coil (mA)" },
+  { "cpu_ma",      25,   "Main core awake at 80MHz, radio off (mA)" },
+  { "radio_ma",    80,   "Extra while WiFi is on (mA)" },
+  { "battery_mah", 2000, "Usable battery capacity, for the estimated battery life (mAh)" },
+};
+
+static double model_value(const char* name) {
+  for (const model_t& m : model) if (strcmp(m.name, name) == 0) return m.value;
+  return 0;
+}
+
+// Local time of day (hours since midnight) -> simulated time of its first occurrence after power on
+static int64_t first_at(double hour) {
+  double h = hour - POWER_ON_HOUR;
+  if (h <= 0) h += 24;
+  return (int64_t)(h * HOUR_NS);
+}
+
+// Calls fn at first_ns and every period_ns after that
+static void every(int64_t first_ns, int64_t period_ns, std::function<void()> fn) {
+  at(first_ns, [=]{
+    fn();
+    every(first_ns + period_ns, period_ns, fn);
+  });
+}
+
+static void stable_ap(double days) {
+}
+
+// AP down from 01:00 to 03:00 every night, plus a 10 min dropout every 6 hours
+static void flaky_ap(double days) {
+  every(first_at(1), DAY_NS, []{ env.ap_up = false; });
+  every(first_at(3), DAY_NS, []{ env.ap_up = true; });
+  every(first_at(4.5), 6*HOUR_NS, []{ env.ap_up = false; });
+  every(first_at(4.5) + HOUR_NS/6, 6*HOUR_NS, []{ env.ap_up = true; });
+}
+
+// Time server springs forward an hour at 02:00 a third of the way in, and falls back two thirds of the way in.
+// Each change is announced by the time server from the day before.
+static void dst(double days) {
+  int64_t spring = (int64_t)(days / 3) * DAY_NS + first_at(2);
+  int64_t fall = (int64_t)(days * 2 / 3) * DAY_NS + first_at(2);
+  at(spring - DAY_NS, [spring]{ transition(spring, 3600); });
+  at(fall - DAY_NS, [fall]{ transition(fall, -3600); });
+}
+
+// Battery sags below SUPPLY_VLOW a third of the way in and is replaced a day later
+static void low_battery(double days) {
+  int64_t sag = (int64_t)(days / 3) * DAY_NS + first_at(20);
+  at(sag - 2*DAY_NS, []{ env.vdd_mv = 3600; });
+  at(sag, []{ env.vdd_mv = 3000; });
+  at(sag + DAY_NS, []{ env.vdd_mv = 4800; });
+}
+
+// Button clicked at 08:00 every day to pause the clock, and again 5 mins later to restart it
+static void daily_button(double days) {
+  int64_t click = SIM_NS_PER_SEC * 3 / 10;
+  every(first_at(8), DAY_NS, []{ env.button = true; });
+  every(first_at(8) + click, DAY_NS, []{ env.button = false; });
+  every(first_at(8) + 5*60*SIM_NS_PER_SEC, DAY_NS, []{ env.button = true; });
+  every(first_at(8) + 5*60*SIM_NS_PER_SEC + click, DAY_NS, []{ env.button = false; });
+}
+
+// RTC_SLOW_CLK follows the temperature: 300ppm long from 08:00 to 20:00, 100ppm short overnight
+static void warm_days(double days) {
+  every(first_at(8), DAY_NS, []{ env.rtc_drift = 0.0003; });
+  every(first_at(20), DAY_NS, []{ env.rtc_drift = -0.0001; });
+}
+
+// Member of a fleet whose leader, another clock with a lower ID, shares net time over ESP-NOW (see fleet.h)
+static void fleet_member(double days) {
+  env.form["fleet"] = "hallway";
+  env.peers.resize(1);
+  env.peers[0].id = 1;
+  env.peers[0].leader = true;
+}
+
+static const benchmark_t benchmarks[] = {
+  { "stable_ap",    "Access point and time server always up",              stable_ap },
+  { "flaky_ap",     "Access point down every night and for short dropouts", flaky_ap },
+  { "dst",          "Daylight saving time starts, then ends",              dst },
+  { "low_battery",  "Battery below SUPPLY_VLOW for a day, then replaced",  low_battery },
+  { "daily_button", "Clock paused and restarted with the button every day", daily_button },
+  { "warm_days",    "RTC slow clock drifts with the temperature every day", warm_days },
+  { "fleet_member", "Net time from the leader of a fleet over ESP-NOW",    fleet_member },
+};
+
+// Metrics are per day so that runs of different lengths can be read side by side. Only the costs
+// marked checked are compared against the baseline; the rest explain where a change came from.
+typedef struct {
+  const char* name;
+  int decimals;
+  bool checked;
+} metric_t;
+
+enum { M_MAH, M_WAKES, M_AWAKE_MS, M_RADIO_MS, M_ULP_MS, M_PULSE_MS, M_PULSE_NORMAL_MS, M_PULSE_FWD_MS, M_PULSE_REV_MS,
+  M_FLASH, M_ERR, M_MAX_ERR, M_COUNT };
+
+static const metric_t metrics[M_COUNT] = {
+  { "mah_day", 3, true }, { "wakes_day", 2, true }, { "awake_ms_day", 0, true }, { "radio_ms_day", 0, true },
+  { "ulp_ms_day", 0, true }, { "pulse_ms_day", 0, true }, { "pulse_normal_ms_day", 0, false }, { "pulse_fwd_ms_day", 0, false },
+  { "pulse_rev_ms_day", 0, false }, { "flash_day", 2, false }, { "err_s", 0, false }, { "max_err_s", 0, false },
+};
+
+typedef struct {
+  char name[32];
+  double days;
+  double values[M_COUNT];
+  bool found;
+} result_t;
+
+static void run_benchmark(const benchmark_t* b, double days, result_t* r) {
+  env.form["clockTime"] = "100000";
+  env.form["timezone"] = "UTC";
+  if (verbose) env.form["syslog"] = "syslog";
+  b->script(days);
+  power_on();
+  int64_t minutes = (int64_t)(days * 24 * 60), max_error = 0;
+  for (int64_t m = 1; m <= minutes; m++) {
+    run(m * 60 * SIM_NS_PER_SEC);
+    if (m > 60 && abs(clock_error_s()) > max_error) max_error = abs(clock_error_s());
+  }
+
+  double hours = days * 24, ms = 1e6 * days;
+  double awake_h = stats.awake_ns / 3.6e12, radio_h = stats.radio_on_ns / 3.6e12, ulp_h = stats.ulp_active_ns / 3.6e12;
+  int64_t pulse_ns = stats.pulse_on_ns[TICK_NORMAL] + stats.pulse_on_ns[TICK_FWD] + stats.pulse_on_ns[TICK_REV];
+  double mah = model_value("sleep_ua") / 1000 * (hours - awake_h) + model_value("ulp_ma") * ulp_h +
+    model_value("pulse_ma") * pulse_ns / 3.6e12 + model_value("cpu_ma") * awake_h + model_value("radio_ma") * radio_h;
+
+  snprintf(r->name, sizeof(r->name), "%s", b->name);
+  r->days = days;
+  r->values[M_MAH] = mah / days;
+  r->values[M_WAKES] = stats.wakes / days;
+  r->values[M_AWAKE_MS] = stats.awake_ns / ms;
+  r->values[M_RADIO_MS] = stats.radio_on_ns / ms;
+  r->values[M_ULP_MS] = stats.ulp_active_ns / ms;
+  r->values[M_PULSE_MS] = pulse_ns / ms;
+  r->values[M_PULSE_NORMAL_MS] = stats.pulse_on_ns[TICK_NORMAL] / ms;
+  r->values[M_PULSE_FWD_MS] = stats.pulse_on_ns[TICK_FWD] / ms;
+  r->values[M_PULSE_REV_MS] = stats.pulse_on_ns[TICK_REV] / ms;
+  r->values[M_FLASH] = stats.flash_writes / days;
+  r->values[M_ERR] = clock_error_s();
+  r->values[M_MAX_ERR] = max_error;
+  r->found = true;
+}
+
+static void format_result(const result_t* r, char* buf, size_t size) {
+  int len = snprintf(buf, size, "%s days=%g", r->name, r->days);
+  for (int i=0; i<M_COUNT; i++) len += snprintf(buf + len, size - len, " %s=%.*f", metrics[i].name, metrics[i].decimals, r->values[i]);
+}
+
+// Parses a line written by format_result(); blank lines and # comments are skipped
+static bool parse_result(const char* line, result_t* r) {
+  memset(r, 0, sizeof(*r));
+  char buf[512];
+  snprintf(buf, sizeof(buf), "%s", line);
+  char* save = NULL;
+  char* tok = strtok_r(buf, " \t\r\n", &save);
+  if (tok == NULL || tok[0] == '#') return false;
+  snprintf(r->name, sizeof(r->name), "%s", tok);
+  while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+    char* eq = strchr(tok, '=');
+    if (eq == NULL) continue;
+    *eq = 0;
+    if (strcmp(tok, "days") == 0) r->days = atof(eq+1);
+    for (int i=0; i<M_COUNT; i++) if (strcmp(tok, metrics[i].name) == 0) r->values[i] = atof(eq+1);
+  }
+  r->found = r->days > 0;
+  return r->found;
+}
+
+static std::vector<result_t> load_baseline(const char* path) {
+  std::vector<result_t> results;
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return results;
+  char line[512];
+  result_t r;
+  while (fgets(line, sizeof(line), f) != NULL) if (parse_result(line, &r)) results.push_back(r);
+  fclose(f);
+  return results;
+}
+
+// Baseline lines for benchmarks that were not run are kept
+static bool save_baseline(const char* path, const std::vector<result_t>& results) {
+  std::vector<result_t> merged = load_baseline(path);
+  for (const result_t& r : results) {
+    if (!r.found) continue;
+    bool replaced = false;
+    for (result_t& m : merged) if (strcmp(m.name, r.name) == 0 && m.days == r.days) { m = r; replaced = true; }
+    if (!replaced) merged.push_back(r);
+  }
+  FILE* f = fopen(path, "w");
+  if (f == NULL) return false;
+  fprintf(f, "# Written by the native_bench build with -w; see \"Battery Life Benchmark\" in README.md\n#");
+  for (const model_t& m : model) fprintf(f, " %s=%g", m.name, m.value);
+  fprintf(f, "\n");
+  char line[512];
+  for (const result_t& r : merged) {
+    format_result(&r, line, sizeof(line));
+    fprintf(f, "%s\n", line);
+  }
+  fclose(f);
+  return true;
+}
+
+// Returns the number of checked metrics that grew by more than tolerance percent
+static int compare(const result_t* r, const std::vector<result_t>& baseline, double tolerance) {
+  const result_t* base = NULL;
+  for (const result_t& b : baseline) if (strcmp(b.name, r->name) == 0 && b.days == r->days) base = &b;
+  if (base == NULL) {
+    printf("  (no baseline)\n");
+    return 0;
+  }
+  int regressions = 0;
+  for (int i=0; i<M_COUNT; i++) {
+    double old = base->values[i], now = r->values[i];
+    if (!metrics[i].checked || now <= old * (1 + tolerance / 100)) continue;
+    printf("  REGRESSION %s: %.*f -> %.*f (%+.1f%%)\n", metrics[i].name, metrics[i].decimals, old, metrics[i].decimals, now,
+      old > 0 ? (now - old) * 100 / old : 100.0);
+    regressions++;
+  }
+  return regressions;
+}
+
+int main(int argc, char** argv) {
+  std::vector<double> lengths;
+  std::vector<const benchmark_t*> selected;
+  const char* baseline_path = DEF_BASELINE;
+  double tolerance = DEF_TOLERANCE;
+  bool update = false;
+  int jobs = 1;
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-v") == 0) verbose = true;
+    else if (strcmp(argv[i], "-w") == 0) update = true;
+    else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) jobs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-b") == 0 && i+1 < argc) baseline_path = argv[++i];
+    else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) tolerance = atof(argv[++i]);
+    else if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+      for (char* s = strtok(argv[++i], ","); s != NULL; s = strtok(NULL, ",")) lengths.push_back(atof(s));
+    }
+    else if (strcmp(argv[i], "-m") == 0 && i+1 < argc) {
+      char* eq = strchr(argv[++i], '=');
+      model_t* found = NULL;
+      if (eq != NULL) for (model_t& m : model) if (strncmp(argv[i], m.name, eq - argv[i]) == 0 && m.name[eq - argv[i]] == 0) found = &m;
+      if (found == NULL) {
+        fprintf(stderr, "Unknown model figure %s; available:\n", argv[i]);
+        for (const model_t& m : model) fprintf(stderr, "  %-12s %-6g %s\n", m.name, m.value, m.description);
+        return 2;
+      }
+      found->value = atof(eq+1);
+    }
+    else {
+      const benchmark_t* found = NULL;
+      for (const benchmark_t& b : benchmarks) if (strcmp(argv[i], b.name) == 0) found = &b;
+      if (found == NULL) {
+        fprintf(stderr, "Unknown benchmark %s; available:\n", argv[i]);
+        for (const benchmark_t& b : benchmarks) fprintf(stderr, "  %-14s %s\n", b.name, b.description);
+        return 2;
+      }
+      selected.push_back(found);
+    }
+  }
+  if (lengths.empty()) lengths.push_back(30);
+  if (selected.empty()) for (const benchmark_t& b : benchmarks) selected.push_back(&b);
+  if (jobs < 1) jobs = 1;
+
+  // Each run sends its result back through a pipe
+  typedef struct { const benchmark_t* b; double days; pid_t pid; int fd; result_t result; } run_t;
+  std::vector<run_t> runs;
+  for (double days : lengths) for (const benchmark_t* b : selected) runs.push_back({ b, days, -1, -1, {} });
+  size_t started = 0, running = 0;
+  while (started < runs.size() || running > 0) {
+    if (started < runs.size() && running < (size_t)jobs) {
+      run_t& run = runs[started++];
+      int fds[2];
+      if (pipe(fds) < 0) { perror("pipe"); return 2; }
+      fflush(stdout);
+      run.pid = fork();
+      if (run.pid == 0) {
+        close(fds[0]);
+        result_t r = {};
+        run_benchmark(run.b, run.days, &r);
+        if (write(fds[1], &r, sizeof(r)) != sizeof(r)) exit(1);
+        exit(0);
+      }
+      close(fds[1]);
+      run.fd = fds[0];
+      if (run.pid > 0) running++;
+      continue;
+    }
+    pid_t pid = wait(NULL);
+    for (run_t& run : runs) {
+      if (pid <= 0 || run.pid != pid) continue;
+      if (read(run.fd, &run.result, sizeof(run.result)) != sizeof(run.result)) run.result.found = false;
+      close(run.fd);
+      running--;
+    }
+  }
+
+  printf("Current model:");
+  for (const model_t& m : model) printf(" %s=%g", m.name, m.value);
+  printf("\n");
+  std::vector<result_t> baseline = update ? std::vector<result_t>() : load_baseline(baseline_path);
+  std::vector<result_t> results;
+  int failed = 0;
+  char line[512];
+  for (run_t& run : runs) {
+    if (!run.result.found) {
+      printf("%s days=%g FAILED to run\n", run.b->name, run.days);
+      failed++;
+      continue;
+    }
+    format_result(&run.result, line, sizeof(line));
+    printf("%s life=%.0fd\n", line, model_value("battery_mah") / run.result.values[M_MAH]);
+    if (!update && !baseline.empty()) failed += compare(&run.result, baseline, tolerance);
+    results.push_back(run.result);
+  }
+  if (update && !save_baseline(baseline_path, results)) {
+    perror(baseline_path);
+    return 2;
+  }
+  if (failed > 0) printf("%d failure(s) against %s\n", failed, baseline_path);
+  return failed > 0 ? 1 : 0;
+}
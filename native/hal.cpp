@@ -0,0 +1,1062 @@
+/*
+ * hal.cpp
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <climits>
+#include "sim.h"
+#include "ulpdefs.h"
+
+// Simulated costs of main core operations that do not go through delay()
+#define BOOT_MS                 250       // Deep sleep wakeup to setup()
+#define FS_MOUNT_MS             20
+#define WIFI_FAIL_MS            5000      // Failed association attempt before the portal opens
+#define WIFI_RESTORE_MS         50
+#define UDP_SEND_MS             2
+#define FLASH_ERASE_SECTOR_MS   40        // 4KB sector erased by esp_ota_begin()
+#define FLASH_WRITE_KB_US       2500
+#define APP_PARTITION_SIZE      0x140000  // app0/app1 in the default partition table
+#define UPDATE_CHUNK_BYTES      1460      // Update server responses arrive one TCP segment at a time
+#define DELTA_BLOCK             16        // Shortest copy looked for by the update server's delta encoder
+#define DELTA_SIG_SIZE          72        // OTA_SIG_SIZE in ota.h
+#define AP_CHANNEL              1
+#define PEER_WINDOW_NS          (7200*SIM_NS_PER_SEC)   // DEF_SYNC_MAX; the protocol times below are those of fleet.h
+#define PEER_LEAD_NS            (6*SIM_NS_PER_SEC)
+#define PEER_GUARD_NS           (3*SIM_NS_PER_SEC)
+#define PEER_BEACON_NS          (20*SIM_NS_PER_MS)
+#define PEER_LISTEN_NS          (60*SIM_NS_PER_MS)
+#define PEER_SYNC_NS            (2*SIM_NS_PER_SEC)      // WiFi sync of a peer before it beacons
+
+uint32_t sim_rtc_slow_mem[2048];
+
+struct esp_timer {
+  esp_timer_cb_t callback;
+  void* arg;
+  int64_t due_ns;                         // -1 when not running
+};
+
+HardwareSerial Serial;
+EspClass ESP;
+EEPROMClass EEPROM;
+WiFiClass WiFi;
+fs::LittleFSFS LittleFS;
+
+namespace sim {
+
+  Env env;
+  Stats stats;
+  int64_t now_ns = 0;
+  bool verbose = false;
+
+  static int64_t boot_ns = 0, radio_since_ns = -1;
+  static esp_sleep_wakeup_cause_t cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+  static bool ulp_wakeup_enabled = false, wdt_enabled = false, asleep = false;
+  static bool wifi_credentials = false, wifi_connected = false;
+  static std::multimap<int64_t, std::function<void()>> events;
+  static std::vector<esp_timer*> timers;
+  static std::map<std::string, std::string> flash;
+  static std::map<uint32_t, uint32_t> peri_regs;
+  static std::string app_images[2];
+  static int running_app = 0, boot_app = 0;
+
+  // Constructed on first use since global library objects register their hooks during static initialization
+  static std::vector<std::function<void()>>& reset_hooks() {
+    static std::vector<std::function<void()>> hooks;
+    return hooks;
+  }
+
+  void on_reset(std::function<void()> fn) {
+    reset_hooks().push_back(fn);
+  }
+
+  // Called by the ULP emulator mid-slot with now_ns still at the start of the slot, so each event is fired at its
+  // own time; what it schedules is then relative to that
+  void fire_events_until(int64_t ns) {
+    int64_t slot_ns = now_ns;
+    while (!events.empty() && events.begin()->first <= ns) {
+      std::function<void()> fn = events.begin()->second;
+      now_ns = std::max(slot_ns, events.begin()->first);
+      events.erase(events.begin());
+      fn();
+    }
+    now_ns = slot_ns;
+  }
+
+  int64_t next_event_ns() {
+    return events.empty() ? LLONG_MAX : events.begin()->first;
+  }
+
+  static esp_timer* next_timer() {
+    esp_timer* next = NULL;
+    for (esp_timer* t : timers) if (t->due_ns >= 0 && (next == NULL || t->due_ns < next->due_ns)) next = t;
+    return next;
+  }
+
+  // Deep sleep and reset stop every esp_timer
+  static void stop_timers() {
+    for (esp_timer* t : timers) t->due_ns = -1;
+  }
+
+  // Run the ULP, scripted events and esp_timer callbacks up to the target time. A callback may not return (eg. it
+  // enters deep sleep), so it only runs between ULP slots.
+  void advance_ns(int64_t ns) {
+    int64_t target = now_ns + ns;
+    while (true) {
+      int64_t slot = ulp_running() ? ulp_next_slot_ns() : LLONG_MAX;
+      int64_t event = next_event_ns();
+      esp_timer* timer = next_timer();
+      if (timer != NULL && timer->due_ns <= std::min(std::min(slot, event), target)) {
+        now_ns = std::max(now_ns, timer->due_ns);
+        timer->due_ns = -1;
+        timer->callback(timer->arg);
+        continue;
+      }
+      if (std::min(slot, event) > target) break;
+      if (event <= slot) {
+        now_ns = std::max(now_ns, event);
+        fire_events_until(now_ns);
+      } else {
+        now_ns = std::max(now_ns, slot);
+        ulp_run_slot();
+      }
+    }
+    now_ns = std::max(now_ns, target);
+  }
+
+  // Deep sleep until the ULP wakes the main core; returns false if until_ns is reached first
+  static bool sleep_until_wake(int64_t until_ns) {
+    ulp_clear_wake();
+    while (true) {
+      int64_t slot = ulp_running() ? ulp_next_slot_ns() : LLONG_MAX;
+      int64_t event = next_event_ns();
+      if (std::min(slot, event) >= until_ns) {
+        now_ns = std::max(now_ns, until_ns);
+        return false;
+      }
+      if (event <= slot) {
+        now_ns = std::max(now_ns, event);
+        fire_events_until(now_ns);
+      } else {
+        now_ns = std::max(now_ns, slot);
+        ulp_run_slot();
+        if (ulp_wakeup_enabled && ulp_wake_requested()) return true;
+      }
+    }
+  }
+
+  int64_t true_time_s() {
+    return (env.local_time_s + now_ns / SIM_NS_PER_SEC) % 86400;
+  }
+
+  int clock_error_s() {
+    int clk = (RTC_SLOW_MEM[VAR_CLK_HH] & 0xffff) * 3600 + (RTC_SLOW_MEM[VAR_CLK_MM] & 0xffff) * 60 + (RTC_SLOW_MEM[VAR_CLK_SS] & 0xffff);
+    int net = (int)(((true_time_s() + env.server_skew_s) % 43200 + 43200) % 43200);
+    int diff = (clk - net) % 43200;
+    if (diff > 21600) diff -= 43200;
+    if (diff < -21600) diff += 43200;
+    return diff;
+  }
+
+  void at(int64_t at_ns, std::function<void()> fn) {
+    events.insert(std::make_pair(at_ns, fn));
+  }
+
+  void transition(int64_t at_ns, int shift_s) {
+    env.transition_ns = at_ns;
+    env.transition_s = shift_s;
+    at(at_ns, [shift_s]{
+      env.server_skew_s += shift_s;
+      for (auto& server : env.servers) server.second.skew_s += shift_s;
+      env.transition_ns = -1;
+    });
+  }
+
+  void radio_on() {
+    if (radio_since_ns < 0) radio_since_ns = now_ns;
+  }
+
+  void radio_off() {
+    if (radio_since_ns >= 0) stats.radio_on_ns += now_ns - radio_since_ns;
+    radio_since_ns = -1;
+    wifi_connected = false;
+  }
+
+  bool radio_is_on() {
+    return radio_since_ns >= 0;
+  }
+
+  bool wifi_up() {
+    return wifi_connected && env.ap_up;
+  }
+
+  void set_wifi_connected(bool connected) {
+    wifi_connected = connected;
+  }
+
+  bool has_wifi_credentials() {
+    return wifi_credentials;
+  }
+
+  void set_wifi_credentials(bool stored) {
+    wifi_credentials = stored;
+  }
+
+  std::map<std::string, std::string>& flash_files() {
+    return flash;
+  }
+
+  int64_t boot_time_ns() {
+    return boot_ns;
+  }
+
+  std::string& app_partition(int index) {
+    return app_images[index];
+  }
+
+  int running_partition() {
+    return running_app;
+  }
+
+  void set_boot_partition(int index) {
+    boot_app = index;
+  }
+
+  // Keyed SHA-256 in place of an ECDSA signature
+  std::string ota_signature(const std::string& key, const uint8_t* hash) {
+    uint8_t sig[32];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_starts_ret(&sha, 0);
+    mbedtls_sha256_update_ret(&sha, (const uint8_t*)key.data(), key.size());
+    mbedtls_sha256_update_ret(&sha, hash, 32);
+    mbedtls_sha256_finish_ret(&sha, sig);
+    return std::string((const char*)sig, sizeof(sig));
+  }
+
+  // Stands in for the ELF SHA-256 of the image: 64-bit FNV-1a of its contents as 16 hex digits
+  std::string image_id(const std::string& image) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : image) hash = (hash ^ c) * 0x100000001b3ULL;
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return hex;
+  }
+
+  void power_on() {
+    memset(sim_rtc_slow_mem, 0, sizeof(sim_rtc_slow_mem));
+    app_images[0] = env.firmware.empty() ? std::string() : env.firmware[0];
+    app_images[1].clear();
+    running_app = boot_app = 0;
+    ulp_reset();
+    cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    peers_start();
+  }
+
+  esp_sleep_wakeup_cause_t wake_cause() {
+    return cause;
+  }
+
+  bool main_core_asleep() {
+    return asleep;
+  }
+
+  void set_ulp_wakeup(bool enabled) {
+    ulp_wakeup_enabled = enabled;
+  }
+
+  void set_wdt(bool enabled) {
+    wdt_enabled = enabled;
+  }
+
+  // Boot the main core repeatedly until until_ns: setup() always ends in deep sleep or a reset.
+  // A run that ends while the main core is in deep sleep resumes sleeping on the next call.
+  void run(int64_t until_ns) {
+    while (now_ns < until_ns) {
+      if (asleep) {
+        if (!sleep_until_wake(until_ns)) return;
+        asleep = false;
+        cause = ESP_SLEEP_WAKEUP_ULP;
+      }
+      boot_ns = now_ns;
+      stats.wakes++;
+      ulp_wakeup_enabled = false;
+      stop_timers();
+      try {
+        advance_ms(BOOT_MS);
+        setup();
+        stats.awake_ns += now_ns - boot_ns;
+        radio_off();
+        return;
+      } catch (DeepSleep&) {
+        stats.awake_ns += now_ns - boot_ns;
+        if (cause == ESP_SLEEP_WAKEUP_ULP) stats.max_ulp_wake_ns = std::max(stats.max_ulp_wake_ns, now_ns - boot_ns);
+        radio_off();
+        stop_timers();
+        asleep = true;
+      } catch (Reset&) {
+        stats.awake_ns += now_ns - boot_ns;
+        stats.resets++;
+        radio_off();
+        stop_timers();
+        for (std::function<void()>& fn : reset_hooks()) fn();
+        running_app = boot_app;
+        ulp_reset();
+        cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+      }
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// Peripheral registers
+/////////////////////////////////////////////////////////////////////////////////
+void sim_write_peri_reg(uint32_t reg, uint32_t value) {
+  sim::peri_regs[reg] = value;
+}
+
+uint32_t sim_read_peri_reg(uint32_t reg) {
+  return sim::peri_regs[reg];
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// GPIO, RTC IO and ADC drivers
+/////////////////////////////////////////////////////////////////////////////////
+esp_err_t rtc_gpio_init(gpio_num_t pin) { (void)pin; return ESP_OK; }
+esp_err_t rtc_gpio_set_direction(gpio_num_t pin, rtc_gpio_mode_t mode) { (void)pin; (void)mode; return ESP_OK; }
+esp_err_t rtc_gpio_set_drive_capability(gpio_num_t pin, gpio_drive_cap_t cap) { (void)pin; (void)cap; return ESP_OK; }
+esp_err_t rtc_gpio_set_level(gpio_num_t pin, uint32_t level) { (void)pin; (void)level; return ESP_OK; }
+esp_err_t rtc_gpio_isolate(gpio_num_t pin) { (void)pin; return ESP_OK; }
+esp_err_t adc1_config_width(adc_bits_width_t width) { (void)width; return ESP_OK; }
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten) { (void)channel; (void)atten; return ESP_OK; }
+int adc1_get_raw(adc1_channel_t channel) { (void)channel; return sim::adc_raw_vdd(); }
+void adc1_ulp_enable() {}
+
+int esp_adc_cal_characterize(adc_unit_t unit, adc_atten_t atten, adc_bits_width_t width, uint32_t vref, esp_adc_cal_characteristics_t* chars) {
+  (void)unit; (void)atten; (void)width;
+  chars->coeff_a = 3300; chars->coeff_b = 0; chars->vref = vref;
+  return 0;
+}
+
+uint32_t esp_adc_cal_raw_to_voltage(uint32_t raw, const esp_adc_cal_characteristics_t* chars) {
+  return raw * chars->coeff_a / 4095 + chars->coeff_b;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// RTC clock, watchdog and sleep
+/////////////////////////////////////////////////////////////////////////////////
+uint32_t rtc_clk_cal(rtc_cal_sel_t cal_clk, uint32_t slow_clk_cycles) {
+  (void)slow_clk_cycles;
+  if (cal_clk == RTC_CAL_RTC_MUX) return (1000000ULL << RTC_CLK_CAL_FRACT) / 150000; // RTC_SLOW_CLK as in ulpsim.cpp
+  return 32U << RTC_CLK_CAL_FRACT; // 8MHz/256 => 32us per cycle
+}
+
+void rtc_wdt_protect_off() {}
+void rtc_wdt_protect_on() {}
+void rtc_wdt_disable() { sim::set_wdt(false); }
+void rtc_wdt_enable() { sim::advance_ms(500); throw sim::Reset(); }
+esp_err_t rtc_wdt_set_length_of_reset_signal(rtc_wdt_reset_sig_t sig, rtc_wdt_length_sig_t length) { (void)sig; (void)length; return ESP_OK; }
+esp_err_t rtc_wdt_set_stage(rtc_wdt_stage_t stage, rtc_wdt_stage_action_t action) { (void)stage; (void)action; return ESP_OK; }
+esp_err_t rtc_wdt_set_time(rtc_wdt_stage_t stage, unsigned int timeout_ms) { (void)stage; (void)timeout_ms; return ESP_OK; }
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause() { return sim::wake_cause(); }
+esp_err_t esp_sleep_pd_config(esp_sleep_pd_domain_t domain, esp_sleep_pd_option_t option) { (void)domain; (void)option; return ESP_OK; }
+esp_err_t esp_sleep_enable_ulp_wakeup() { sim::set_ulp_wakeup(true); return ESP_OK; }
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us) { (void)time_in_us; return ESP_OK; }
+void esp_deep_sleep_start() { throw sim::DeepSleep(); }
+void esp_deep_sleep_disable_rom_logging() {}
+int64_t esp_timer_get_time() { return (sim::now_ns - sim::boot_time_ns()) / SIM_NS_PER_US; }
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* out_handle) {
+  *out_handle = new esp_timer{ args->callback, args->arg, -1 };
+  sim::timers.push_back(*out_handle);
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  if (timer->due_ns >= 0) return ESP_ERR_INVALID_STATE;
+  timer->due_ns = sim::now_ns + (int64_t)timeout_us * SIM_NS_PER_US;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  if (timer->due_ns < 0) return ESP_ERR_INVALID_STATE;
+  timer->due_ns = -1;
+  return ESP_OK;
+}
+
+esp_err_t ulp_run(uint32_t entry_point) {
+  sim::ulp_start(entry_point);
+  return ESP_OK;
+}
+
+esp_err_t ulp_set_wakeup_period(size_t period_index, uint32_t period_us) {
+  (void)period_index;
+  sim::ulp_set_period_us(period_us);
+  return ESP_OK;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// OTA partitions and ROM CRC
+/////////////////////////////////////////////////////////////////////////////////
+static const esp_partition_t app_partitions[2] = {
+  { 0x10000, APP_PARTITION_SIZE, "app0" },
+  { 0x10000 + APP_PARTITION_SIZE, APP_PARTITION_SIZE, "app1" },
+};
+static int ota_target = -1;
+static bool ota_valid[2];
+
+const esp_partition_t* esp_ota_get_running_partition() { return &app_partitions[sim::running_partition()]; }
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start_from) {
+  (void)start_from;
+  return &app_partitions[1 - sim::running_partition()];
+}
+
+// Erased flash reads as 0xff
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size) {
+  if (src_offset + size > partition->size) return ESP_ERR_INVALID_SIZE;
+  const std::string& image = sim::app_partition(partition - app_partitions);
+  memset(dst, 0xff, size);
+  if (src_offset < image.size()) memcpy(dst, image.data() + src_offset, std::min(size, image.size() - src_offset));
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t image_size, esp_ota_handle_t* out_handle) {
+  int index = partition - app_partitions;
+  if (index == sim::running_partition() || image_size > partition->size) return ESP_ERR_INVALID_ARG;
+  sim::advance_ms((image_size + 4095) / 4096 * FLASH_ERASE_SECTOR_MS);
+  sim::app_partition(index).clear();
+  ota_valid[index] = false;
+  ota_target = index;
+  *out_handle = 1;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size) {
+  if (handle != 1 || ota_target < 0) return ESP_ERR_INVALID_ARG;
+  sim::app_partition(ota_target).append((const char*)data, size);
+  sim::advance_ns((int64_t)size * FLASH_WRITE_KB_US * SIM_NS_PER_US / 1024);
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+  if (handle != 1 || ota_target < 0) return ESP_ERR_INVALID_ARG;
+  ota_valid[ota_target] = !sim::app_partition(ota_target).empty();
+  esp_err_t rc = ota_valid[ota_target] ? ESP_OK : ESP_ERR_OTA_VALIDATE_FAILED;
+  ota_target = -1;
+  return rc;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+  if (handle != 1 || ota_target < 0) return ESP_ERR_INVALID_ARG;
+  sim::app_partition(ota_target).clear();
+  ota_target = -1;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition) {
+  int index = partition - app_partitions;
+  if (!ota_valid[index]) return ESP_ERR_OTA_VALIDATE_FAILED;
+  sim::set_boot_partition(index);
+  return ESP_OK;
+}
+
+int esp_ota_get_app_elf_sha256(char* dst, size_t size) {
+  std::string id = sim::image_id(sim::app_partition(sim::running_partition()));
+  size_t n = std::min(size - 1, id.size());
+  memcpy(dst, id.data(), n);
+  dst[n] = 0;
+  return n + 1;
+}
+
+// Same as the ESP32 ROM: CRC-32 as used by zlib, chained through crc
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (int i=0; i<8; i++) crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// Arduino core
+/////////////////////////////////////////////////////////////////////////////////
+void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+
+int digitalRead(uint8_t pin) {
+  if (pin == GPIO_NUM_4) return sim::env.button ? LOW : HIGH;
+  return LOW;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) { (void)pin; (void)val; }
+void delay(uint32_t ms) { sim::advance_ms(ms); }
+unsigned long millis() { return (unsigned long)(esp_timer_get_time() / 1000); }
+long random(long howsmall, long howbig) { return howsmall + rand() % (howbig - howsmall); }
+bool setCpuFrequencyMhz(uint32_t mhz) { (void)mhz; return true; }
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (sim::verbose) fputc(c, stdout);
+  return 1;
+}
+
+uint64_t EspClass::getEfuseMac() { return 0x0000A1B2C3D4E5F6ULL; }
+void EspClass::restart() { throw sim::Reset(); }
+
+/////////////////////////////////////////////////////////////////////////////////
+// Filesystem
+/////////////////////////////////////////////////////////////////////////////////
+File::File(const std::string& path, const char* mode) : _path(path), _open(true) {
+  _write = mode[0] != 'r';
+  if (!_write || mode[0] == 'a') _data = sim::flash_files()[path];
+  if (!_write) _open = sim::flash_files().count(path) > 0;
+  else if (mode[0] == 'a') _pos = _data.size();
+}
+
+size_t File::read(uint8_t* buf, size_t size) {
+  size_t n = std::min(size, (size_t)available());
+  memcpy(buf, _data.data() + _pos, n);
+  _pos += n;
+  return n;
+}
+
+size_t File::write(uint8_t c) {
+  if (!_open || !_write) return 0;
+  _data.push_back((char)c);
+  return 1;
+}
+
+size_t File::write(const uint8_t* buf, size_t size) {
+  if (!_open || !_write) return 0;
+  _data.append((const char*)buf, size);
+  return size;
+}
+
+void File::close() {
+  if (_open && _write) {
+    sim::advance_ms(sim::env.fs_write_ms); // A write cut short by deep sleep leaves the old contents in place
+    sim::flash_files()[_path] = _data;
+    sim::stats.flash_writes++;
+  }
+  _open = false;
+}
+
+namespace fs {
+  bool LittleFSFS::begin(bool format_on_fail) { (void)format_on_fail; sim::advance_ms(FS_MOUNT_MS); return true; }
+  bool LittleFSFS::exists(const char* path) { return sim::flash_files().count(path) > 0; }
+  File LittleFSFS::open(const char* path, const char* mode) { return File(path, mode); }
+  bool LittleFSFS::remove(const char* path) { return sim::flash_files().erase(path) > 0; }
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// WiFi and UDP
+/////////////////////////////////////////////////////////////////////////////////
+esp_err_t esp_wifi_init(const wifi_init_config_t* config) { (void)config; return ESP_OK; }
+esp_err_t esp_wifi_restore() { sim::set_wifi_credentials(false); sim::advance_ms(WIFI_RESTORE_MS); return ESP_OK; }
+esp_err_t esp_wifi_stop() { sim::radio_off(); return ESP_OK; }
+
+bool IPAddress::fromString(const char* s) {
+  unsigned a, b, c, d;
+  if (sscanf(s, "%u.%u.%u.%u", &a, &b, &c, &d) != 4) return false;
+  *this = IPAddress(a, b, c, d);
+  return true;
+}
+
+// Boot in which the last WiFi.begin() gave up, as the driver does when it cannot find the access point
+static int64_t wifi_failed_boot_ns = -1;
+
+wl_status_t WiFiClass::begin() {
+  sim::radio_on();
+  wifi_failed_boot_ns = -1;
+  // Connected after env.wifi_connect_ms in the same boot if the radio is still on and the AP up by then, otherwise
+  // failed after WIFI_FAIL_MS as with autoConnect()
+  int64_t boot_ns = sim::boot_time_ns();
+  if (sim::has_wifi_credentials() && sim::env.ap_up && sim::env.wifi_connect_ms <= WIFI_FAIL_MS) {
+    sim::at(sim::now_ns + sim::env.wifi_connect_ms * SIM_NS_PER_MS, [boot_ns]{
+      if (sim::boot_time_ns() != boot_ns || !sim::radio_is_on() || !sim::env.ap_up) return;
+      sim::stats.wifi_connects++;
+      sim::set_wifi_connected(true);
+    });
+  } else {
+    sim::at(sim::now_ns + WIFI_FAIL_MS * SIM_NS_PER_MS, [boot_ns]{
+      if (sim::boot_time_ns() == boot_ns && sim::radio_is_on()) wifi_failed_boot_ns = boot_ns;
+    });
+  }
+  return WL_DISCONNECTED;
+}
+
+wl_status_t WiFiClass::status() {
+  if (sim::wifi_up()) return WL_CONNECTED;
+  return wifi_failed_boot_ns == sim::boot_time_ns() ? WL_NO_SSID_AVAIL : WL_DISCONNECTED;
+}
+String WiFiClass::macAddress() { return String("A1:B2:C3:D4:E5:F6"); }
+bool WiFiClass::mode(wifi_mode_t mode) { if (mode == WIFI_OFF) sim::radio_off(); else sim::radio_on(); return true; }
+bool WiFiClass::disconnect(bool wifioff) { sim::set_wifi_connected(false); if (wifioff) sim::radio_off(); return true; }
+int WiFiClass::channel() { return 1; }
+
+int WiFiUDP::beginPacket(const char* host, uint16_t port) { (void)host; _buf.clear(); _port = port; return 1; }
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) { (void)ip; _buf.clear(); _port = port; return 1; }
+
+int WiFiUDP::endPacket() {
+  if (!sim::wifi_up()) return 0;
+  sim::stats.syslog_packets++;
+  sim::advance_ms(UDP_SEND_MS);
+  if (sim::verbose) printf("[udp:%d] %s\n", _port, _buf.c_str());
+  return 1;
+}
+
+// Time server answer: "HH:MM:SS" in 12-hr format, as returned by now.php, followed by the next change of UTC offset if one is scripted
+static String server_body(int skew_s, bool garbage) {
+  int64_t t = ((sim::true_time_s() + skew_s) % 86400 + 86400) % 86400;
+  int hh = (int)(t / 3600) % 12;
+  char buf[48];
+  int len = snprintf(buf, sizeof(buf), "%02d:%02d:%02d", hh == 0 ? 12 : hh, (int)(t / 60) % 60, (int)(t % 60));
+  if (sim::env.transition_ns > sim::now_ns) {
+    snprintf(buf + len, sizeof(buf) - len, " %lld %d", (long long)((sim::env.transition_ns - sim::now_ns) / SIM_NS_PER_SEC), sim::env.transition_s);
+  }
+  return garbage ? String("<html><body>Service unavailable</body></html>") : String(buf);
+}
+
+static void put_varint(std::string& out, uint32_t v) {
+  while (v >= 0x80) {
+    out.push_back((char)((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out.push_back((char)v);
+}
+
+static void put_u32(std::string& out, uint32_t v) {
+  for (int i=0; i<4; i++) out.push_back((char)(v >> (i*8)));
+}
+
+// Delta from src to dst in the format of ota.h, the same as otaserver.py: every DELTA_BLOCK-aligned block of src is
+// indexed, and at each position of dst a matching block is extended both ways into a copy. It is signed with
+// sim::env.ota_key.
+static std::string delta_encode(const std::string& src, const std::string& dst) {
+  std::map<std::string, uint32_t> blocks;
+  for (size_t i=0; i+DELTA_BLOCK<=src.size(); i+=DELTA_BLOCK) blocks.insert(std::make_pair(src.substr(i, DELTA_BLOCK), (uint32_t)i));
+  std::string ops;
+  size_t literal = 0, i = 0;
+  auto insert = [&](size_t end) {
+    if (end <= literal) return;
+    put_varint(ops, (uint32_t)(end - literal) << 1);
+    ops.append(dst, literal, end - literal);
+  };
+  while (i + DELTA_BLOCK <= dst.size()) {
+    auto match = blocks.find(dst.substr(i, DELTA_BLOCK));
+    if (match == blocks.end()) {
+      i++;
+      continue;
+    }
+    size_t s = match->second, d = i, len = DELTA_BLOCK;
+    while (d > literal && s > 0 && dst[d-1] == src[s-1]) { d--; s--; len++; }
+    while (d + len < dst.size() && s + len < src.size() && dst[d+len] == src[s+len]) len++;
+    insert(d);
+    put_varint(ops, (uint32_t)len << 1 | 1);
+    put_varint(ops, (uint32_t)s);
+    i = literal = d + len;
+  }
+  insert(dst.size());
+  uint8_t hash[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_starts_ret(&sha, 0);
+  mbedtls_sha256_update_ret(&sha, (const uint8_t*)dst.data(), dst.size());
+  mbedtls_sha256_finish_ret(&sha, hash);
+  std::string sig = sim::ota_signature(sim::env.ota_key, hash);
+  std::string delta = "ESPD";
+  put_u32(delta, 24 + DELTA_SIG_SIZE + ops.size());
+  put_u32(delta, src.size());
+  put_u32(delta, dst.size());
+  put_u32(delta, crc32_le(0, (const uint8_t*)dst.data(), dst.size()));
+  put_u32(delta, sig.size());
+  delta += sig + std::string(DELTA_SIG_SIZE - sig.size(), 0);
+  return delta + ops;
+}
+
+// Update server answer to "GET <path>?from=<image id>&offset=<n>": the rest of the delta from that image to the latest one
+// in env.firmware, 204 if it is the latest already or 404 if it is not known
+static std::string update_response(const std::string& request) {
+  static std::map<std::pair<std::string, std::string>, std::string> deltas;
+  size_t from = request.find("from="), offset = request.find("offset=");
+  std::string id = from == std::string::npos ? "" : request.substr(from + 5, request.find_first_of("& ", from) - from - 5);
+  size_t skip = offset == std::string::npos ? 0 : atol(request.c_str() + offset + 7);
+  const std::string* image = NULL;
+  for (const std::string& f : sim::env.firmware) if (sim::image_id(f) == id) image = &f;
+  if (image == NULL) return "HTTP/1.0 404 Not Found\r\n\r\n";
+  const std::string& latest = sim::env.firmware.back();
+  if (image == &latest) return "HTTP/1.0 204 No Content\r\n\r\n";
+  std::string& delta = deltas[std::make_pair(id, sim::image_id(latest))];
+  if (delta.empty()) delta = delta_encode(*image, latest);
+  std::string body = skip < delta.size() ? delta.substr(skip) : std::string();
+  return "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// mbedtls
+/////////////////////////////////////////////////////////////////////////////////
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t ror32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static void sha256_block(mbedtls_sha256_context* ctx) {
+  uint32_t w[64], v[8];
+  for (int i=0; i<16; i++) {
+    w[i] = (uint32_t)ctx->block[i*4] << 24 | (uint32_t)ctx->block[i*4+1] << 16 | (uint32_t)ctx->block[i*4+2] << 8 | ctx->block[i*4+3];
+  }
+  for (int i=16; i<64; i++) {
+    uint32_t s0 = ror32(w[i-15], 7) ^ ror32(w[i-15], 18) ^ (w[i-15] >> 3);
+    uint32_t s1 = ror32(w[i-2], 17) ^ ror32(w[i-2], 19) ^ (w[i-2] >> 10);
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+  memcpy(v, ctx->state, sizeof(v));
+  for (int i=0; i<64; i++) {
+    uint32_t t1 = v[7] + (ror32(v[4], 6) ^ ror32(v[4], 11) ^ ror32(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+    uint32_t t2 = (ror32(v[0], 2) ^ ror32(v[0], 13) ^ ror32(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    memmove(v + 1, v, 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + t2;
+  }
+  for (int i=0; i<8; i++) ctx->state[i] += v[i];
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context* ctx) { memset(ctx, 0, sizeof(*ctx)); }
+void mbedtls_sha256_free(mbedtls_sha256_context* ctx) { (void)ctx; }
+
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context* ctx, int is224) {
+  static const uint32_t init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  if (is224) return -1;
+  memcpy(ctx->state, init, sizeof(init));
+  ctx->total = 0;
+  return 0;
+}
+
+int mbedtls_sha256_update_ret(mbedtls_sha256_context* ctx, const unsigned char* input, size_t ilen) {
+  for (size_t i=0; i<ilen; i++) {
+    ctx->block[ctx->total++ % 64] = input[i];
+    if (ctx->total % 64 == 0) sha256_block(ctx);
+  }
+  return 0;
+}
+
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context* ctx, unsigned char output[32]) {
+  uint64_t bits = ctx->total * 8;
+  uint8_t pad = 0x80;
+  mbedtls_sha256_update_ret(ctx, &pad, 1);
+  pad = 0;
+  while (ctx->total % 64 != 56) mbedtls_sha256_update_ret(ctx, &pad, 1);
+  for (int i=7; i>=0; i--) {
+    pad = (uint8_t)(bits >> (i*8));
+    mbedtls_sha256_update_ret(ctx, &pad, 1);
+  }
+  for (int i=0; i<32; i++) output[i] = (uint8_t)(ctx->state[i/4] >> (24 - (i%4)*8));
+  return 0;
+}
+
+void mbedtls_pk_init(mbedtls_pk_context* ctx) { ctx->key.clear(); }
+void mbedtls_pk_free(mbedtls_pk_context* ctx) { ctx->key.clear(); }
+
+// PEM keys are passed with their terminating NUL, as with mbedtls
+int mbedtls_pk_parse_public_key(mbedtls_pk_context* ctx, const unsigned char* key, size_t keylen) {
+  if (keylen == 0 || key[keylen-1] != 0 || strstr((const char*)key, "-----BEGIN PUBLIC KEY-----") == NULL) {
+    return MBEDTLS_ERR_PK_KEY_INVALID_FORMAT;
+  }
+  ctx->key = (const char*)key;
+  return 0;
+}
+
+int mbedtls_pk_verify(mbedtls_pk_context* ctx, mbedtls_md_type_t md_alg, const unsigned char* hash, size_t hash_len,
+  const unsigned char* sig, size_t sig_len) {
+  if (md_alg != MBEDTLS_MD_SHA256 || hash_len != 32 || ctx->key.empty()) return MBEDTLS_ERR_PK_KEY_INVALID_FORMAT;
+  return sim::ota_signature(ctx->key, hash) == std::string((const char*)sig, sig_len) ? 0 : MBEDTLS_ERR_ECP_VERIFY_FAILED;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// AsyncClient
+/////////////////////////////////////////////////////////////////////////////////
+static sim::Server server_for(const std::string& host) {
+  if (sim::env.servers.count(host)) return sim::env.servers[host];
+  sim::Server server;
+  server.up = sim::env.server_up;
+  server.garbage = sim::env.server_garbage;
+  server.skew_s = sim::env.server_skew_s;
+  server.latency_ms = sim::env.http_latency_ms;
+  return server;
+}
+
+bool AsyncClient::connect(const char* host, uint16_t port) {
+  (void)port;
+  if (!sim::wifi_up()) return false;
+  sim::stats.http_requests++;
+  _host = host;
+  _alive = std::make_shared<bool>(true);
+  std::shared_ptr<bool> alive = _alive;
+  sim::Server server = server_for(_host);
+  if (!server.up) {
+    sim::at(sim::now_ns + 3000 * SIM_NS_PER_MS, [this, alive]() {
+      if (!*alive) return;
+      *alive = false;
+      if (_error_cb) _error_cb(_error_arg, this, -13);
+    });
+    return true;
+  }
+  sim::at(sim::now_ns + server.latency_ms / 2 * SIM_NS_PER_MS, [this, alive]() {
+    if (!*alive) return;
+    _connected = true;
+    if (_connect_cb) _connect_cb(_connect_arg, this);
+  });
+  return true;
+}
+
+size_t AsyncClient::write(const char* data) {
+  std::shared_ptr<bool> alive = _alive;
+  sim::Server server = server_for(_host);
+  if (strstr(data, "from=") != NULL) {
+    // Update request: the response streams in at env.download_bytes_per_ms, so the connection can be cut short
+    std::string response = update_response(data);
+    int64_t t = sim::now_ns + (server.latency_ms - server.latency_ms / 2) * SIM_NS_PER_MS;
+    for (size_t pos=0; pos<response.size(); pos+=UPDATE_CHUNK_BYTES) {
+      std::string chunk = response.substr(pos, UPDATE_CHUNK_BYTES);
+      t += (int64_t)chunk.size() * SIM_NS_PER_MS / sim::env.download_bytes_per_ms;
+      sim::at(t, [this, alive, chunk]() {
+        if (!*alive) return;
+        if (!sim::wifi_up()) {
+          *alive = false;
+          _connected = false;
+          if (_error_cb) _error_cb(_error_arg, this, -14);
+          return;
+        }
+        sim::stats.ota_bytes += chunk.size();
+        if (_data_cb) _data_cb(_data_arg, this, (void*)chunk.data(), chunk.size());
+      });
+    }
+    sim::at(t, [this, alive]() {
+      if (!*alive) return;
+      *alive = false;
+      _connected = false;
+      if (_disconnect_cb) _disconnect_cb(_disconnect_arg, this);
+    });
+    return strlen(data);
+  }
+  sim::at(sim::now_ns + (server.latency_ms - server.latency_ms / 2) * SIM_NS_PER_MS, [this, alive, server]() {
+    if (!*alive) return;
+    std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n" + server_body(server.skew_s, server.garbage);
+    if (_data_cb) _data_cb(_data_arg, this, (void*)response.data(), response.size());
+    *alive = false;
+    _connected = false;
+    if (_disconnect_cb) _disconnect_cb(_disconnect_arg, this);
+  });
+  return strlen(data);
+}
+
+void AsyncClient::close(bool now) {
+  (void)now;
+  if (_alive) *_alive = false;
+  _connected = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// ESP-NOW, and the fleet peers sharing the broadcast medium with the clock
+/////////////////////////////////////////////////////////////////////////////////
+// Same layout as fleet_beacon_t in fleet.h
+typedef struct __attribute__((packed)) {
+  uint32_t magic, fleet, id;
+  uint16_t secs, ms;
+  int32_t transition_secs, transition_shift;
+} peer_beacon_t;
+
+static bool espnow_up = false;
+static esp_now_recv_cb_t espnow_recv_cb = NULL;
+static uint8_t wifi_channel = 0;
+
+// Same as fleet_hash() in fleet.h
+static uint32_t peer_fleet_hash() {
+  std::string key = sim::env.form["fleet"] + "|" + sim::env.form["timezone"];
+  uint32_t hash = 0x811c9dc5;
+  for (unsigned char c : key) hash = (hash ^ c) * 0x01000193;
+  return hash;
+}
+
+// Frame sent by a peer at t_ns; peers have true time plus the time server's skew
+static peer_beacon_t peer_beacon(uint32_t id, int64_t t_ns) {
+  int64_t ms = (sim::env.local_time_s + sim::env.server_skew_s) * 1000 + t_ns / SIM_NS_PER_MS;
+  peer_beacon_t beacon = { 0x54454c46, peer_fleet_hash(), id, (uint16_t)(ms / 1000 % 43200), (uint16_t)(ms % 1000), -1, 0 };
+  if (sim::env.transition_ns > t_ns) {
+    beacon.transition_secs = (int32_t)((sim::env.transition_ns - t_ns) / SIM_NS_PER_SEC);
+    beacon.transition_shift = sim::env.transition_s;
+  }
+  return beacon;
+}
+
+// Deliver a frame to every receiver on the AP channel but its sender (id 0 is the clock)
+static void espnow_broadcast(uint32_t from, const uint8_t* data, size_t len) {
+  static const uint8_t mac[6] = { 0 };
+  uint8_t channel = sim::wifi_up() ? AP_CHANNEL : wifi_channel;
+  if (from != 0 && espnow_up && espnow_recv_cb && sim::radio_is_on() && channel == AP_CHANNEL) {
+    sim::stats.beacons_received++;
+    espnow_recv_cb(mac, data, (int)len);
+  }
+  const peer_beacon_t* beacon = (const peer_beacon_t*)data;
+  if (len != sizeof(peer_beacon_t) || beacon->fleet != peer_fleet_hash()) return;
+  for (sim::Peer& p : sim::env.peers) {
+    if (p.id == beacon->id || !p.up || !p.listening) continue;
+    if (p.heard_id == 0 || beacon->id < p.heard_id) p.heard_id = beacon->id;
+  }
+}
+
+// Peer i beacons every PEER_BEACON_NS from at_ns until until_ns, listening in between, and steps down if it hears a
+// lower ID. Times are worked out from at_ns since events may fire during a ULP slot, before now_ns has caught up.
+static void peer_lead(size_t i, int64_t at_ns, int64_t until_ns) {
+  sim::at(at_ns, [i, at_ns, until_ns]{
+    sim::Peer& p = sim::env.peers[i];
+    p.listening = p.up && p.leader && at_ns < until_ns;
+    if (p.listening && p.heard_id != 0 && p.heard_id < p.id) p.leader = p.listening = false;
+    if (!p.listening) return;
+    peer_beacon_t beacon = peer_beacon(p.id, at_ns);
+    espnow_broadcast(p.id, (const uint8_t*)&beacon, sizeof(beacon));
+    peer_lead(i, at_ns + PEER_BEACON_NS, until_ns);
+  });
+}
+
+// Peer i wakes for the window at w: PEER_LEAD_NS early if it leads, at w to listen for PEER_LISTEN_NS if it follows
+static void peer_window(size_t i, int64_t w) {
+  sim::at(w + PEER_WINDOW_NS - PEER_LEAD_NS, [i, w]{ peer_window(i, w + PEER_WINDOW_NS); });
+  sim::Peer& p = sim::env.peers[i];
+  if (!p.up) return;
+  p.windows++;
+  p.heard_id = 0;
+  if (p.leader) {
+    p.led++;
+    peer_lead(i, w - PEER_LEAD_NS + PEER_SYNC_NS, w + PEER_GUARD_NS);
+    return;
+  }
+  sim::at(w, [i]{ sim::env.peers[i].listening = true; });
+  sim::at(w + PEER_LISTEN_NS, [i, w]{
+    sim::Peer& p = sim::env.peers[i];
+    p.listening = false;
+    if (p.heard_id != 0) {
+      p.heard++;
+    } else if (p.up) {
+      p.missed++;
+      p.leader = true;
+      p.led++;
+      peer_lead(i, w + PEER_LISTEN_NS + PEER_SYNC_NS, w + PEER_GUARD_NS);
+    }
+  });
+}
+
+void sim::peers_start() {
+  int64_t first = (7200 - (env.local_time_s + env.server_skew_s) % 7200) * SIM_NS_PER_SEC;
+  for (size_t i=0; i<env.peers.size(); i++) at(first - PEER_LEAD_NS, [i, first]{ peer_window(i, first); });
+}
+
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second) { (void)second; wifi_channel = primary; return ESP_OK; }
+
+esp_err_t esp_now_init() {
+  if (!sim::radio_is_on()) return ESP_ERR_ESPNOW_NOT_INIT;
+  espnow_up = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_now_deinit() { espnow_up = false; espnow_recv_cb = NULL; return ESP_OK; }
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) { espnow_recv_cb = cb; return espnow_up ? ESP_OK : ESP_ERR_ESPNOW_NOT_INIT; }
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t* peer) { (void)peer; return espnow_up ? ESP_OK : ESP_ERR_ESPNOW_NOT_INIT; }
+
+esp_err_t esp_now_send(const uint8_t* peer_addr, const uint8_t* data, size_t len) {
+  (void)peer_addr;
+  if (!espnow_up || !sim::radio_is_on()) return ESP_ERR_ESPNOW_NOT_INIT;
+  sim::stats.beacons_sent++;
+  espnow_broadcast(0, data, len);
+  return ESP_OK;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// Syslog
+/////////////////////////////////////////////////////////////////////////////////
+Syslog::Syslog(WiFiUDP& client, const char* server, uint16_t port, const char* device_hostname, const char* app_name,
+  uint16_t priDefault, uint8_t protocol) : _client(client), _server(server), _hostname(device_hostname), _port(port) {
+  (void)app_name; (void)priDefault; (void)protocol;
+}
+
+bool Syslog::log(const char* message) {
+  _client.beginPacket(_server.c_str(), _port);
+  _client.write((const uint8_t*)message, strlen(message));
+  return _client.endPacket() == 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// AsyncWiFiManager
+/////////////////////////////////////////////////////////////////////////////////
+AsyncWiFiManagerParameter::AsyncWiFiManagerParameter(const char* id, const char* placeholder, const char* default_value,
+  int length, const char* custom) : _id(id), _value(default_value ? default_value : ""), _default(_value) {
+  (void)placeholder; (void)length; (void)custom;
+  sim::on_reset([this]() { _value = _default; });
+}
+
+AsyncWiFiManager::AsyncWiFiManager(AsyncWebServer* server, DNSServer* dns) {
+  (void)server; (void)dns;
+  sim::on_reset([this]() { _params.clear(); _timeout = _connect_timeout = 0; _save_cb = NULL; });
+}
+
+void AsyncWiFiManager::addParameter(AsyncWiFiManagerParameter* p) {
+  for (AsyncWiFiManagerParameter* q : _params) if (q == p) return;
+  _params.push_back(p);
+}
+
+boolean AsyncWiFiManager::autoConnect(const char* ap_name, const char* ap_password, unsigned long max_connect_retries, unsigned long retry_delay_ms) {
+  (void)max_connect_retries; (void)retry_delay_ms;
+  sim::radio_on();
+  int64_t limit_ms = _connect_timeout > 0 ? (int64_t)_connect_timeout * 1000 : WIFI_FAIL_MS;
+  if (sim::has_wifi_credentials() && sim::env.ap_up && sim::env.wifi_connect_ms <= limit_ms) {
+    sim::stats.wifi_connects++;
+    sim::advance_ms(sim::env.wifi_connect_ms);
+    sim::set_wifi_connected(true);
+    return true;
+  }
+  sim::advance_ms(std::min<int64_t>(WIFI_FAIL_MS, limit_ms));
+  return startConfigPortal(ap_name, ap_password);
+}
+
+boolean AsyncWiFiManager::startConfigPortal(const char* ap_name, const char* ap_password) {
+  (void)ap_name; (void)ap_password;
+  sim::radio_on();
+  if (_timeout > 0 && sim::env.portal_user_ms > (int64_t)_timeout * 1000) {
+    sim::advance_ms((int64_t)_timeout * 1000);
+    return false;
+  }
+  sim::advance_ms(sim::env.portal_user_ms);
+  for (AsyncWiFiManagerParameter* p : _params) {
+    if (sim::env.form.count(p->getID())) p->setValue(sim::env.form[p->getID()].c_str());
+  }
+  sim::set_wifi_credentials(true);
+  if (!sim::env.ap_up) {
+    // The portal stays open for another try until it times out
+    if (_timeout > 0) sim::advance_ms(std::max<int64_t>((int64_t)_timeout * 1000 - sim::env.portal_user_ms, 0));
+    return false;
+  }
+  sim::stats.wifi_connects++;
+  sim::advance_ms(sim::env.wifi_connect_ms);
+  sim::set_wifi_connected(true);
+  if (_save_cb != NULL) _save_cb(); // Only once the form connects, as in the library
+  return true;
+}
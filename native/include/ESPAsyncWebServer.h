@@ -0,0 +1,3 @@
+// Native shim: all host-side stand-ins for the ESP32 SDK and Arduino libraries live in hal.h
+#pragma once
+#include "hal.h"
@@ -0,0 +1,193 @@
+/*
+ * esp32/ulp.h (native shim)
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Instruction encoding and macros mirror ESP-IDF v4.4 components/ulp/include/esp32/ulp.h,
+// so that ulp_code[] assembles to the same words on the host as on the target.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "esp_err.h"
+#include "soc/soc.h"
+
+#define R0 0
+#define R1 1
+#define R2 2
+#define R3 3
+
+#define OPCODE_WR_REG 1
+#define OPCODE_RD_REG 2
+#define RD_REG_PERIPH_RTC_CNTL 0
+#define RD_REG_PERIPH_RTC_IO 1
+#define RD_REG_PERIPH_SENS 2
+#define RD_REG_PERIPH_RTC_I2C 3
+#define OPCODE_I2C 3
+#define OPCODE_DELAY 4
+#define OPCODE_ADC 5
+#define OPCODE_ST 6
+#define SUB_OPCODE_ST 4
+#define OPCODE_ALU 7
+#define SUB_OPCODE_ALU_REG 0
+#define SUB_OPCODE_ALU_IMM 1
+#define ALU_SEL_ADD 0
+#define ALU_SEL_SUB 1
+#define ALU_SEL_AND 2
+#define ALU_SEL_OR 3
+#define ALU_SEL_MOV 4
+#define ALU_SEL_LSH 5
+#define ALU_SEL_RSH 6
+#define SUB_OPCODE_ALU_CNT 2
+#define ALU_SEL_SINC 0
+#define ALU_SEL_SDEC 1
+#define ALU_SEL_SRST 2
+#define OPCODE_BRANCH 8
+#define SUB_OPCODE_BX 0
+#define BX_JUMP_TYPE_DIRECT 0
+#define BX_JUMP_TYPE_ZERO 1
+#define BX_JUMP_TYPE_OVF 2
+#define SUB_OPCODE_B 1
+#define B_CMP_L 0
+#define B_CMP_GE 1
+#define SUB_OPCODE_BS 2
+#define BS_CMP_L 0
+#define BS_CMP_GE 1
+#define BS_CMP_LE 2
+#define OPCODE_END 9
+#define SUB_OPCODE_END 0
+#define SUB_OPCODE_SLEEP 1
+#define OPCODE_TSENS 10
+#define OPCODE_HALT 11
+#define OPCODE_LD 13
+#define OPCODE_MACRO 15
+#define SUB_OPCODE_MACRO_LABEL 0
+#define SUB_OPCODE_MACRO_BRANCH 1
+#define SUB_OPCODE_MACRO_LABELPC 2
+
+#define ESP_ERR_ULP_BASE 0x1200
+#define ESP_ERR_ULP_SIZE_TOO_BIG (ESP_ERR_ULP_BASE + 1)
+#define ESP_ERR_ULP_INVALID_LOAD_ADDR (ESP_ERR_ULP_BASE + 2)
+#define ESP_ERR_ULP_DUPLICATE_LABEL (ESP_ERR_ULP_BASE + 3)
+#define ESP_ERR_ULP_UNDEFINED_LABEL (ESP_ERR_ULP_BASE + 4)
+#define ESP_ERR_ULP_BRANCH_OUT_OF_RANGE (ESP_ERR_ULP_BASE + 5)
+
+typedef union {
+  struct { uint32_t cycles : 16; uint32_t unused : 12; uint32_t opcode : 4; } delay;
+  struct { uint32_t dreg : 2; uint32_t sreg : 2; uint32_t unused1 : 6; uint32_t offset : 11; uint32_t unused2 : 4; uint32_t sub_opcode : 3; uint32_t opcode : 4; } st;
+  struct { uint32_t dreg : 2; uint32_t sreg : 2; uint32_t unused1 : 6; uint32_t offset : 11; uint32_t unused2 : 7; uint32_t opcode : 4; } ld;
+  struct { uint32_t unused : 28; uint32_t opcode : 4; } halt;
+  struct { uint32_t dreg : 2; uint32_t addr : 11; uint32_t unused : 8; uint32_t reg : 1; uint32_t type : 3; uint32_t sub_opcode : 3; uint32_t opcode : 4; } bx;
+  struct { uint32_t imm : 16; uint32_t cmp : 1; uint32_t offset : 7; uint32_t sign : 1; uint32_t sub_opcode : 3; uint32_t opcode : 4; } b;
+  struct { uint32_t imm : 8; uint32_t unused : 7; uint32_t cmp : 2; uint32_t offset : 7; uint32_t sign : 1; uint32_t sub_opcode : 3; uint32_t opcode : 4; } bs;
+  struct { uint32_t dreg : 2; uint32_t sreg : 2; uint32_t treg : 2; uint32_t unused : 15; uint32_t sel : 4; uint32_t sub_opcode : 3; uint32_t opcode : 4; } alu_reg;
+  struct { uint32_t unused1 : 4; uint32_t imm : 8; uint32_t unused2 : 9; uint32_t sel : 4; uint32_t sub_opcode : 3; uint32_t opcode : 4; } alu_reg_s;
+  struct { uint32_t dreg : 2; uint32_t sreg : 2; uint32_t imm : 16; uint32_t unused : 1; uint32_t sel : 4; uint32_t sub_opcode : 3; uint32_t opcode : 4; } alu_imm;
+  struct { uint32_t addr : 8; uint32_t periph_sel : 2; uint32_t data : 8; uint32_t low : 5; uint32_t high : 5; uint32_t opcode : 4; } wr_reg;
+  struct { uint32_t addr : 8; uint32_t periph_sel : 2; uint32_t unused : 8; uint32_t low : 5; uint32_t high : 5; uint32_t opcode : 4; } rd_reg;
+  struct { uint32_t dreg : 2; uint32_t mux : 4; uint32_t sar_sel : 1; uint32_t unused1 : 1; uint32_t cycles : 16; uint32_t unused2 : 4; uint32_t opcode : 4; } adc;
+  struct { uint32_t wakeup : 1; uint32_t unused : 24; uint32_t sub_opcode : 3; uint32_t opcode : 4; } end;
+  struct { uint32_t cycle_sel : 4; uint32_t unused : 21; uint32_t sub_opcode : 3; uint32_t opcode : 4; } sleep;
+  struct { uint32_t label : 16; uint32_t unused : 8; uint32_t sub_opcode : 4; uint32_t opcode : 4; } macro;
+  uint32_t instruction;
+} ulp_insn_t;
+
+static inline uint32_t SOC_REG_TO_ULP_PERIPH_SEL(uint32_t reg) {
+  if (reg < DR_REG_RTCIO_BASE) return RD_REG_PERIPH_RTC_CNTL;
+  if (reg < DR_REG_SENS_BASE) return RD_REG_PERIPH_RTC_IO;
+  if (reg < DR_REG_RTC_I2C_BASE) return RD_REG_PERIPH_SENS;
+  return RD_REG_PERIPH_RTC_I2C;
+}
+
+#define I_DELAY(cycles_) { .delay = { .cycles = cycles_, .unused = 0, .opcode = OPCODE_DELAY } }
+#define I_HALT() { .halt = { .unused = 0, .opcode = OPCODE_HALT } }
+#define I_WR_REG(reg, low_bit, high_bit, val) { .wr_reg = { .addr = ((reg) & 0xff) / sizeof(uint32_t), \
+    .periph_sel = SOC_REG_TO_ULP_PERIPH_SEL(reg), .data = val, .low = low_bit, .high = high_bit, .opcode = OPCODE_WR_REG } }
+#define I_RD_REG(reg, low_bit, high_bit) { .rd_reg = { .addr = ((reg) & 0xff) / sizeof(uint32_t), \
+    .periph_sel = SOC_REG_TO_ULP_PERIPH_SEL(reg), .unused = 0, .low = low_bit, .high = high_bit, .opcode = OPCODE_RD_REG } }
+#define I_WR_REG_BIT(reg, shift, val) I_WR_REG(reg, shift, shift, val)
+#define I_RD_REG_BIT(reg, shift) I_RD_REG(reg, shift, shift)
+#define I_WAKE() { .end = { .wakeup = 1, .unused = 0, .sub_opcode = SUB_OPCODE_END, .opcode = OPCODE_END } }
+#define I_ADC(reg_dest, adc_idx, pad_idx) { .adc = { .dreg = reg_dest, .mux = (pad_idx) + 1, .sar_sel = adc_idx, \
+    .unused1 = 0, .cycles = 0, .unused2 = 0, .opcode = OPCODE_ADC } }
+#define I_ST(reg_val, reg_addr, offset_) { .st = { .dreg = reg_addr, .sreg = reg_val, .unused1 = 0, .offset = offset_, \
+    .unused2 = 0, .sub_opcode = SUB_OPCODE_ST, .opcode = OPCODE_ST } }
+#define I_LD(reg_dest, reg_addr, offset_) { .ld = { .dreg = reg_dest, .sreg = reg_addr, .unused1 = 0, .offset = offset_, \
+    .unused2 = 0, .opcode = OPCODE_LD } }
+
+#define __I_B(cmp_, pc_offset, imm_value) { .b = { .imm = imm_value, .cmp = cmp_, .offset = (uint32_t)abs(pc_offset), \
+    .sign = (pc_offset) >= 0 ? 0u : 1u, .sub_opcode = SUB_OPCODE_B, .opcode = OPCODE_BRANCH } }
+#define I_BL(pc_offset, imm_value) __I_B(B_CMP_L, pc_offset, imm_value)
+#define I_BGE(pc_offset, imm_value) __I_B(B_CMP_GE, pc_offset, imm_value)
+
+#define __I_BX(reg_, type_, dreg_, addr_) { .bx = { .dreg = dreg_, .addr = addr_, .unused = 0, .reg = reg_, .type = type_, \
+    .sub_opcode = SUB_OPCODE_BX, .opcode = OPCODE_BRANCH } }
+#define I_BXR(reg_pc) __I_BX(1, BX_JUMP_TYPE_DIRECT, reg_pc, 0)
+#define I_BXI(imm_pc) __I_BX(0, BX_JUMP_TYPE_DIRECT, 0, imm_pc)
+#define I_BXZR(reg_pc) __I_BX(1, BX_JUMP_TYPE_ZERO, reg_pc, 0)
+#define I_BXZI(imm_pc) __I_BX(0, BX_JUMP_TYPE_ZERO, 0, imm_pc)
+#define I_BXFR(reg_pc) __I_BX(1, BX_JUMP_TYPE_OVF, reg_pc, 0)
+#define I_BXFI(imm_pc) __I_BX(0, BX_JUMP_TYPE_OVF, 0, imm_pc)
+
+#define __I_ALUR(sel_, reg_dest, reg_src1, reg_src2) { .alu_reg = { .dreg = reg_dest, .sreg = reg_src1, .treg = reg_src2, \
+    .unused = 0, .sel = sel_, .sub_opcode = SUB_OPCODE_ALU_REG, .opcode = OPCODE_ALU } }
+#define I_ADDR(reg_dest, reg_src1, reg_src2) __I_ALUR(ALU_SEL_ADD, reg_dest, reg_src1, reg_src2)
+#define I_SUBR(reg_dest, reg_src1, reg_src2) __I_ALUR(ALU_SEL_SUB, reg_dest, reg_src1, reg_src2)
+#define I_ANDR(reg_dest, reg_src1, reg_src2) __I_ALUR(ALU_SEL_AND, reg_dest, reg_src1, reg_src2)
+#define I_ORR(reg_dest, reg_src1, reg_src2) __I_ALUR(ALU_SEL_OR, reg_dest, reg_src1, reg_src2)
+#define I_MOVR(reg_dest, reg_src) __I_ALUR(ALU_SEL_MOV, reg_dest, reg_src, 0)
+#define I_LSHR(reg_dest, reg_src, reg_shift) __I_ALUR(ALU_SEL_LSH, reg_dest, reg_src, reg_shift)
+#define I_RSHR(reg_dest, reg_src, reg_shift) __I_ALUR(ALU_SEL_RSH, reg_dest, reg_src, reg_shift)
+
+#define __I_ALUI(sel_, reg_dest, reg_src, imm_) { .alu_imm = { .dreg = reg_dest, .sreg = reg_src, .imm = imm_, \
+    .unused = 0, .sel = sel_, .sub_opcode = SUB_OPCODE_ALU_IMM, .opcode = OPCODE_ALU } }
+#define I_ADDI(reg_dest, reg_src, imm_) __I_ALUI(ALU_SEL_ADD, reg_dest, reg_src, imm_)
+#define I_SUBI(reg_dest, reg_src, imm_) __I_ALUI(ALU_SEL_SUB, reg_dest, reg_src, imm_)
+#define I_ANDI(reg_dest, reg_src, imm_) __I_ALUI(ALU_SEL_AND, reg_dest, reg_src, imm_)
+#define I_ORI(reg_dest, reg_src, imm_) __I_ALUI(ALU_SEL_OR, reg_dest, reg_src, imm_)
+#define I_MOVI(reg_dest, imm_) __I_ALUI(ALU_SEL_MOV, reg_dest, 0, imm_)
+#define I_LSHI(reg_dest, reg_src, imm_) __I_ALUI(ALU_SEL_LSH, reg_dest, reg_src, imm_)
+#define I_RSHI(reg_dest, reg_src, imm_) __I_ALUI(ALU_SEL_RSH, reg_dest, reg_src, imm_)
+
+#define __I_STAGE(sel_, imm_) { .alu_reg_s = { .unused1 = 0, .imm = imm_, .unused2 = 0, .sel = sel_, \
+    .sub_opcode = SUB_OPCODE_ALU_CNT, .opcode = OPCODE_ALU } }
+#define I_STAGE_INC(imm_) __I_STAGE(ALU_SEL_SINC, imm_)
+#define I_STAGE_DEC(imm_) __I_STAGE(ALU_SEL_SDEC, imm_)
+#define I_STAGE_RST() __I_STAGE(ALU_SEL_SRST, 0)
+
+#define __I_BS(cmp_, pc_offset, imm_value) { .bs = { .imm = imm_value, .unused = 0, .cmp = cmp_, .offset = (uint32_t)abs(pc_offset), \
+    .sign = (pc_offset) >= 0 ? 0u : 1u, .sub_opcode = SUB_OPCODE_BS, .opcode = OPCODE_BRANCH } }
+#define I_BSLT(pc_offset, imm_value) __I_BS(BS_CMP_L, pc_offset, imm_value)
+#define I_BSGE(pc_offset, imm_value) __I_BS(BS_CMP_GE, pc_offset, imm_value)
+#define I_BSLE(pc_offset, imm_value) __I_BS(BS_CMP_LE, pc_offset, imm_value)
+
+#define __M_MACRO(sub_, label_num) { .macro = { .label = label_num, .unused = 0, .sub_opcode = sub_, .opcode = OPCODE_MACRO } }
+#define M_LABEL(label_num) __M_MACRO(SUB_OPCODE_MACRO_LABEL, label_num)
+#define M_BRANCH(label_num) __M_MACRO(SUB_OPCODE_MACRO_BRANCH, label_num)
+#define M_LABELPC(label_num) __M_MACRO(SUB_OPCODE_MACRO_LABELPC, label_num)
+#define M_MOVL(reg_dest, label_num) M_LABELPC(label_num), I_MOVI(reg_dest, 0)
+#define M_BL(label_num, imm_value) M_BRANCH(label_num), I_BL(0, imm_value)
+#define M_BGE(label_num, imm_value) M_BRANCH(label_num), I_BGE(0, imm_value)
+#define M_BX(label_num) M_BRANCH(label_num), I_BXI(0)
+#define M_BXZ(label_num) M_BRANCH(label_num), I_BXZI(0)
+#define M_BXF(label_num) M_BRANCH(label_num), I_BXFI(0)
+#define M_BSLT(label_num, imm_value) M_BRANCH(label_num), I_BSLT(0, imm_value)
+#define M_BSGE(label_num, imm_value) M_BRANCH(label_num), I_BSGE(0, imm_value)
+#define M_BSLE(label_num, imm_value) M_BRANCH(label_num), I_BSLE(0, imm_value)
+
+esp_err_t ulp_run(uint32_t entry_point);
+esp_err_t ulp_set_wakeup_period(size_t period_index, uint32_t period_us);
@@ -0,0 +1,546 @@
+/*
+ * hal.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host-side stand-ins for the parts of the ESP32 SDK, Arduino core and third-party libraries used by
+// espclock4.cpp. Everything is backed by the simulator in sim.h: a simulated clock, RTC slow memory
+// executed by a ULP emulator, an in-memory flash filesystem and scripted WiFi/HTTP endpoints.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <ctype.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <type_traits>
+
+using std::min;
+using std::max;
+
+#include "esp_err.h"
+#include "soc/soc.h"
+#include "soc/rtc_cntl_reg.h"
+#include "esp32/ulp.h"
+
+/////////////////////////////////////////////////////////////////////////////////
+// sdkconfig / esp_attr / esp_log
+/////////////////////////////////////////////////////////////////////////////////
+#define CONFIG_ESP32_ULP_COPROC_RESERVE_MEM 512
+#define IRAM_ATTR
+#define PROGMEM
+#define RTC_DATA_ATTR
+// Log formats are written for the ESP32, where int, long and size_t are all 32 bits wide, so integer
+// arguments are narrowed to those widths before reaching the host's printf
+template<typename T, bool = std::is_integral<T>::value || std::is_enum<T>::value> struct esp_log_arg {
+  typedef typename std::conditional<std::is_signed<T>::value, int32_t, uint32_t>::type type;
+};
+template<typename T> struct esp_log_arg<T, false> { typedef T type; };
+template<typename... Args> void esp_log_write(char level, const char* tag, const char* format, Args... args) {
+  fprintf(stderr, "%c (%s) ", level, tag);
+  if constexpr (sizeof...(Args) == 0) fputs(format, stderr);
+  else fprintf(stderr, format, (typename esp_log_arg<Args>::type)args...);
+  fputc('\n', stderr);
+}
+#define ESP_LOGE(tag, format, ...) esp_log_write('E', tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) esp_log_write('W', tag, format, ##__VA_ARGS__)
+
+/////////////////////////////////////////////////////////////////////////////////
+// GPIO, RTC IO and ADC drivers
+/////////////////////////////////////////////////////////////////////////////////
+typedef enum {
+  GPIO_NUM_0 = 0, GPIO_NUM_2 = 2, GPIO_NUM_4 = 4, GPIO_NUM_12 = 12, GPIO_NUM_15 = 15,
+  GPIO_NUM_25 = 25, GPIO_NUM_27 = 27, GPIO_NUM_33 = 33, GPIO_NUM_MAX = 40,
+} gpio_num_t;
+typedef enum { RTC_GPIO_MODE_INPUT_ONLY, RTC_GPIO_MODE_OUTPUT_ONLY, RTC_GPIO_MODE_INPUT_OUTPUT, RTC_GPIO_MODE_DISABLED } rtc_gpio_mode_t;
+typedef enum { GPIO_DRIVE_CAP_0, GPIO_DRIVE_CAP_1, GPIO_DRIVE_CAP_2, GPIO_DRIVE_CAP_3 } gpio_drive_cap_t;
+typedef enum { ADC_UNIT_1 = 1, ADC_UNIT_2 = 2 } adc_unit_t;
+typedef enum { ADC_ATTEN_DB_0, ADC_ATTEN_DB_2_5, ADC_ATTEN_DB_6, ADC_ATTEN_DB_11 } adc_atten_t;
+typedef enum { ADC_WIDTH_BIT_9, ADC_WIDTH_BIT_10, ADC_WIDTH_BIT_11, ADC_WIDTH_BIT_12 } adc_bits_width_t;
+typedef enum { ADC1_CHANNEL_0, ADC1_CHANNEL_1, ADC1_CHANNEL_2, ADC1_CHANNEL_3, ADC1_CHANNEL_4, ADC1_CHANNEL_5 } adc1_channel_t;
+typedef struct { uint32_t coeff_a, coeff_b, vref; } esp_adc_cal_characteristics_t;
+
+#define RTCIO_GPIO4_CHANNEL             10
+#define RTCIO_GPIO25_CHANNEL            6
+#define RTCIO_GPIO27_CHANNEL            17
+#define ADC1_GPIO33_CHANNEL             ADC1_CHANNEL_5
+
+esp_err_t rtc_gpio_init(gpio_num_t pin);
+esp_err_t rtc_gpio_set_direction(gpio_num_t pin, rtc_gpio_mode_t mode);
+esp_err_t rtc_gpio_set_drive_capability(gpio_num_t pin, gpio_drive_cap_t cap);
+esp_err_t rtc_gpio_set_level(gpio_num_t pin, uint32_t level);
+esp_err_t rtc_gpio_isolate(gpio_num_t pin);
+esp_err_t adc1_config_width(adc_bits_width_t width);
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten);
+int adc1_get_raw(adc1_channel_t channel);
+void adc1_ulp_enable();
+int esp_adc_cal_characterize(adc_unit_t unit, adc_atten_t atten, adc_bits_width_t width, uint32_t vref, esp_adc_cal_characteristics_t* chars);
+uint32_t esp_adc_cal_raw_to_voltage(uint32_t raw, const esp_adc_cal_characteristics_t* chars);
+
+/////////////////////////////////////////////////////////////////////////////////
+// RTC clock, watchdog and sleep
+/////////////////////////////////////////////////////////////////////////////////
+typedef enum { RTC_CAL_RTC_MUX, RTC_CAL_8MD256, RTC_CAL_32K_XTAL } rtc_cal_sel_t;
+#define RTC_CLK_CAL_FRACT 19
+uint32_t rtc_clk_cal(rtc_cal_sel_t cal_clk, uint32_t slow_clk_cycles);
+
+typedef enum { RTC_WDT_STAGE0, RTC_WDT_STAGE1, RTC_WDT_STAGE2, RTC_WDT_STAGE3 } rtc_wdt_stage_t;
+typedef enum { RTC_WDT_STAGE_ACTION_OFF, RTC_WDT_STAGE_ACTION_INTERRUPT, RTC_WDT_STAGE_ACTION_RESET_CPU,
+  RTC_WDT_STAGE_ACTION_RESET_SYSTEM, RTC_WDT_STAGE_ACTION_RESET_RTC } rtc_wdt_stage_action_t;
+typedef enum { RTC_WDT_SYS_RESET_SIG, RTC_WDT_CPU_RESET_SIG } rtc_wdt_reset_sig_t;
+typedef enum { RTC_WDT_LENGTH_100ns, RTC_WDT_LENGTH_200ns, RTC_WDT_LENGTH_300ns, RTC_WDT_LENGTH_400ns,
+  RTC_WDT_LENGTH_500ns, RTC_WDT_LENGTH_800ns, RTC_WDT_LENGTH_1_6us, RTC_WDT_LENGTH_3_2us } rtc_wdt_length_sig_t;
+void rtc_wdt_protect_off();
+void rtc_wdt_protect_on();
+void rtc_wdt_disable();
+void rtc_wdt_enable();
+esp_err_t rtc_wdt_set_length_of_reset_signal(rtc_wdt_reset_sig_t sig, rtc_wdt_length_sig_t length);
+esp_err_t rtc_wdt_set_stage(rtc_wdt_stage_t stage, rtc_wdt_stage_action_t action);
+esp_err_t rtc_wdt_set_time(rtc_wdt_stage_t stage, unsigned int timeout_ms);
+
+typedef enum {
+  ESP_SLEEP_WAKEUP_UNDEFINED, ESP_SLEEP_WAKEUP_ALL, ESP_SLEEP_WAKEUP_EXT0, ESP_SLEEP_WAKEUP_EXT1, ESP_SLEEP_WAKEUP_TIMER,
+  ESP_SLEEP_WAKEUP_TOUCHPAD, ESP_SLEEP_WAKEUP_ULP,
+} esp_sleep_wakeup_cause_t;
+typedef enum { ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_DOMAIN_RTC_SLOW_MEM, ESP_PD_DOMAIN_RTC_FAST_MEM } esp_sleep_pd_domain_t;
+typedef enum { ESP_PD_OPTION_OFF, ESP_PD_OPTION_ON, ESP_PD_OPTION_AUTO } esp_sleep_pd_option_t;
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause();
+esp_err_t esp_sleep_pd_config(esp_sleep_pd_domain_t domain, esp_sleep_pd_option_t option);
+esp_err_t esp_sleep_enable_ulp_wakeup();
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us);
+[[noreturn]] void esp_deep_sleep_start();
+void esp_deep_sleep_disable_rom_logging();
+int64_t esp_timer_get_time();
+
+// One-shot timers only; the callback runs on the main core as soon as simulated time reaches it (see sim::advance_ns())
+typedef void (*esp_timer_cb_t)(void* arg);
+typedef enum { ESP_TIMER_TASK } esp_timer_dispatch_t;
+typedef struct {
+  esp_timer_cb_t callback;
+  void* arg;
+  esp_timer_dispatch_t dispatch_method;
+  const char* name;
+  bool skip_unhandled_events;
+} esp_timer_create_args_t;
+typedef struct esp_timer* esp_timer_handle_t;
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* out_handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+
+/////////////////////////////////////////////////////////////////////////////////
+// OTA partitions and ROM CRC
+/////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+typedef uint32_t esp_ota_handle_t;
+
+const esp_partition_t* esp_ota_get_running_partition();
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start_from);
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size);
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t image_size, esp_ota_handle_t* out_handle);
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void* data, size_t size);
+esp_err_t esp_ota_end(esp_ota_handle_t handle);
+esp_err_t esp_ota_abort(esp_ota_handle_t handle);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* partition);
+int esp_ota_get_app_elf_sha256(char* dst, size_t size);
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len);
+
+/////////////////////////////////////////////////////////////////////////////////
+// mbedtls: SHA-256 and signatures of the simulated update server
+/////////////////////////////////////////////////////////////////////////////////
+// Key the firmware is built with; sim::env.ota_key is the one the update server signs with. Its signatures are a
+// keyed SHA-256 standing in for ECDSA, so they only check out under the same key.
+#define SIM_OTA_KEY             "-----BEGIN PUBLIC KEY-----\nsimulated update server\n-----END PUBLIC KEY-----\n"
+#define OTA_PUBLIC_KEY          SIM_OTA_KEY
+#define MBEDTLS_ERR_PK_KEY_INVALID_FORMAT -0x3D00
+#define MBEDTLS_ERR_ECP_VERIFY_FAILED     -0x4E00
+typedef enum { MBEDTLS_MD_NONE = 0, MBEDTLS_MD_SHA256 = 6 } mbedtls_md_type_t;
+typedef struct {
+  uint32_t state[8];
+  uint64_t total;
+  uint8_t block[64];
+} mbedtls_sha256_context;
+typedef struct {
+  std::string key;
+} mbedtls_pk_context;
+
+void mbedtls_sha256_init(mbedtls_sha256_context* ctx);
+void mbedtls_sha256_free(mbedtls_sha256_context* ctx);
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context* ctx, int is224);
+int mbedtls_sha256_update_ret(mbedtls_sha256_context* ctx, const unsigned char* input, size_t ilen);
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context* ctx, unsigned char output[32]);
+void mbedtls_pk_init(mbedtls_pk_context* ctx);
+void mbedtls_pk_free(mbedtls_pk_context* ctx);
+int mbedtls_pk_parse_public_key(mbedtls_pk_context* ctx, const unsigned char* key, size_t keylen);
+int mbedtls_pk_verify(mbedtls_pk_context* ctx, mbedtls_md_type_t md_alg, const unsigned char* hash, size_t hash_len,
+  const unsigned char* sig, size_t sig_len);
+
+/////////////////////////////////////////////////////////////////////////////////
+// Arduino core
+/////////////////////////////////////////////////////////////////////////////////
+#define LOW 0
+#define HIGH 1
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define LED_BUILTIN 2
+
+typedef bool boolean;
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t val);
+void delay(uint32_t ms);
+unsigned long millis();
+long random(long howsmall, long howbig);
+bool setCpuFrequencyMhz(uint32_t mhz);
+
+class String : public std::string {
+public:
+  String() {}
+  String(const char* s) : std::string(s ? s : "") {}
+  String(const std::string& s) : std::string(s) {}
+  String(int value) : std::string(std::to_string(value)) {}
+  unsigned int length() const { return (unsigned int)size(); }
+  String substring(unsigned int from, unsigned int to) const {
+    if (from >= size()) return String();
+    return String(substr(from, to > from ? to - from : 0));
+  }
+  String substring(unsigned int from) const { return from >= size() ? String() : String(substr(from)); }
+  long toInt() const { return atol(c_str()); }
+  int indexOf(char c) const { size_t pos = find(c); return pos == npos ? -1 : (int)pos; }
+  bool startsWith(const char* prefix) const { return compare(0, strlen(prefix), prefix) == 0; }
+  void trim() {
+    size_t from = find_first_not_of(" \t\r\n"), to = find_last_not_of(" \t\r\n");
+    *this = from == npos ? String() : String(substr(from, to - from + 1));
+  }
+  void replace(const char* find, const char* replace_with) {
+    size_t pos = 0, flen = strlen(find), rlen = strlen(replace_with);
+    if (flen == 0) return;
+    while ((pos = std::string::find(find, pos)) != std::string::npos) {
+      std::string::replace(pos, flen, replace_with);
+      pos += rlen;
+    }
+  }
+  void replace(const String& find, const String& replace_with) { replace(find.c_str(), replace_with.c_str()); }
+  void replace(const char* find, const String& replace_with) { replace(find, replace_with.c_str()); }
+  bool concat(const char* s) { append(s); return true; }
+  bool concat(char c) { push_back(c); return true; }
+  bool concat(const char* s, unsigned int n) { append(s, n); return true; }
+  String& operator+=(char c) { push_back(c); return *this; }
+  String& operator+=(const char* s) { append(s); return *this; }
+  String& operator+=(const String& s) { append(s); return *this; }
+};
+class StringSumHelper : public String {
+public:
+  StringSumHelper(const String& s) : String(s) {}
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buf, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buf++);
+    return n;
+  }
+  size_t print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+  size_t println(const char* s) { return print(s) + print("\n"); }
+  size_t println(const String& s) { return println(s.c_str()); }
+};
+
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  size_t write(uint8_t c) override;
+  using Print::write;
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  uint64_t getEfuseMac();
+  void restart();
+};
+extern EspClass ESP;
+
+/////////////////////////////////////////////////////////////////////////////////
+// Filesystem (LittleFS)
+/////////////////////////////////////////////////////////////////////////////////
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+class File : public Print {
+public:
+  File() {}
+  File(const std::string& path, const char* mode);
+  operator bool() const { return _open; }
+  int available() { return _open ? (int)(_data.size() - _pos) : 0; }
+  int read() { return available() > 0 ? (uint8_t)_data[_pos++] : -1; }
+  size_t read(uint8_t* buf, size_t size);
+  size_t size() const { return _data.size(); }
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buf, size_t size) override;
+  void close();
+private:
+  std::string _path, _data;
+  size_t _pos = 0;
+  bool _open = false, _write = false;
+};
+
+namespace fs {
+  class LittleFSFS {
+  public:
+    bool begin(bool format_on_fail = false);
+    bool exists(const char* path);
+    File open(const char* path, const char* mode = FILE_READ);
+    bool remove(const char* path);
+  };
+}
+extern fs::LittleFSFS LittleFS;
+
+/////////////////////////////////////////////////////////////////////////////////
+// EEPROM (unused; declared for completeness)
+/////////////////////////////////////////////////////////////////////////////////
+class EEPROMClass {
+public:
+  bool begin(size_t size) { (void)size; return true; }
+};
+extern EEPROMClass EEPROM;
+
+/////////////////////////////////////////////////////////////////////////////////
+// WiFi and UDP
+/////////////////////////////////////////////////////////////////////////////////
+typedef enum { WL_IDLE_STATUS = 0, WL_NO_SSID_AVAIL = 1, WL_CONNECTED = 3, WL_CONNECT_FAILED = 4, WL_DISCONNECTED = 6 } wl_status_t;
+typedef enum { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 } wifi_mode_t;
+typedef struct { int unused; } wifi_init_config_t;
+#define WIFI_INIT_CONFIG_DEFAULT() { 0 }
+esp_err_t esp_wifi_init(const wifi_init_config_t* config);
+esp_err_t esp_wifi_restore();
+esp_err_t esp_wifi_stop();
+typedef enum { WIFI_SECOND_CHAN_NONE = 0, WIFI_SECOND_CHAN_ABOVE, WIFI_SECOND_CHAN_BELOW } wifi_second_chan_t;
+typedef enum { WIFI_IF_STA = 0, WIFI_IF_AP } wifi_interface_t;
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second);
+
+class IPAddress {
+public:
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _addr((uint32_t)a << 24 | (uint32_t)b << 16 | (uint32_t)c << 8 | d) {}
+  bool fromString(const char* s);
+  uint32_t value() const { return _addr; }
+private:
+  uint32_t _addr = 0;
+};
+
+class WiFiClass {
+public:
+  wl_status_t begin();                        // Stored credentials; associates in the background
+  wl_status_t status();
+  bool isConnected() { return status() == WL_CONNECTED; }
+  String macAddress();
+  bool setAutoReconnect(bool enable) { (void)enable; return true; }
+  void persistent(bool enable) { (void)enable; }
+  bool mode(wifi_mode_t mode);
+  bool disconnect(bool wifioff = false);
+  int channel();
+};
+extern WiFiClass WiFi;
+
+class WiFiClient {
+public:
+  WiFiClient() {}
+};
+
+class WiFiUDP {
+public:
+  int beginPacket(const char* host, uint16_t port);
+  int beginPacket(IPAddress ip, uint16_t port);
+  size_t write(uint8_t c) { _buf.push_back((char)c); return 1; }
+  size_t write(const uint8_t* buf, size_t size) { _buf.append((const char*)buf, size); return size; }
+  int endPacket();
+private:
+  std::string _buf;
+  uint16_t _port = 0;
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+// ESP-NOW
+/////////////////////////////////////////////////////////////////////////////////
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_KEY_LEN 16
+typedef struct {
+  uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+  uint8_t lmk[ESP_NOW_KEY_LEN];
+  uint8_t channel;
+  wifi_interface_t ifidx;
+  bool encrypt;
+  void* priv;
+} esp_now_peer_info_t;
+typedef void (*esp_now_recv_cb_t)(const uint8_t* mac_addr, const uint8_t* data, int data_len);
+
+esp_err_t esp_now_init();
+esp_err_t esp_now_deinit();
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t* peer);
+esp_err_t esp_now_send(const uint8_t* peer_addr, const uint8_t* data, size_t len);
+
+/////////////////////////////////////////////////////////////////////////////////
+// Syslog
+/////////////////////////////////////////////////////////////////////////////////
+#define SYSLOG_PROTO_IETF 0
+#define SYSLOG_PROTO_BSD 1
+#define LOG_KERN (0<<3)
+#define LOG_INFO 6
+
+class Syslog {
+public:
+  Syslog(WiFiUDP& client, const char* server, uint16_t port, const char* device_hostname, const char* app_name,
+    uint16_t priDefault, uint8_t protocol = SYSLOG_PROTO_IETF);
+  bool log(const char* message);
+private:
+  WiFiUDP& _client;
+  std::string _server, _hostname;
+  uint16_t _port;
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+// AsyncWebServer / AsyncWiFiManager
+/////////////////////////////////////////////////////////////////////////////////
+class AsyncClient;
+typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
+typedef std::function<void(void*, AsyncClient*, void* data, size_t len)> AcDataHandler;
+typedef std::function<void(void*, AsyncClient*, int8_t error)> AcErrorHandler;
+
+// Talks to the simulated time servers in sim::env.servers; callbacks fire from scheduled events while the
+// main core waits in delay()
+class AsyncClient {
+public:
+  ~AsyncClient() { close(true); }
+  void onConnect(AcConnectHandler cb, void* arg = 0) { _connect_cb = cb; _connect_arg = arg; }
+  void onDisconnect(AcConnectHandler cb, void* arg = 0) { _disconnect_cb = cb; _disconnect_arg = arg; }
+  void onData(AcDataHandler cb, void* arg = 0) { _data_cb = cb; _data_arg = arg; }
+  void onError(AcErrorHandler cb, void* arg = 0) { _error_cb = cb; _error_arg = arg; }
+  bool connect(const char* host, uint16_t port);
+  size_t write(const char* data);
+  void close(bool now = false);
+  bool connected() { return _connected; }
+private:
+  AcConnectHandler _connect_cb, _disconnect_cb;
+  AcDataHandler _data_cb;
+  AcErrorHandler _error_cb;
+  void *_connect_arg = 0, *_disconnect_arg = 0, *_data_arg = 0, *_error_arg = 0;
+  std::string _host;
+  bool _connected = false;
+  std::shared_ptr<bool> _alive;                 // Reset on close() so that pending events are dropped
+};
+
+enum WebRequestMethod { HTTP_GET = 1, HTTP_POST = 2 };
+
+// Responses are kept in memory so that the simulator can inspect what would have been sent
+class AsyncWebServerResponse {
+public:
+  int code;
+  std::string content_type, body;
+  std::vector<std::pair<std::string, std::string>> headers;
+  void addHeader(const char* name, const char* value) { headers.push_back({name, value}); }
+};
+
+class AsyncWebServerRequest {
+public:
+  AsyncWebServerResponse* beginResponse_P(int code, const char* content_type, const uint8_t* data, size_t len) {
+    _response.reset(new AsyncWebServerResponse{code, content_type, std::string((const char*)data, len)});
+    return _response.get();
+  }
+  void send(AsyncWebServerResponse* response) { (void)response; }
+  void send(int code, const char* content_type, const char* content) {
+    _response.reset(new AsyncWebServerResponse{code, content_type, content});
+  }
+  std::shared_ptr<AsyncWebServerResponse> _response;
+};
+
+typedef std::function<void(AsyncWebServerRequest*)> ArRequestHandlerFunction;
+
+class AsyncWebServer {
+public:
+  AsyncWebServer(uint16_t port) { (void)port; instance() = this; }
+  static AsyncWebServer*& instance() { static AsyncWebServer* server; return server; }
+  void on(const char* uri, WebRequestMethod method, ArRequestHandlerFunction handler) { (void)method; _handlers[uri] = handler; }
+  // Simulated GET; returns NULL if no handler is registered for uri
+  std::shared_ptr<AsyncWebServerResponse> get(const char* uri) {
+    if (!_handlers.count(uri)) return NULL;
+    AsyncWebServerRequest request;
+    _handlers[uri](&request);
+    return request._response;
+  }
+private:
+  std::map<std::string, ArRequestHandlerFunction> _handlers;
+};
+
+class DNSServer {
+public:
+  DNSServer() {}
+};
+
+// Global library objects keep their state across a simulated reset unless they restore it through this hook
+namespace sim { void on_reset(std::function<void()> fn); }
+
+class AsyncWiFiManagerParameter {
+public:
+  AsyncWiFiManagerParameter(const char* id, const char* placeholder, const char* default_value, int length, const char* custom = "");
+  const char* getID() const { return _id; }
+  const char* getValue() const { return _value.c_str(); }
+  void setValue(const char* value) { _value = value; }
+private:
+  const char* _id;
+  std::string _value, _default;
+};
+
+class AsyncWiFiManager {
+public:
+  AsyncWiFiManager(AsyncWebServer* server, DNSServer* dns);
+  void setDebugOutput(bool debug) { (void)debug; }
+  void setCustomHeadElement(const char* element) { (void)element; }
+  void addParameter(AsyncWiFiManagerParameter* p);
+  void setConfigPortalTimeout(unsigned long seconds) { _timeout = seconds; }
+  void setConnectTimeout(unsigned long seconds) { _connect_timeout = seconds; }
+  void setSaveConfigCallback(void (*func)(void)) { _save_cb = func; }
+  boolean autoConnect(const char* ap_name, const char* ap_password = NULL, unsigned long max_connect_retries = 1, unsigned long retry_delay_ms = 1000);
+  boolean startConfigPortal(const char* ap_name, const char* ap_password = NULL);
+private:
+  std::vector<AsyncWiFiManagerParameter*> _params;
+  unsigned long _timeout = 0, _connect_timeout = 0;
+  void (*_save_cb)(void) = NULL;
+};
+
+// Arduino entry points provided by the firmware
+void setup();
+void loop();
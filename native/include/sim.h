@@ -0,0 +1,166 @@
+/*
+ * sim.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Simulated ESP32 for the native build. Time only moves when the firmware waits (delay(), WiFi, HTTP,
+// flash) or while the main core is in deep sleep; the ULP program in RTC_SLOW_MEM is executed
+// instruction by instruction by the emulator in ulpsim.cpp whenever its timer falls due.
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "hal.h"
+
+namespace sim {
+
+  #define SIM_NS_PER_US   1000LL
+  #define SIM_NS_PER_MS   1000000LL
+  #define SIM_NS_PER_SEC  1000000000LL
+  #define SIM_NS_PER_DAY  (86400LL*SIM_NS_PER_SEC)
+
+  // Thrown to unwind setup() when the main core enters deep sleep or is reset
+  struct DeepSleep {};
+  struct Reset {};
+
+  // Time server reached through AsyncClient
+  struct Server {
+    bool up = true;                           // Answers at all; otherwise the connection times out
+    bool garbage = false;                     // Answers with an unparseable body
+    int skew_s = 0;                           // Offset from true time
+    int64_t latency_ms = 300;                 // Request round trip
+  };
+
+  // Another clock of the same fleet (see fleet.h), reduced to its ESP-NOW traffic. It keeps true time and
+  // follows the same protocol at every window of DEF_SYNC_MAX: a leader syncs over WiFi and beacons, a
+  // follower listens and leads in its place if it hears nothing, a leader that hears a lower ID steps down.
+  struct Peer {
+    uint32_t id = 0;
+    bool up = true;                           // Powered; scenarios bring it back up as a follower
+    bool leader = false;
+    int64_t windows = 0;                      // Windows it was up for ...
+    int64_t heard = 0;                        // ... took time from a beacon in ...
+    int64_t missed = 0;                       // ... listened in vain and synced over WiFi in ...
+    int64_t led = 0;                          // ... and beaconed in
+    bool listening = false;                   // Receiver on
+    uint32_t heard_id = 0;                    // Lowest ID heard since the window began, or 0
+  };
+
+  // Outside world as seen by the clock; scenarios change these fields through scheduled events
+  struct Env {
+    int vdd_mv = 4800;                        // Supply voltage (before the 1:2 divider)
+    bool button = false;                      // Reset button held down
+    bool ap_up = true;                        // Access point reachable
+    bool server_up = true;                    // Time server answers
+    bool server_garbage = false;              // Time server answers with an unparseable body
+    int server_skew_s = 0;                    // Time server offset from true time
+    int64_t transition_ns = -1;               // Next change of UTC offset announced by the time servers, or -1 (see transition())
+    int transition_s = 0;                     // Size of that change
+    int64_t wifi_connect_ms = 1500;           // Association + DHCP latency
+    int64_t http_latency_ms = 300;            // Request round trip
+    int64_t portal_user_ms = 60*1000;         // Time taken by the user to fill in the config portal
+    int64_t fs_write_ms = 15;                 // LittleFS file write, including any garbage collection it sets off
+    double rtc_drift = 0.0;                   // Fractional error of RTC_SLOW_CLK (+0.05 => ULP timer runs 5% long)
+    int64_t local_time_s = 10*3600;           // True local time of day at power-on
+    std::map<std::string, std::string> form;  // Values entered into the config portal
+    std::map<std::string, Server> servers;    // Per-host time servers; other hosts use server_up etc. above
+    std::vector<std::string> firmware;        // Images published by the update server, oldest first; the first one is flashed at power-on
+    int64_t download_bytes_per_ms = 100;      // Throughput of update downloads (100 => 800kbit/s)
+    std::string ota_key = SIM_OTA_KEY;        // Key the update server signs images with
+    std::vector<Peer> peers;                  // Other clocks sharing form["fleet"] and form["timezone"] with this one
+  };
+
+  // Counters accumulated over a run
+  struct Stats {
+    int64_t ulp_slots = 0;
+    int64_t ulp_cycles = 0;
+    int64_t ulp_active_ns = 0;
+    int64_t pulse_on_ns[5] = {0};             // Tick pin high time, indexed by VAR_TICK_ACTION at slot start
+    int64_t wakes = 0;
+    int64_t awake_ns = 0;
+    int64_t max_ulp_wake_ns = 0;              // Longest wake after a ULP wakeup that ended in deep sleep
+    int64_t radio_on_ns = 0;
+    int64_t flash_writes = 0;
+    int64_t http_requests = 0;
+    int64_t wifi_connects = 0;
+    int64_t resets = 0;
+    int64_t syslog_packets = 0;
+    int64_t ota_bytes = 0;                    // Update server responses, headers included
+    int64_t beacons_sent = 0;                 // ESP-NOW frames sent by the clock ...
+    int64_t beacons_received = 0;             // ... and passed to its receive callback
+  };
+
+  extern Env env;
+  extern Stats stats;
+  extern int64_t now_ns;                      // Simulated time since power-on
+  extern bool verbose;                        // Echo Serial output
+
+  // Time
+  void advance_ns(int64_t ns);
+  inline void advance_ms(int64_t ms) { advance_ns(ms * SIM_NS_PER_MS); }
+  int64_t true_time_s();                      // True local time of day in seconds (mod 24h)
+  int clock_error_s();                        // Clock hands less the default time server's time, wrapped to +/-6 hours
+
+  // Scripted events; fn is called once simulated time reaches at_ns
+  void at(int64_t at_ns, std::function<void()> fn);
+  void fire_events_until(int64_t ns);         // Used by the ULP emulator to let events happen mid-slot
+  void transition(int64_t at_ns, int shift_s); // Announce a change of UTC offset by all time servers, due at at_ns
+  int64_t next_event_ns();                    // Time of the earliest scripted event, or LLONG_MAX
+
+  // Radio bookkeeping for the WiFi shims
+  void radio_on();
+  void radio_off();
+  bool radio_is_on();
+
+  // ULP emulator (ulpsim.cpp)
+  void ulp_reset();
+  void ulp_start(uint32_t entry);
+  void ulp_set_period_us(uint32_t us);
+  bool ulp_running();
+  int64_t ulp_next_slot_ns();
+  void ulp_run_slot();
+  bool ulp_wake_requested();
+  void ulp_clear_wake();
+  uint32_t rtc_gpio_out();
+  int adc_raw_vdd();
+
+  // Plumbing between the shims and the main core lifecycle (hal.cpp)
+  bool wifi_up();
+  void set_wifi_connected(bool connected);
+  bool has_wifi_credentials();
+  void set_wifi_credentials(bool stored);
+  std::map<std::string, std::string>& flash_files();
+  int64_t boot_time_ns();
+  std::string& app_partition(int index);      // Contents of OTA app partition 0 or 1
+  int running_partition();
+  void set_boot_partition(int index);         // Booted at the next reset
+  std::string image_id(const std::string& image); // Reported by esp_ota_get_app_elf_sha256() when image is running
+  std::string ota_signature(const std::string& key, const uint8_t* hash); // Of a SHA-256 by the update server
+  void set_ulp_wakeup(bool enabled);
+  void set_wdt(bool enabled);
+  void peers_start();                         // Schedule the first fleet window of every env.peers
+
+  // Main core lifecycle
+  void power_on();
+  void run(int64_t until_ns);
+  esp_sleep_wakeup_cause_t wake_cause();
+  bool main_core_asleep();                    // In deep sleep, waiting for the ULP to wake it
+}
@@ -0,0 +1,34 @@
+/*
+ * soc/rtc_cntl_reg.h (native shim)
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "soc/soc.h"
+
+#define RTC_CNTL_TIME_UPDATE_REG        (DR_REG_RTCCNTL_BASE + 0x000c)
+#define RTC_CNTL_TIME_UPDATE_S          31
+#define RTC_CNTL_TIME_VALID_S           30
+#define RTC_CNTL_TIME0_REG              (DR_REG_RTCCNTL_BASE + 0x0010)
+#define RTC_CNTL_TIME1_REG              (DR_REG_RTCCNTL_BASE + 0x0014)
+#define RTC_CNTL_LOW_POWER_ST_REG       (DR_REG_RTCCNTL_BASE + 0x00c0)
+#define RTC_CNTL_RDY_FOR_WAKEUP_S       19
+#define RTC_CNTL_BROWN_OUT_REG          (DR_REG_RTCCNTL_BASE + 0x00d4)
+
+#define RTC_GPIO_OUT_REG                (DR_REG_RTCIO_BASE + 0x0000)
+#define RTC_GPIO_IN_REG                 (DR_REG_RTCIO_BASE + 0x0024)
+#define RTC_GPIO_IN_NEXT_S              14
@@ -0,0 +1,36 @@
+/*
+ * soc/soc.h (native shim)
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Peripheral base addresses as seen by the ULP (only used to encode/decode I_RD_REG/I_WR_REG)
+#define DR_REG_RTCCNTL_BASE             0x3ff48000
+#define DR_REG_RTCIO_BASE               0x3ff48400
+#define DR_REG_SENS_BASE                0x3ff48800
+#define DR_REG_RTC_I2C_BASE             0x3ff48C00
+
+// RTC slow memory is backed by a plain array owned by the simulator
+extern uint32_t sim_rtc_slow_mem[2048];
+#define RTC_SLOW_MEM                    (sim_rtc_slow_mem)
+
+void sim_write_peri_reg(uint32_t reg, uint32_t value);
+uint32_t sim_read_peri_reg(uint32_t reg);
+#define WRITE_PERI_REG(reg, value)      sim_write_peri_reg((reg), (value))
+#define READ_PERI_REG(reg)              sim_read_peri_reg(reg)
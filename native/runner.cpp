@@ -0,0 +1,424 @@
+/*
+ * runner.cpp
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Scenario runner for the native build. Each scenario powers the clock on, scripts changes to the outside
+// world (sim::Env) at fixed simulated times and lets setup() run through every deep sleep cycle until the
+// end of the scenario. The clock hands (VAR_CLK_*) are compared against the time served by the time
+// server once a minute, and the run fails if they are still off by more than a scenario's tolerance
+// at the end. Each scenario runs in a child process so that it starts from freshly initialized globals,
+// the same as a real power-on.
+//
+// Usage: espclock [-v] [-t] [-d days] [scenario...]
+//        espclock [-v] [-t] [-d days] -r snapshot_file
+//   -v  echo Serial output and syslog packets (syslog is enabled in the portal; pipe through eventlog.py to decode)
+//   -t  print VAR_* variables once a minute
+//   -d  override the length of each scenario in days (fractions allowed)
+//   -r  replay an RTC snapshot written by eventlog.py -s (see src/snapshot.h) instead of the scenarios
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <sstream>
+#include "sim.h"
+#include "ulpdefs.h"
+
+using namespace sim;
+
+#define HOUR_NS                 (3600*SIM_NS_PER_SEC)
+
+typedef struct {
+  const char* name;
+  const char* description;
+  double days;
+  int max_error_s;                                                // Allowed clock error at the end of the run
+  void (*script)();
+  bool (*check)(char* detail, size_t size);                      // Further pass condition at the end of the run, or NULL
+} scenario_t;
+
+static void cold_boot() {
+}
+
+// ULP slot lengths counted since the last report (see jitter.h): some, and most of them in the nominal bucket
+static bool slots_nominal(char* detail, size_t size) {
+  int64_t count[SLOT_BUCKETS] = {}, n = 0;
+  int peak = 0;
+  for (int action=TICK_NORMAL; action<=TICK_HOLD; action++) {
+    for (int i=0; i<SLOT_BUCKETS; i++) count[i] += RTC_SLOW_MEM[RTC_JITTER_START + (action-1)*SLOT_BUCKETS + i] & 0xffff;
+  }
+  for (int i=0; i<SLOT_BUCKETS; i++) {
+    n += count[i];
+    if (count[i] > count[peak]) peak = i;
+  }
+  snprintf(detail, size, "slots=%lld peak=%d", (long long)n, peak);
+  return n > 0 && peak == SLOT_NOMINAL_BUCKET;
+}
+
+// Reset button held down for 3s: the ULP pauses the clock and the main core resets the RTC
+static void factory_reset() {
+  at(2*HOUR_NS, []{ env.button = true; });
+  at(2*HOUR_NS + 3*SIM_NS_PER_SEC, []{ env.button = false; });
+}
+
+// Battery sags below SUPPLY_VLOW for an hour: no syncs until it recovers
+static void low_vdd() {
+  at(4*HOUR_NS, []{ env.vdd_mv = 3000; });
+  at(5*HOUR_NS, []{ env.vdd_mv = 4800; });
+}
+
+static void ap_outage() {
+  at(6*HOUR_NS, []{ env.ap_up = false; });
+  at(9*HOUR_NS, []{ env.ap_up = true; });
+}
+
+// Access point down from Friday evening to Sunday evening: the clock should back off to a try every few hours rather
+// than spending a WiFi session every 5 mins
+static int64_t outage_wakes, outage_radio_ns;
+
+static void weekend_outage() {
+  at(12*HOUR_NS, []{ env.ap_up = false; outage_wakes = -stats.wakes; outage_radio_ns = -stats.radio_on_ns; });
+  at(60*HOUR_NS, []{ env.ap_up = true; outage_wakes += stats.wakes; outage_radio_ns += stats.radio_on_ns; });
+}
+
+// A handful of tries for the whole outage
+static bool outage_backed_off(char* detail, size_t size) {
+  snprintf(detail, size, "outage_wakes=%lld outage_radio=%.1fs", (long long)outage_wakes, outage_radio_ns / 1e9);
+  return outage_wakes <= 16;
+}
+
+// Largest error and minutes beyond the scenario's max_error_s as measured by run_scenario(), for the checks
+static int64_t measured_max_error, measured_errors_over;
+
+// The accuracy summary the clock keeps itself (see accuracy.h), with the bound set to the scenario's 30s, must agree
+// with what the runner measured: the largest error within 10s, and the time beyond the bound within `mins` minutes.
+// The clock only counts up to its last sync.
+static bool accuracy_tracked(char* detail, size_t size, int mins) {
+  int64_t max_err = RTC_SLOW_MEM[RTC_ACCURACY_START+2], mins_out = RTC_SLOW_MEM[RTC_ACCURACY_START+3] / 60;
+  snprintf(detail, size, "acc_max=%llds acc_mins_out=%lld", (long long)max_err, (long long)mins_out);
+  return llabs(max_err - measured_max_error) <= 10 && llabs(mins_out - measured_errors_over) <= mins;
+}
+
+// Time server jumps ahead by 40s, then falls behind by 30s
+static void server_skew() {
+  env.form["accBound"] = "30";
+  at(6*HOUR_NS, []{ env.server_skew_s = 40; });
+  at(12*HOUR_NS, []{ env.server_skew_s = -30; });
+}
+
+// A jump of the time server is only seen at the next sync, and the clock spreads the error it finds there over the
+// interval since the last one; so each of the two jumps may be counted up to a tune interval short
+static bool server_skew_tracked(char* detail, size_t size) {
+  return accuracy_tracked(detail, size, 2*120);
+}
+
+// Three time sources: one skewed by 5 mins, one that goes down for a while and one that returns garbage
+static void multi_source() {
+  env.form["scriptUrl"] = "http://a/now.php?tz=[tz] http://b/now.php http://c/now.php";
+  env.servers["a"].latency_ms = 300;
+  env.servers["b"].latency_ms = 500;
+  env.servers["c"].latency_ms = 100;
+  env.servers["c"].skew_s = 300;
+  at(3*HOUR_NS, []{ env.servers["a"].up = false; });
+  at(5*HOUR_NS, []{ env.servers["a"].up = true; });
+  at(8*HOUR_NS, []{ env.servers["b"].garbage = true; });
+}
+
+// Slow association and a server that stalls; the network session deadline must keep the radio-on time bounded
+static void slow_network() {
+  at(2*HOUR_NS, []{ env.http_latency_ms = 60000; });
+  at(4*HOUR_NS, []{ env.http_latency_ms = 300; env.wifi_connect_ms = 30000; });
+  at(6*HOUR_NS, []{ env.wifi_connect_ms = 1500; });
+}
+
+// DST starts at 02:00 on the first night and ends at 02:00 on the second, announced by the time server:
+// the clock should fast-forward at 02:00 sharp, then hold its hands for an hour
+static void dst() {
+  env.form["accBound"] = "30";
+  transition(16*HOUR_NS, 3600);
+  at(17*HOUR_NS, []{ transition(40*HOUR_NS, -3600); });
+}
+
+// Transitions are announced, so the clock knows when its error changes
+static bool dst_tracked(char* detail, size_t size) {
+  return accuracy_tracked(detail, size, 10);
+}
+
+// RTC_SLOW_CLK runs 400ppm long, then 200ppm short after a change in temperature
+static void rtc_drift() {
+  env.rtc_drift = 0.0004;
+  at(12*HOUR_NS, []{ env.rtc_drift = -0.0002; });
+}
+
+// Pseudo-random stand-in for a firmware image
+static std::string firmware_image(size_t size, uint32_t seed) {
+  std::string image(size, 0);
+  for (size_t i=0; i<size; i++) {
+    seed = seed * 1103515245 + 12345;
+    image[i] = (char)(seed >> 16);
+  }
+  return image;
+}
+
+// Next version of a firmware image: a new function, a few changed call targets, some code removed and more data
+static std::string firmware_update(const std::string& image) {
+  std::string update = image;
+  update.insert(120*1024, firmware_image(2048, 2));
+  for (int i=0; i<20; i++) update.replace(200*1024 + i*30000, 16, firmware_image(16, 3+i));
+  update.erase(600*1024, 1024);
+  return update + firmware_image(4096, 30);
+}
+
+// The update server publishes a new image after 6 hours: the clock should fetch a small delta at its daily check,
+// apply it with the radio off and restart into the new image
+static void ota() {
+  env.form["otaUrl"] = "http://ota.local:8070/update";
+  env.firmware.push_back(firmware_image(900*1024, 1));
+  at(6*HOUR_NS, []{ env.firmware.push_back(firmware_update(env.firmware[0])); });
+}
+
+// The new image must be running, and less than a tenth of it sent over the air
+static bool ota_booted(char* detail, size_t size) {
+  const std::string& latest = env.firmware.back();
+  bool booted = app_partition(running_partition()) == latest;
+  snprintf(detail, size, "booted=%d ota=%lldB (%.1f%% of image, %.1fs on air vs %.1fs)", booted, (long long)stats.ota_bytes,
+    stats.ota_bytes * 100.0 / latest.size(), stats.ota_bytes / 1000.0 / env.download_bytes_per_ms, latest.size() / 1000.0 / env.download_bytes_per_ms);
+  return booted && stats.ota_bytes * 10 < (int64_t)latest.size();
+}
+
+// The same update signed with a key the clock was not built with: it is downloaded, but must not be booted
+static void ota_forged() {
+  ota();
+  env.ota_key = "-----BEGIN PUBLIC KEY-----\nsomeone else\n-----END PUBLIC KEY-----\n";
+}
+
+static bool ota_refused(char* detail, size_t size) {
+  bool booted = app_partition(running_partition()) == env.firmware.back();
+  snprintf(detail, size, "booted=%d ota=%lldB", booted, (long long)stats.ota_bytes);
+  return !booted && stats.ota_bytes > 0 && stats.resets == 0;
+}
+
+// Two more clocks of the same fleet: one with a lower ID that leads, one that follows. The leader is off for
+// 6 hours on the second day, and this clock leads in its place; it comes back up as a follower.
+static void fleet() {
+  env.form["fleet"] = "hallway";
+  env.peers.resize(2);
+  env.peers[0].id = 0x00000001;
+  env.peers[0].leader = true;
+  env.peers[1].id = 0xfffffff0;
+  at(30*HOUR_NS, []{ env.peers[0].up = false; });
+  at(36*HOUR_NS, []{ env.peers[0].up = true; env.peers[0].leader = false; });
+}
+
+// The peers must have missed a beacon only in the window in which the leader went missing
+static bool fleet_shared(char* detail, size_t size) {
+  int64_t missed = 0, len = 0;
+  for (const Peer& p : env.peers) {
+    missed += p.missed;
+    len += snprintf(detail + len, size - len, "peer%d=%lld/%lld/%lld/%lld ", (int)(&p - &env.peers[0]), (long long)p.heard,
+      (long long)p.missed, (long long)p.led, (long long)p.windows);
+  }
+  snprintf(detail + len, size - len, "beacons=%lld/%lld", (long long)stats.beacons_received, (long long)stats.beacons_sent);
+  return missed <= 1;
+}
+
+// The clock is paused for 10 mins, and DST starts a few mins before a tune is due: pausing must not turn WiFi on,
+// and the tune must run in the same wake as the transition
+static void batch() {
+  at(6*HOUR_NS, []{ env.button = true; });
+  at(6*HOUR_NS + SIM_NS_PER_SEC/2, []{ env.button = false; });
+  at(6*HOUR_NS + 10*60*SIM_NS_PER_SEC, []{ env.button = true; });
+  at(6*HOUR_NS + 10*60*SIM_NS_PER_SEC + SIM_NS_PER_SEC/2, []{ env.button = false; });
+  transition(18*HOUR_NS + 5*60*SIM_NS_PER_SEC, 3600);
+}
+
+// Wakes saved by pulling jobs into a batch are counted in the high word of RTC_JOBS_START (see jobs.h)
+static bool batch_saved(char* detail, size_t size) {
+  int saved = RTC_SLOW_MEM[RTC_JOBS_START] >> 16;
+  snprintf(detail, size, "saved=%d", saved);
+  return saved >= 1;
+}
+
+// Flash writes stall for 2 mins each for a few hours, as when LittleFS has to collect garbage on worn blocks: the awake
+// time governor must force the main core back to sleep instead of waiting for them
+static void flash_stall() {
+  at(2*HOUR_NS, []{ env.fs_write_ms = 120000; });
+  at(6*HOUR_NS, []{ env.fs_write_ms = 15; });
+}
+
+// Forced sleeps are counted in the low word of RTC_AWAKE_START (see awake.h); no ULP wake may outlast the largest
+// budget and its grace period
+static bool awake_bounded(char* detail, size_t size) {
+  int forced = RTC_SLOW_MEM[RTC_AWAKE_START] & 0xffff, phase = RTC_SLOW_MEM[RTC_AWAKE_START] >> 16;
+  snprintf(detail, size, "forced=%d phase=%d longest=%.1fs", forced, phase, stats.max_ulp_wake_ns / 1e9);
+  return forced >= 1 && stats.max_ulp_wake_ns <= 40*SIM_NS_PER_SEC;
+}
+
+// Nobody completes the config portal at power on; someone turns up 3 hours later and clicks the button to open it again.
+// The radio must stay off while the clock awaits setup.
+static int64_t setup_radio_ns;
+
+static void late_setup() {
+  env.portal_user_ms = 24*3600*1000LL;
+  at(3*HOUR_NS - SIM_NS_PER_SEC, []{ setup_radio_ns = stats.radio_on_ns; env.portal_user_ms = 60*1000; });
+  at(3*HOUR_NS, []{ env.button = true; });
+  at(3*HOUR_NS + SIM_NS_PER_SEC/2, []{ env.button = false; });
+}
+
+// Radio time before the click is no more than SETUP_PORTAL_SECS and a little for booting
+static bool setup_awaited(char* detail, size_t size) {
+  snprintf(detail, size, "radio_before_setup=%.1fs", setup_radio_ns / 1e9);
+  return setup_radio_ns <= 610*SIM_NS_PER_SEC && stats.wifi_connects >= 1;
+}
+
+// RTC snapshot to replay: the args of EV_SNAPSHOT and EV_SNAPSHOT_STACK, one line each
+static std::vector<int32_t> snapshot_header, snapshot_stack;
+
+static bool load_snapshot(const char* path) {
+  std::ifstream in(path);
+  std::string line;
+  std::vector<std::vector<int32_t>> lines;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    std::istringstream words(line);
+    lines.emplace_back();
+    for (int32_t v; words >> v; ) lines.back().push_back(v);
+  }
+  if (lines.empty() || lines[0].size() < 3) {
+    fprintf(stderr, "%s: no RTC snapshot\n", path);
+    return false;
+  }
+  snapshot_header = lines[0];
+  if (lines.size() > 1) snapshot_stack = lines[1];
+  if (snapshot_header[0] != SNAPSHOT_VERSION || snapshot_header[2] != VAR_STACK_REGION
+    || (int)snapshot_header.size() != snapshot_header[2] + 3) {
+    fprintf(stderr, "%s: RTC snapshot v%d with %d VAR_* words does not match this build (v%d, %d words)\n", path,
+      snapshot_header[0], snapshot_header[2], SNAPSHOT_VERSION, VAR_STACK_REGION);
+    return false;
+  }
+  return true;
+}
+
+// Load the snapshot into RTC_SLOW_MEM between two ULP calls while the main core sleeps, as if the ULP had got there
+// itself, and move the time server to its net time. VAR_STACK_LIMIT and VAR_STACK_PTR belong to the ULP program
+// of this build, so they are kept.
+static void restore_snapshot() {
+  if (!main_core_asleep() || (ulp_running() && ulp_next_slot_ns() < now_ns)) {
+    at(now_ns + SIM_NS_PER_SEC, restore_snapshot);
+    return;
+  }
+  const int32_t* vars = &snapshot_header[3];
+  for (int v=0; v<VAR_STACK_LIMIT; v++) RTC_SLOW_MEM[v] = vars[v] & 0xffff;
+  int limit = RTC_SLOW_MEM[VAR_STACK_LIMIT] & 0xffff;
+  for (size_t i=0; i<snapshot_stack.size() && VAR_STACK_REGION + (int)i < limit; i++) {
+    RTC_SLOW_MEM[VAR_STACK_REGION + i] = snapshot_stack[i] & 0xffff;
+  }
+  ulp_set_period_us(((uint32_t)vars[VAR_ULP_TIMERH] << 16) | (uint32_t)vars[VAR_ULP_TIMERL]);
+  env.server_skew_s = vars[VAR_NET_HH]*3600 + vars[VAR_NET_MM]*60 + vars[VAR_NET_SS] - (int)(true_time_s() % 43200);
+}
+
+// Power on and configure as usual, then carry on from the snapshot
+static void replay() {
+  at(10*60*SIM_NS_PER_SEC, restore_snapshot);
+}
+
+static const scenario_t scenarios[] = {
+  { "cold_boot",     "Power on, configure through the portal and keep time",   1, 30, cold_boot, slots_nominal },
+  { "factory_reset", "Long press of the reset button",                          1, 30, factory_reset },
+  { "low_vdd",       "Battery below SUPPLY_VLOW for an hour",                   1, 30, low_vdd },
+  { "ap_outage",     "Access point down for 3 hours",                           1, 30, ap_outage },
+  { "weekend_outage", "Access point down for 2 days",                           3, 30, weekend_outage, outage_backed_off },
+  { "server_skew",   "Time server jumps ahead, then falls behind",              1, 30, server_skew, server_skew_tracked },
+  { "multi_source",  "Three time sources, one skewed, one flaky",               1, 30, multi_source },
+  { "slow_network",  "Slow WiFi association and a stalled time server",         1, 30, slow_network },
+  { "dst",           "DST starts, then ends, announced by the time server",     2, 30, dst, dst_tracked },
+  { "rtc_drift",     "ULP timer runs long, then short",                         2, 30, rtc_drift },
+  { "ota",           "Firmware update from a local update server",              2, 30, ota, ota_booted },
+  { "ota_forged",    "Firmware update signed with the wrong key",               2, 30, ota_forged, ota_refused },
+  { "fleet",         "Time shared over ESP-NOW by three clocks of a fleet",     2, 30, fleet, fleet_shared },
+  { "batch",         "Pause without WiFi, DST and a tune in one wake",          1, 30, batch, batch_saved },
+  { "flash_stall",   "Flash writes stall for minutes at a time",                1, 30, flash_stall, awake_bounded },
+  { "late_setup",    "Config portal left alone, then reopened with the button", 1, 30, late_setup, setup_awaited },
+};
+
+static bool run_scenario(const scenario_t* s, double days, bool trace) {
+  env.form["clockTime"] = "100000";
+  env.form["timezone"] = "UTC";
+  if (verbose) env.form["syslog"] = "syslog";
+  s->script();
+  power_on();
+  int64_t minutes = (int64_t)(days * 24 * 60), max_error = 0, errors_over = 0;
+  int error = 0;
+  for (int64_t m = 1; m <= minutes; m++) {
+    run(m * 60 * SIM_NS_PER_SEC);
+    error = clock_error_s();
+    if (m > 60 && abs(error) > max_error) max_error = abs(error);  // Allow an hour to catch up after power on
+    if (m > 60 && s->max_error_s >= 0 && abs(error) > s->max_error_s) errors_over++;
+    if (trace) {
+      printf("%lld", (long long)m);
+      for (int v=0; v<VAR_STACK_LIMIT; v++) printf(" %u", RTC_SLOW_MEM[v] & 0xffff);
+      printf(" | err=%d\n", error);
+    }
+  }
+  measured_max_error = max_error;
+  measured_errors_over = errors_over;
+  char detail[128] = "";
+  bool pass = (s->max_error_s < 0 || abs(error) <= s->max_error_s) && (s->check == NULL || s->check(detail, sizeof(detail)));
+  printf("%-14s %s  days=%g wakes=%lld resets=%lld awake=%.1fs radio=%.1fs wifi=%lld http=%lld flash=%lld syslog=%lld "
+    "err=%ds max_err=%llds mins_over=%lld %s\n",
+    s->name, pass ? "PASS" : "FAIL", days, (long long)stats.wakes, (long long)stats.resets, stats.awake_ns / 1e9,
+    stats.radio_on_ns / 1e9, (long long)stats.wifi_connects, (long long)stats.http_requests, (long long)stats.flash_writes,
+    (long long)stats.syslog_packets, error, (long long)max_error, (long long)errors_over, detail);
+  return pass;
+}
+
+int main(int argc, char** argv) {
+  bool trace = false;
+  double days = 0;
+  std::vector<const scenario_t*> selected;
+  static const scenario_t replay_scenario = { "replay", "RTC snapshot from the field", 0.5, -1, replay };
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-v") == 0) verbose = true;
+    else if (strcmp(argv[i], "-t") == 0) trace = true;
+    else if (strcmp(argv[i], "-d") == 0 && i+1 < argc) days = atof(argv[++i]);
+    else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) {
+      if (!load_snapshot(argv[++i])) return 2;
+      selected.push_back(&replay_scenario);
+    } else {
+      const scenario_t* found = NULL;
+      for (const scenario_t& s : scenarios) if (strcmp(argv[i], s.name) == 0) found = &s;
+      if (found == NULL) {
+        fprintf(stderr, "Unknown scenario %s; available:\n", argv[i]);
+        for (const scenario_t& s : scenarios) fprintf(stderr, "  %-14s %s\n", s.name, s.description);
+        return 2;
+      }
+      selected.push_back(found);
+    }
+  }
+  if (selected.empty()) for (const scenario_t& s : scenarios) selected.push_back(&s);
+  int failed = 0;
+  for (const scenario_t* s : selected) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) exit(run_scenario(s, days > 0 ? days : s->days, trace) ? 0 : 1);
+    int status = -1;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+  }
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * ulpsim.cpp
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ULP FSM emulator. Executes the program loaded into RTC_SLOW_MEM one timer slot at a time. Each slot
+// runs from the entry point to I_HALT() in zero simulated time; its cost in RTC_FAST_CLK cycles
+// (8MHz, see rtc_clk_cal() in hal.cpp) is added to the start of the next slot, which mirrors the
+// hardware where the wakeup timer only starts counting once the ULP halts.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "ulpdefs.h"
+
+#define ULP_NS_PER_CYCLE        125                               // RTC_FAST_CLK = 8MHz
+#define ULP_MAX_INSNS_PER_SLOT  10000000                          // Guard against runaway programs
+#define RTC_SLOW_CLK_HZ         150000                            // The wakeup period is set in whole cycles of this clock
+
+
+namespace sim {
+
+  static bool running = false, wake = false;
+  static uint32_t entry = 0;
+  static int64_t period_ns = 0, next_slot_ns = 0;
+  static uint32_t gpio_out = 0;
+
+  void ulp_reset() {
+    running = false; wake = false;
+    gpio_out = 0;
+  }
+
+  void ulp_start(uint32_t entry_point) {
+    entry = entry_point;
+    running = true;
+    next_slot_ns = now_ns;
+  }
+
+  // Like ulp_set_wakeup_period(), round down to whole RTC_SLOW_CLK cycles
+  void ulp_set_period_us(uint32_t us) {
+    int64_t cycles = (int64_t)us * RTC_SLOW_CLK_HZ / 1000000;
+    period_ns = cycles * 1000000000LL / RTC_SLOW_CLK_HZ;
+  }
+
+  bool ulp_running() { return running; }
+  int64_t ulp_next_slot_ns() { return next_slot_ns; }
+  bool ulp_wake_requested() { return wake; }
+  void ulp_clear_wake() { wake = false; }
+  uint32_t rtc_gpio_out() { return gpio_out; }
+
+  int adc_raw_vdd() {
+    int raw = env.vdd_mv / 2 * 4095 / 3300;                     // 1:2 divider into 11dB attenuated ADC
+    return raw > 4095 ? 4095 : raw;
+  }
+
+  static uint32_t periph_base(int sel) {
+    static const uint32_t bases[] = { DR_REG_RTCCNTL_BASE, DR_REG_RTCIO_BASE, DR_REG_SENS_BASE, DR_REG_RTC_I2C_BASE };
+    return bases[sel & 3];
+  }
+
+  static uint32_t read_reg(uint32_t reg) {
+    if (reg == RTC_GPIO_IN_REG) {
+      uint32_t value = gpio_out << RTC_GPIO_IN_NEXT_S;
+      if (!env.button) value |= 1 << (RTC_GPIO_IN_NEXT_S + RESETBTN_PIN); // Pulled up; pressed => low
+      else value &= ~(1 << (RTC_GPIO_IN_NEXT_S + RESETBTN_PIN));
+      return value;
+    }
+    if (reg == RTC_CNTL_LOW_POWER_ST_REG) return 1 << RTC_CNTL_RDY_FOR_WAKEUP_S;
+    if (reg == RTC_CNTL_TIME_UPDATE_REG) return 1 << RTC_CNTL_TIME_VALID_S;   // Counter is latched at once
+    if (reg == RTC_CNTL_TIME0_REG || reg == RTC_CNTL_TIME1_REG) {
+      uint64_t ticks = (uint64_t)(now_ns / (SIM_NS_PER_SEC / RTC_SLOW_CLK_HZ));
+      return reg == RTC_CNTL_TIME0_REG ? (uint32_t)ticks : (uint32_t)(ticks >> 32);
+    }
+    return sim_read_peri_reg(reg);
+  }
+
+  static void write_reg(uint32_t reg, int low, int high, uint32_t data) {
+    uint32_t mask = (high >= 31 ? 0xffffffff : ((1U << (high + 1)) - 1)) & ~((1U << low) - 1);
+    if (reg == RTC_GPIO_OUT_REG) {
+      uint32_t value = ((gpio_out << RTC_GPIO_IN_NEXT_S) & ~mask) | ((data << low) & mask);
+      gpio_out = value >> RTC_GPIO_IN_NEXT_S;
+      return;
+    }
+    sim_write_peri_reg(reg, (sim_read_peri_reg(reg) & ~mask) | ((data << low) & mask));
+  }
+
+  void ulp_run_slot() {
+    uint16_t r[4] = {0}, stage = 0;
+    bool zero = false, overflow = false;
+    uint32_t pc = entry;
+    int64_t cycles = 0, pulse_start = -1;
+    int action = RTC_SLOW_MEM[VAR_TICK_ACTION] & 3;
+    uint32_t tickpins = (1 << TICKPIN1) | (1 << TICKPIN2);
+    int64_t event_ns = next_event_ns();
+    stats.ulp_slots++;
+    for (long n = 0; ; n++) {
+      if (n > ULP_MAX_INSNS_PER_SLOT || pc >= 2048) {
+        fprintf(stderr, "ulpsim: runaway ULP program (pc=%u)\n", pc);
+        exit(2);
+      }
+      ulp_insn_t insn;
+      *(uint32_t*)&insn = RTC_SLOW_MEM[pc];
+      uint32_t next = pc + 1;
+      #ifdef ULPSIM_DELAY_ONLY
+        if (insn.macro.opcode == OPCODE_DELAY) cycles += insn.delay.cycles;
+      #else
+        cycles += ulp_insn_cycles(insn);
+      #endif
+      bool halt = false;
+      switch (insn.macro.opcode) {
+        case OPCODE_ALU: {
+          if (insn.alu_reg.sub_opcode == SUB_OPCODE_ALU_CNT) {
+            uint8_t imm = insn.alu_reg_s.imm;
+            if (insn.alu_reg_s.sel == ALU_SEL_SINC) stage += imm;
+            else if (insn.alu_reg_s.sel == ALU_SEL_SDEC) stage -= imm;
+            else stage = 0;
+            stage &= 0xff;
+            break;
+          }
+          uint32_t a, b;
+          int d;
+          if (insn.alu_reg.sub_opcode == SUB_OPCODE_ALU_REG) {
+            a = r[insn.alu_reg.sreg]; b = r[insn.alu_reg.treg]; d = insn.alu_reg.dreg;
+            if (insn.alu_reg.sel == ALU_SEL_MOV) b = a;
+          } else {
+            a = r[insn.alu_imm.sreg]; b = insn.alu_imm.imm; d = insn.alu_imm.dreg;
+          }
+          uint32_t result;
+          switch (insn.alu_reg.sel) {
+            case ALU_SEL_ADD: result = a + b; break;
+            case ALU_SEL_SUB: result = a - b; break;
+            case ALU_SEL_AND: result = a & b; break;
+            case ALU_SEL_OR:  result = a | b; break;
+            case ALU_SEL_MOV: result = b; break;
+            case ALU_SEL_LSH: result = b >= 32 ? 0 : a << b; break;
+            default:          result = b >= 32 ? 0 : a >> b; break;
+          }
+          overflow = (insn.alu_reg.sel == ALU_SEL_ADD || insn.alu_reg.sel == ALU_SEL_SUB) && (result & 0x10000);
+          r[d] = result & 0xffff;
+          zero = r[d] == 0;
+          break;
+        }
+        case OPCODE_LD:
+          r[insn.ld.dreg] = RTC_SLOW_MEM[(r[insn.ld.sreg] + insn.ld.offset) & 0x7ff] & 0xffff;
+          break;
+        case OPCODE_ST:
+          RTC_SLOW_MEM[(r[insn.st.dreg] + insn.st.offset) & 0x7ff] = ((pc & 0x7ff) << 21) | r[insn.st.sreg];
+          break;
+        case OPCODE_BRANCH:
+          if (insn.bx.sub_opcode == SUB_OPCODE_BX) {
+            uint32_t target = insn.bx.reg ? r[insn.bx.dreg] : insn.bx.addr;
+            bool taken = insn.bx.type == BX_JUMP_TYPE_DIRECT || (insn.bx.type == BX_JUMP_TYPE_ZERO && zero) ||
+              (insn.bx.type == BX_JUMP_TYPE_OVF && overflow);
+            if (taken) next = target & 0x7ff;
+          } else if (insn.b.sub_opcode == SUB_OPCODE_B) {
+            bool taken = insn.b.cmp == B_CMP_L ? r[0] < insn.b.imm : r[0] >= insn.b.imm;
+            if (taken) next = insn.b.sign ? pc - insn.b.offset : pc + insn.b.offset;
+          } else {
+            bool taken;
+            if (insn.bs.cmp == BS_CMP_L) taken = stage < insn.bs.imm;
+            else if (insn.bs.cmp == BS_CMP_GE) taken = stage >= insn.bs.imm;
+            else taken = stage <= insn.bs.imm;
+            if (taken) next = insn.bs.sign ? pc - insn.bs.offset : pc + insn.bs.offset;
+          }
+          break;
+        case OPCODE_DELAY:
+          if (now_ns + cycles * ULP_NS_PER_CYCLE >= event_ns) {     // eg. button released while ULP polls it
+            fire_events_until(now_ns + cycles * ULP_NS_PER_CYCLE);
+            event_ns = next_event_ns();
+          }
+          break;
+        case OPCODE_RD_REG: {
+          uint32_t value = read_reg(periph_base(insn.rd_reg.periph_sel) + insn.rd_reg.addr * 4);
+          int low = insn.rd_reg.low, high = insn.rd_reg.high;
+          r[0] = (value >> low) & ((high - low >= 31) ? 0xffffffff : ((1U << (high - low + 1)) - 1));
+          break;
+        }
+        case OPCODE_WR_REG: {
+          uint32_t before = gpio_out & tickpins;
+          write_reg(periph_base(insn.wr_reg.periph_sel) + insn.wr_reg.addr * 4, insn.wr_reg.low, insn.wr_reg.high, insn.wr_reg.data);
+          uint32_t after = gpio_out & tickpins;
+          if (!before && after) pulse_start = cycles;
+          if (before && !after && pulse_start >= 0) {
+            stats.pulse_on_ns[action] += (cycles - pulse_start) * ULP_NS_PER_CYCLE;
+            pulse_start = -1;
+          }
+          break;
+        }
+        case OPCODE_ADC:
+          r[insn.adc.dreg] = adc_raw_vdd();
+          break;
+        case OPCODE_END:
+          if (insn.end.sub_opcode == SUB_OPCODE_END && insn.end.wakeup) wake = true;
+          break;
+        case OPCODE_HALT:
+          halt = true;
+          break;
+        default:
+          fprintf(stderr, "ulpsim: unsupported instruction 0x%08x at pc=%u\n", RTC_SLOW_MEM[pc], pc);
+          exit(2);
+      }
+      if (halt) break;
+      pc = next;
+    }
+    int64_t active_ns = cycles * ULP_NS_PER_CYCLE;
+    stats.ulp_cycles += cycles;
+    stats.ulp_active_ns += active_ns;
+    next_slot_ns = now_ns + active_ns + (int64_t)(period_ns * (1.0 + env.rtc_drift));
+  }
+}
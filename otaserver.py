@@ -0,0 +1,117 @@
+import os
+import struct
+import subprocess
+import sys
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import urlparse, parse_qs
+
+# Update server for delta firmware updates (see src/ota.h). Answers "GET <any path>?from=<id>&offset=<n>" with the
+# delta from the image with that ID to the newest .bin in the firmware directory, so keep the .bin of every release
+# that may still be running on a clock there. The ID is the start of the ELF SHA-256 in the app description.
+# Each delta carries an ECDSA signature of the new image made with the private key (PEM) given with -k, using the
+# openssl command line tool; the clocks must be built with its public key as OTA_PUBLIC_KEY (see src/espclock4.h).
+# Usage: python otaserver.py [-p port] -k key.pem firmware_dir
+
+APP_DESC_MAGIC = 0xabcd5432
+APP_DESC_OFFSET = 32                 # After the image header and the first segment header
+ELF_SHA_OFFSET = APP_DESC_OFFSET + 144
+BLOCK = 16                           # Shortest copy looked for; same as DELTA_BLOCK in native/hal.cpp
+SIG_SIZE = 72                        # Same as OTA_SIG_SIZE in src/ota.h
+
+deltas = {}
+
+def main():
+	args = sys.argv[1:]
+	port, key = 8070, None
+	while len(args) >= 2 and args[0] in ('-p', '-k'):
+		if args[0] == '-p': port = int(args[1])
+		else: key = args[1]
+		args = args[2:]
+	if len(args) != 1 or key is None:
+		sys.exit('Usage: python otaserver.py [-p port] -k key.pem firmware_dir')
+	server = ThreadingHTTPServer(('', port), Handler)
+	server.firmware_dir = args[0]
+	server.key = key
+	print('Serving updates from %s on port %d' % (args[0], port))
+	server.serve_forever()
+
+# ID of each image as reported by esp_ota_get_app_elf_sha256(buf, 17), and the path of the newest image
+def load_images(firmware_dir):
+	images, newest = {}, None
+	for name in os.listdir(firmware_dir):
+		path = os.path.join(firmware_dir, name)
+		if not name.endswith('.bin'): continue
+		data = open(path, 'rb').read(ELF_SHA_OFFSET + 8)
+		if len(data) < ELF_SHA_OFFSET + 8 or struct.unpack_from('<I', data, APP_DESC_OFFSET)[0] != APP_DESC_MAGIC: continue
+		images[data[ELF_SHA_OFFSET:ELF_SHA_OFFSET+8].hex()] = path
+		if newest is None or os.path.getmtime(path) > os.path.getmtime(newest): newest = path
+	return images, newest
+
+def varint(value):
+	out = bytearray()
+	while value >= 0x80:
+		out.append((value & 0x7f) | 0x80)
+		value >>= 7
+	out.append(value)
+	return out
+
+# DER-encoded ECDSA signature of the SHA-256 of data
+def sign(data, key):
+	sig = subprocess.run(['openssl', 'dgst', '-sha256', '-sign', key], input=data, stdout=subprocess.PIPE, check=True).stdout
+	if len(sig) > SIG_SIZE: sys.exit('%s: not an ECDSA P-256 key' % key)
+	return sig
+
+# Every BLOCK-aligned block of src is indexed, and at each position of dst a matching block is extended both ways into a copy
+def delta_encode(src, dst, key):
+	blocks = {}
+	for i in range(0, len(src) - BLOCK + 1, BLOCK):
+		blocks.setdefault(src[i:i+BLOCK], i)
+	ops = bytearray()
+	literal = i = 0
+	def insert(end):
+		if end > literal: ops.extend(varint((end - literal) << 1) + dst[literal:end])
+	while i + BLOCK <= len(dst):
+		s = blocks.get(dst[i:i+BLOCK])
+		if s is None:
+			i += 1
+			continue
+		d, n = i, BLOCK
+		while d > literal and s > 0 and dst[d-1] == src[s-1]:
+			d, s, n = d - 1, s - 1, n + 1
+		while d + n < len(dst) and s + n < len(src) and dst[d+n] == src[s+n]:
+			n += 1
+		insert(d)
+		ops.extend(varint(n << 1 | 1) + varint(s))
+		i = literal = d + n
+	insert(len(dst))
+	sig = sign(dst, key)
+	header = struct.pack('<IIIII', 24 + SIG_SIZE + len(ops), len(src), len(dst), zlib.crc32(dst), len(sig))
+	return b'ESPD' + header + sig.ljust(SIG_SIZE, b'\0') + bytes(ops)
+
+class Handler(BaseHTTPRequestHandler):
+	def do_GET(self):
+		query = parse_qs(urlparse(self.path).query)
+		source = query.get('from', [''])[0]
+		offset = int(query.get('offset', ['0'])[0])
+		images, newest = load_images(self.server.firmware_dir)
+		if source not in images:
+			self.send_response(404)
+			self.end_headers()
+			return
+		if images[source] == newest:
+			self.send_response(204)
+			self.end_headers()
+			return
+		key = (images[source], newest, os.path.getmtime(newest))
+		if key not in deltas:
+			deltas[key] = delta_encode(open(images[source], 'rb').read(), open(newest, 'rb').read(), self.server.key)
+			self.log_message('delta %s -> %s: %d bytes', images[source], newest, len(deltas[key]))
+		body = deltas[key][offset:]
+		self.send_response(200)
+		self.send_header('Content-Type', 'application/octet-stream')
+		self.send_header('Content-Length', str(len(body)))
+		self.end_headers()
+		self.wfile.write(body)
+
+if __name__ == "__main__": main()
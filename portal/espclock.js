@@ -0,0 +1,35 @@
+// Loaded by WiFiManager's config page (see jscript in espclock4.cpp)
+document.addEventListener('DOMContentLoaded', function() {
+  var tz = document.getElementById('timezone');
+  if (tz && !tz.value) tz.value = Intl.DateTimeFormat().resolvedOptions().timeZone;
+
+  // Only plain http:// time sources are supported (see nettime.h)
+  var url = document.getElementById('scriptUrl');
+  if (url) url.addEventListener('change', function() {
+    var bad = url.value.trim().split(/\s+/).filter(function(u) { return u && u.indexOf('http://') != 0; });
+    url.setCustomValidity(bad.length ? 'Only http:// URLs are supported' : '');
+  });
+
+  // Show the pulse table compiled into the firmware below the form
+  var form = document.querySelector('form');
+  if (!form) return;
+  fetch('/pulse.json').then(function(r) { return r.json(); }).then(function(p) {
+    var rows = [['Pulse', 'Length (ms)', 'Duty (%)', 'Ticks/sec']];
+    rows.push(['Normal', p.norm[0], p.norm[1], 8 / (p.norm[2] + 1)]);
+    rows.push(['Forward', p.fwd[0], p.fwd[1], 8 / (p.fwd[2] + 1)]);
+    rows.push(['Reverse A', p.reva.slice(0, 3).join('/'), p.reva[3], 8 / (p.rev + 1)]);
+    rows.push(['Reverse B', p.revb.slice(0, 3).join('/'), p.revb[3], 8 / (p.rev + 1)]);
+    var table = document.createElement('table');
+    rows.forEach(function(row, i) {
+      var tr = table.insertRow();
+      row.forEach(function(cell) {
+        var td = document.createElement(i ? 'td' : 'th');
+        td.textContent = cell;
+        tr.appendChild(td);
+      });
+    });
+    var caption = table.createCaption();
+    caption.textContent = 'Pulse table (' + p.profile + ')';
+    form.parentNode.appendChild(table);
+  });
+});
@@ -0,0 +1,33 @@
+import gzip
+import os
+
+# Compresses the config portal assets in portal/ into src/portal_assets.h so that they can be served
+# from flash with "Content-Encoding: gzip" (see init_portal() in src/espclock4.cpp).
+# Runs before every PlatformIO build; can also be run on its own: python portalbuilder.py
+
+CONTENT_TYPES = { '.js': 'application/javascript', '.css': 'text/css', '.html': 'text/html' }
+
+def main(project_dir):
+	portal_dir = os.path.join(project_dir, 'portal')
+	arrays, entries = [], []
+	for name in sorted(os.listdir(portal_dir)):
+		ext = os.path.splitext(name)[1]
+		if ext not in CONTENT_TYPES: continue
+		data = gzip.compress(open(os.path.join(portal_dir, name), 'rb').read(), 9, mtime=0)
+		var = 'portal_' + name.replace('.', '_').replace('-', '_')
+		lines = [', '.join('0x%02x' % b for b in data[i:i+16]) for i in range(0, len(data), 16)]
+		arrays.append('const uint8_t %s[] PROGMEM = {\n  %s\n};\n' % (var, ',\n  '.join(lines)))
+		entries.append('  { "/%s", "%s", %s, sizeof(%s) },\n' % (name, CONTENT_TYPES[ext], var, var))
+	header = '// Generated by portalbuilder.py from portal/; do not edit\n\n'
+	header += '\n'.join(arrays) + '\n'
+	header += 'typedef struct {\n  const char* path;\n  const char* content_type;\n  const uint8_t* data;\n  size_t len;\n} portal_asset_t;\n\n'
+	header += 'const portal_asset_t portal_assets[] = {\n' + ''.join(entries) + '};\n'
+	path = os.path.join(project_dir, 'src', 'portal_assets.h')
+	if not os.path.exists(path) or open(path).read() != header:
+		open(path, 'w').write(header)
+
+try:
+	Import("env")
+	main(env.get("PROJECT_DIR"))
+except NameError:
+	main(os.path.dirname(os.path.abspath(__file__)))
@@ -0,0 +1,155 @@
+/*
+ * accuracy.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Accuracy of the displayed time. What the user sees is how far the hands are from true time, and the main CPU
+// only ever learns that at a sync: accuracy_sync() is given the new net time before it replaces the ULP's, and
+// measures the error of the hands (clock minus new net time) and how far the ULP's net time drifted. Between the
+// last sync and this one, the error is estimated every ACCURACY_STEP_SECS as the sum of
+//
+//   - the error the hands were left with at the last sync, caught up the way the ULP does it: TICK_FWD when behind
+//     by TOLERANCE_SS or more, TICK_HOLD when ahead by up to hold_limit() (see hold.h), TICK_REV before that when
+//     further ahead, and not at all when within TOLERANCE_SS otherwise
+//   - the drift, which grows linearly over the interval since the ULP timer and drift rate did not change
+//   - whatever the two miss of the error measured at this sync, spread linearly over the interval
+//
+// The secs of each step are counted in a histogram of the error in RTC_SLOW_MEM[RTC_ACCURACY_START], along with
+// the largest error and the secs spent beyond the bound set in the config portal. The summary covers everything
+// since cold boot and is sent via status() after each sync. A DST transition ends an interval as well, taking the
+// ULP's net time as true, so that the hands catching up with the new UTC offset are counted. Intervals are measured
+// in net time and so must be shorter than 12 hrs; the clock is not tuned less often than every 2 hrs.
+
+#define ACCURACY_BUCKETS        13
+#define ACCURACY_STEP_SECS      10                                // Step of the estimated error between two syncs
+#define ACC_BOUND_LIMIT         3600                              // Largest bound (secs) that may be set
+#define ACCURACY_NONE           0xffffffff                        // ACCURACY_LAST before the first sync
+#define ACCURACY_LAST           RTC_SLOW_MEM[RTC_ACCURACY_START]   // Bits 0-15 = net time (secs) of the last sync, bits 16-31 = signed error of the hands there
+#define ACCURACY_PLAN           RTC_SLOW_MEM[RTC_ACCURACY_START+1] // Bits 0-15 = bound (secs), bits 16-31 = VAR_HOLD_SECS at the last sync
+#define ACCURACY_MAX            RTC_SLOW_MEM[RTC_ACCURACY_START+2] // Largest error (secs)
+#define ACCURACY_OUT            RTC_SLOW_MEM[RTC_ACCURACY_START+3] // Secs spent with an error beyond the bound
+#define ACCURACY_BUCKET(i)      RTC_SLOW_MEM[RTC_ACCURACY_START+4+(i)] // Secs spent with an error below ACCURACY_EDGES[i]
+#define FWD_TICKS_PER_SEC       (ULP_CALL_PER_SEC/(FWD_COUNT_MASK+1))
+
+static_assert(RTC_ACCURACY_WORDS == 4 + ACCURACY_BUCKETS, "RTC_ACCURACY_WORDS does not match the histogram");
+
+// Upper edges (secs) of the buckets; the last bucket takes everything beyond
+const int ACCURACY_EDGES[ACCURACY_BUCKETS-1] = { 1, 2, 5, 10, 20, 30, 60, 120, 300, 600, 1800, 3600 };
+
+// Called on cold boot once the summary has been zeroed with the rest of RTC_SLOW_MEM
+void accuracy_init() {
+  ACCURACY_LAST = ACCURACY_NONE;
+  ACCURACY_PLAN = DEF_ACC_BOUND;
+}
+
+// Set the bound (secs) beyond which the time is counted in ACCURACY_OUT
+void accuracy_plan(int bound) {
+  ACCURACY_PLAN = MAKE_INT(HI_WORD(ACCURACY_PLAN), max(1, min(bound, ACC_BOUND_LIMIT)));
+}
+
+// Difference (secs) between two 12-hr times, from -6 hrs up to 6 hrs
+int accuracy_wrap(int secs) {
+  return ((secs % NET_12HRS) + NET_12HRS + NET_12HRS/2) % NET_12HRS - NET_12HRS/2;
+}
+
+// Error of the hands against the ULP's net time, `t` secs after they were left `err` secs off with the hands held
+// for `held` secs
+int accuracy_catch_up(int err, int held, int t) {
+  if (err < 0) return -err < TOLERANCE_SS ? err : min(err + t * (FWD_TICKS_PER_SEC - 1), 0);
+  int limit = max(hold_limit(), held);
+  if (err > limit) {
+    if (err < TOLERANCE_SS) return err;
+    int rev_secs = (err - limit) / (REV_TICKS_PER_SEC + 1);
+    if (t < rev_secs) return err - t * (REV_TICKS_PER_SEC + 1);
+    err -= rev_secs * (REV_TICKS_PER_SEC + 1);
+    t -= rev_secs;
+  }
+  return max(err - t, 0);
+}
+
+// Count the interval from the last sync to net time `secs`, where the hands are `err` secs off true time and the ULP's
+// net time `drift` secs. Returns the length of the interval (secs), or -1 if there was no sync before.
+int accuracy_interval(int secs, int err, int drift) {
+  uint32_t worst = abs(err);
+  int interval = -1;
+  if (ACCURACY_LAST != ACCURACY_NONE) {
+    int start = LO_WORD(ACCURACY_LAST), start_err = (int16_t)HI_WORD(ACCURACY_LAST);
+    int held = HI_WORD(ACCURACY_PLAN), bound = LO_WORD(ACCURACY_PLAN);
+    interval = (secs - start + NET_12HRS) % NET_12HRS;
+    int residual = err - accuracy_catch_up(start_err, held, interval) - drift;
+    for (int t=0; t<interval; t+=ACCURACY_STEP_SECS) {
+      int step = min(ACCURACY_STEP_SECS, interval - t), mid = t + step/2;
+      int est = abs(accuracy_catch_up(start_err, held, mid) + (int)((int64_t)(drift + residual) * mid / interval));
+      int i = 0;
+      while (i < ACCURACY_BUCKETS-1 && est >= ACCURACY_EDGES[i]) i++;
+      ACCURACY_BUCKET(i) += step;
+      if (est > bound) ACCURACY_OUT += step;
+      worst = max(worst, (uint32_t)est);
+    }
+  }
+  ACCURACY_MAX = max(ACCURACY_MAX, worst);
+  return interval;
+}
+
+// The next interval starts at net time `secs` with the hands `err` secs off
+void accuracy_start(int secs, int err) {
+  err = max(-32768, min(err, 32767));
+  ACCURACY_LAST = MAKE_INT((uint16_t)err, secs);
+  ACCURACY_PLAN = MAKE_INT(_get(VAR_HOLD_SECS), LO_WORD(ACCURACY_PLAN));
+}
+
+// Called at each sync with the new net time (secs since 00:00:00, 12-hr), before it replaces the ULP's
+void accuracy_sync(int secs) {
+  int net = _get(VAR_NET_HH) * 3600 + _get(VAR_NET_MM) * 60 + _get(VAR_NET_SS);
+  int clk = _get(VAR_CLK_HH) * 3600 + _get(VAR_CLK_MM) * 60 + _get(VAR_CLK_SS);
+  int err = accuracy_wrap(clk - secs), drift = accuracy_wrap(net - secs);
+  int interval = accuracy_interval(secs, err, drift);
+  event_log(EV_ACCURACY, 3, err, drift, interval);
+  accuracy_start(secs, err);
+}
+
+// Called after dst_transition() has shifted the ULP's net time by `shift` secs
+void accuracy_shift(int shift) {
+  int net = _get(VAR_NET_HH) * 3600 + _get(VAR_NET_MM) * 60 + _get(VAR_NET_SS);
+  int clk = _get(VAR_CLK_HH) * 3600 + _get(VAR_CLK_MM) * 60 + _get(VAR_CLK_SS);
+  accuracy_interval((net - shift + NET_12HRS) % NET_12HRS, accuracy_wrap(clk - net + shift), 0);
+  accuracy_start(net, accuracy_wrap(clk - net));
+}
+
+// Bucket (as "<edge" or ">=edge") below which `pct` percent of the time was spent
+static void accuracy_percentile(char* buf, int size, uint32_t* count, uint64_t total, int pct) {
+  uint64_t sum = 0;
+  int i = 0;
+  for (; i<ACCURACY_BUCKETS-1; i++) {
+    sum += count[i];
+    if (sum * 100 >= total * pct) break;
+  }
+  if (i < ACCURACY_BUCKETS-1) snprintf(buf, size, "<%d", ACCURACY_EDGES[i]);
+  else snprintf(buf, size, ">=%d", ACCURACY_EDGES[ACCURACY_BUCKETS-2]);
+}
+
+// Send the summary since cold boot, eg. "Accuracy over 72 hrs: p50<2 p95<10 max=31 secs, 12 mins beyond 10 secs"
+void accuracy_report() {
+  uint32_t count[ACCURACY_BUCKETS];
+  uint64_t total = 0;
+  for (int i=0; i<ACCURACY_BUCKETS; i++) total += count[i] = ACCURACY_BUCKET(i);
+  if (total == 0) return;
+  char p50[8], p95[8];
+  accuracy_percentile(p50, sizeof(p50), count, total, 50);
+  accuracy_percentile(p95, sizeof(p95), count, total, 95);
+  status("Accuracy over %d hrs: p50%s p95%s max=%d secs, %d mins beyond %d secs",
+    (int)(total / 3600), p50, p95, ACCURACY_MAX, ACCURACY_OUT / 60, LO_WORD(ACCURACY_PLAN));
+}
@@ -0,0 +1,122 @@
+/*
+ * awake.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Awake time governor. The network session deadline (see session.h) only covers the radio; this budget covers
+// the whole wake, from the moment setup() knows why it was woken until deep sleep. It is set per wake reason and
+// scaled down with VDD in the same way. Jobs that can just as well run at a later wake (firmware update check,
+// syslog flush, fleet beacons) are skipped once it is spent. A wake that goes on for AWAKE_GRACE_MS past its budget
+// anyway, eg. stuck in a flash write, is forced back to deep sleep by a one-shot esp_timer; the ULP keeps the clock
+// going and wakes the main CPU again when the next job falls due. Each forced sleep is counted in RTC_SLOW_MEM with
+// the phase (PHASE_* in profile.h) that overran and logged as EV_AWAKE_OVERRUN.
+//
+// The backstop is only armed on ULP wakes. On cold boot the ULP program is not loaded until the end of setup(),
+// so there would be nothing to wake the main CPU again.
+
+#include <esp_timer.h>
+
+// Budget (ms) at full battery per wake reason: WAKE_NONE, WAKE_RESET_BUTTON, WAKE_UPDATE_NETTIME, WAKE_TUNE_ULP_TIMER,
+// WAKE_DEBUG, WAKE_DST_TRANSITION. A tune includes the fleet beacons of a leader (see fleet.h).
+const int AWAKE_BUDGETS[] = { 30000, 5000, 20000, 30000, 20000, 5000 };
+static_assert(sizeof(AWAKE_BUDGETS)/sizeof(int) == WAKE_COUNT, "AWAKE_BUDGETS needs one entry per wake reason");
+
+#define AWAKE_GRACE_MS          5000                              // Past the budget before the backstop forces deep sleep
+#define AWAKE_HEADER            RTC_SLOW_MEM[RTC_AWAKE_START]     // Bits 0-15 = forced sleeps, bits 16-31 = phase of the last one
+#define AWAKE_SKIPPED           RTC_SLOW_MEM[RTC_AWAKE_START+1]   // Bits 0-15 = jobs skipped, bits 16-31 = JOB_* bits of the last one
+#define AWAKE_OVERRUN           RTC_SLOW_MEM[RTC_AWAKE_START+2]   // Bits 0-15 = elapsed ms, bits 16-31 = budget ms of a forced sleep not yet logged
+
+static bool awake_active = false;
+static int awake_phase_now = PHASE_BOOT;
+static uint32_t awake_start_ms, awake_budget_ms;
+static esp_timer_handle_t awake_timer = NULL;
+
+int awake_budget(int reason) {
+  return vdd_budget(AWAKE_BUDGETS[reason >= 0 && reason < WAKE_COUNT ? reason : WAKE_NONE]);
+}
+
+// Runs in the esp_timer task while the main task is stuck somewhere, possibly halfway through the event log; so
+// only the words below are written here, and the event and snapshot are left to the next wake (see awake_begin())
+static void awake_backstop(void* arg) {
+  uint32_t elapsed = millis() - awake_start_ms;
+  AWAKE_OVERRUN = MAKE_INT(min(awake_budget_ms, (uint32_t)0xffff), min(max(elapsed, (uint32_t)1), (uint32_t)0xffff));
+  AWAKE_HEADER = MAKE_INT(awake_phase_now, LO_WORD(AWAKE_HEADER) + 1);
+  awake_active = false;
+  session_active = false; // Not session_end(), which would write SESSION_WORST
+  esp_sleep_enable_ulp_wakeup();
+  esp_deep_sleep_start();
+}
+
+void awake_suspend() {
+  if (awake_timer != NULL) esp_timer_stop(awake_timer);
+}
+
+// Re-arm the backstop after awake_suspend(); a wake already past its budget is given AWAKE_GRACE_MS from now
+void awake_resume() {
+  if (!awake_active || awake_timer == NULL) return;
+  uint32_t elapsed = millis() - awake_start_ms;
+  esp_timer_start_once(awake_timer, (uint64_t)max((int)(awake_budget_ms + AWAKE_GRACE_MS - elapsed), AWAKE_GRACE_MS) * 1000);
+}
+
+// Start the budget of this wake; when already started, switch to the budget of another reason from the same start
+// (jobs_collect() may turn a wake into a tune). restart forces a new start (eg. after the config portal).
+void awake_begin(int reason, bool restart = false) {
+  if (!awake_active && AWAKE_OVERRUN != 0) {
+    event_log(EV_AWAKE_OVERRUN, 3, HI_WORD(AWAKE_HEADER), LO_WORD(AWAKE_OVERRUN), HI_WORD(AWAKE_OVERRUN));
+    snapshot_log(SNAP_AWAKE_OVERRUN);
+    AWAKE_OVERRUN = 0;
+  }
+  if (!awake_active) awake_phase_now = PHASE_CONFIG;
+  if (!awake_active || restart) awake_start_ms = millis();
+  awake_active = true;
+  awake_budget_ms = awake_budget(reason);
+  if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_ULP) return;
+  if (awake_timer == NULL) {
+    esp_timer_create_args_t args = {};
+    args.callback = awake_backstop;
+    args.name = "awake";
+    if (esp_timer_create(&args, &awake_timer) != ESP_OK) return;
+  }
+  uint32_t elapsed = millis() - awake_start_ms;
+  awake_suspend();
+  esp_timer_start_once(awake_timer, (uint64_t)max((int)(awake_budget_ms + AWAKE_GRACE_MS - elapsed), 1) * 1000);
+}
+
+// Phase the backstop blames if it fires
+void awake_phase(int phase) {
+  awake_phase_now = phase;
+}
+
+// Time left (ms) until the budget is spent; no limit if it has not been started
+uint32_t awake_remaining_ms() {
+  if (!awake_active) return UINT32_MAX;
+  uint32_t elapsed = millis() - awake_start_ms;
+  return elapsed >= awake_budget_ms ? 0 : awake_budget_ms - elapsed;
+}
+
+// Whether there is time left for an optional job; if not, the job is counted as skipped
+bool awake_allows(int job) {
+  if (awake_remaining_ms() > 0) return true;
+  AWAKE_SKIPPED = MAKE_INT(job, LO_WORD(AWAKE_SKIPPED) + 1);
+  event_log(EV_AWAKE_SKIPPED, 3, job, millis() - awake_start_ms, awake_budget_ms);
+  return false;
+}
+
+// Called before going back to sleep
+void awake_end() {
+  awake_suspend();
+  awake_active = false;
+}
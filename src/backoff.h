@@ -0,0 +1,55 @@
+/*
+ * backoff.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Backoff of failed tunes. Each failed try costs a full WiFi session, so rather than retrying every
+// TUNE_INTERVALS[0], the interval doubles with every failure in a row, from TUNE_INTERVALS[0] up to a cap that
+// depends on what failed:
+//
+//   BACKOFF_AP_MISSING       WiFi did not connect; the access point may be down for days, so up to BACKOFF_AP_CAP
+//   BACKOFF_SERVER_FAILING   WiFi connected but no time source answered; up to the interval of the tune level, which
+//                            is how long a successful tune would have waited anyway
+//
+// Each interval is moved by up to 1/BACKOFF_JITTER_DIV either way, so that the clocks behind the same access point
+// do not all come back at once. The first successful sync resets the count.
+
+#define BACKOFF_AP_CAP          (6*60*60)                         // Longest interval (secs) while WiFi does not connect
+#define BACKOFF_JITTER_DIV      4
+#define BACKOFF_STATE           RTC_SLOW_MEM[RTC_BACKOFF_START]   // Bits 0-15 = failed tunes in a row, bits 16-31 = BACKOFF_* of the last one
+
+enum {
+  BACKOFF_NONE,
+  BACKOFF_AP_MISSING,
+  BACKOFF_SERVER_FAILING,
+};
+
+// After a successful tune; the tune level sets the interval again
+void backoff_reset() {
+  if (LO_WORD(BACKOFF_STATE) > 0) event_log(EV_BACKOFF, 3, BACKOFF_NONE, LO_WORD(BACKOFF_STATE), TUNE_INTERVALS[_get(VAR_TUNE_LEVEL)]);
+  BACKOFF_STATE = 0;
+}
+
+// After a failed tune; returns the secs until the next try
+int backoff_failed(int kind) {
+  int failures = min((int)LO_WORD(BACKOFF_STATE) + 1, 0xffff);
+  BACKOFF_STATE = MAKE_INT(kind, failures);
+  int cap = kind == BACKOFF_AP_MISSING ? BACKOFF_AP_CAP : TUNE_INTERVALS[_get(VAR_TUNE_LEVEL)];
+  int interval = min(TUNE_INTERVALS[0] << min(failures - 1, 8), max(cap, TUNE_INTERVALS[0]));
+  interval += random(-interval/BACKOFF_JITTER_DIV, interval/BACKOFF_JITTER_DIV + 1);
+  event_log(EV_BACKOFF, 3, kind, failures, interval);
+  return interval;
+}
@@ -1,3 +1,4 @@
+#define CLOCK_PROFILE           "clock25cm"                       // Shown in the config portal pulse table
 #define SUPPLY_VLOW             3100                              // 4xAA = 4200; 18650 = 3100
 #define NORM_TICK_MS            31                                // Length of forward tick pulse in msecs
 #define NORM_TICK_ON_US         60                                // Duty cycle of forward tick pulse (out of 100us)
@@ -16,6 +16,9 @@
  * limitations under the License.
  */
 
+// Queue record for syslog (see netlog.h)
+void log_append(const char* msg);
+
 #ifdef DEBUG 
 
   void init_debug() {
@@ -23,9 +26,6 @@
   }
 
   void netdebug(const char *format, ...) {
-    WiFiUDP udpClient;
-    Syslog syslog(udpClient, "192.168.1.3", 514, getClockName(), "", LOG_KERN, SYSLOG_PROTO_BSD);
-
     char buf[1024];
     va_list ap;
     va_start(ap, format);
@@ -33,11 +33,7 @@
     va_end(ap);
     
     Serial.println(buf);
-
-    if (WiFi.status() == WL_CONNECTED) { 
-      syslog.log(buf); 
-      delay(500); 
-    }
+    log_append(buf);
   }
 
   void debug(const char *format, ...) {
@@ -57,13 +53,9 @@
 
 #endif // DEBUG
 
-#include <Syslog.h>
 char* getClockName();
 
 void status(const char *format, ...) {
-  WiFiUDP udpClient;
-  Syslog syslog(udpClient, "192.168.1.3", 514, getClockName(), "", LOG_KERN, SYSLOG_PROTO_BSD);
-
   char buf[1024];
   va_list ap;
   va_start(ap, format);
@@ -71,9 +63,5 @@ void status(const char *format, ...) {
   va_end(ap);
   
   Serial.println(buf);
-
-  if (WiFi.status() == WL_CONNECTED) { 
-    syslog.log(buf); 
-    delay(500); 
-  }
+  log_append(buf);
 }
@@ -0,0 +1,60 @@
+/*
+ * drift.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Fractional drift correction. ulp_set_wakeup_period() only takes whole RTC_SLOW_CLK cycles (~6.7us at
+// 150kHz), which is about 100ppm of the sleep between two ULP calls, and every change of the timer
+// shifts the whole cadence. So once the timer is roughly right, it is left alone and the rest of the
+// error is corrected Bresenham style: every second the ULP adds VAR_DRIFT_RATE to the 16-bit
+// accumulator VAR_DRIFT_ACC, and each time it carries, that second is made one ULP call shorter
+// (VAR_DRIFT_DIR == 0) or longer (VAR_DRIFT_DIR == 1). One unit of VAR_DRIFT_RATE is 1/65536 of a
+// call per second, just under 2ppm, and the corrections are spread evenly over the tuning interval.
+//
+// tune_ulp_timer() folds the error measured over each interval into the rate, up to DRIFT_MAX_RATE.
+// Only an error of more than DRIFT_MAX_DIFF secs that the rate cannot take up rescales the ULP timer,
+// which mostly happens at the first tunes after power on.
+
+#define DRIFT_UNITS_PER_SEC     (ULP_CALL_PER_SEC*65536.0)        // Rate units for a correction of 1 sec per sec
+#define DRIFT_MAX_RATE          512                               // ~980ppm; more is left to the ULP timer
+#define DRIFT_MAX_DIFF          5                                 // Error (secs) over an interval that rescales the ULP timer
+
+// Signed correction rate; > 0 when secs are shortened
+int drift_rate() {
+  return _get(VAR_DRIFT_DIR) ? -_get(VAR_DRIFT_RATE) : _get(VAR_DRIFT_RATE);
+}
+
+void drift_set_rate(int rate) {
+  _set(VAR_DRIFT_DIR, rate < 0 ? 1 : 0);
+  _set(VAR_DRIFT_RATE, abs(rate));
+}
+
+// Net time ended up `diff` secs ahead over `interval` secs. Returns the multiplier for the ULP timer:
+// 1 if the rate takes up what it can of the error, otherwise the timer is rescaled for all of it and the
+// rate cleared.
+float drift_update(int diff, int interval) {
+  int old_rate = drift_rate();
+  int rate = old_rate - (int)round(diff * DRIFT_UNITS_PER_SEC / interval);
+  float multiplier = 1;
+  if (abs(rate) > DRIFT_MAX_RATE && abs(diff) > DRIFT_MAX_DIFF) {
+    multiplier = 1 + (float)diff / interval - old_rate / DRIFT_UNITS_PER_SEC;
+    rate = 0;
+  }
+  rate = max(-DRIFT_MAX_RATE, min(rate, DRIFT_MAX_RATE));
+  drift_set_rate(rate);
+  event_log(EV_DRIFT_UPDATE, 2, (int)(old_rate * 1e6 / DRIFT_UNITS_PER_SEC), (int)(rate * 1e6 / DRIFT_UNITS_PER_SEC));
+  return multiplier;
+}
@@ -0,0 +1,52 @@
+/*
+ * dst.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Planned DST transitions. When the time source announces the next change of UTC offset (see nettime.h),
+// dst_plan() has the ULP count down to it in VAR_DST_COUNT, and the ULP wakes the main CPU with
+// WAKE_DST_TRANSITION right on time, without waiting for the next sync. dst_transition() then moves net
+// time by the change. When the clock springs forward, the ULP starts fast-forwarding straight away; when
+// it falls back, the hands are held in VAR_HOLD_SECS for the length of the change instead of reversing,
+// so the hour costs no pulses at all. Every successful sync plans again from the latest answer.
+
+#define DST_PLAN_SECS           65535                             // VAR_DST_COUNT is 16-bit; later transitions are planned by a later sync
+#define DST_MAX_SHIFT           (2*60*60)                         // Largest change of UTC offset in use anywhere
+
+// Plan the transition (if any) announced with the latest net time
+void dst_plan(const net_transition_t* transition) {
+  int secs = transition->secs, shift = transition->shift;
+  if (secs <= 0 || secs > DST_PLAN_SECS || shift == 0 || abs(shift) > DST_MAX_SHIFT || shift % 60 != 0) {
+    _set(VAR_DST_COUNT, 0);
+    return;
+  }
+  if (_get(VAR_DST_COUNT) == 0) event_log(EV_DST_PLAN, 2, secs, shift / 60);
+  _set(VAR_DST_SHIFT, (uint16_t)(shift / 60));
+  _set(VAR_DST_COUNT, secs);
+}
+
+// Called on WAKE_DST_TRANSITION
+void dst_transition() {
+  int shift = (int16_t)_get(VAR_DST_SHIFT) * 60;
+  int net = _get(VAR_NET_HH) * 3600 + _get(VAR_NET_MM) * 60 + _get(VAR_NET_SS);
+  net = ((net + shift) % (12*60*60) + 12*60*60) % (12*60*60);
+  // Hold first, so that the ULP never sees the clock ahead of net time without it
+  if (shift < 0) _set(VAR_HOLD_SECS, -shift);
+  _set(VAR_NET_HH, net / 3600);
+  _set(VAR_NET_MM, (net / 60) % 60);
+  _set(VAR_NET_SS, net % 60);
+  event_log(EV_DST_TRANSITION, 2, shift / 60, _get(VAR_HOLD_SECS));
+}
@@ -20,39 +20,59 @@
 
 // Ordinary variables - not persisted across deep sleep
 static bool shouldSaveConfig = false;
-static char param_tz[48] = "UTC", param_url[128] = DEFAULT_SCRIPT_URL;
-static char buf_timezone[48] = "", buf_clock_time[10] = "", buf_script_url[128] = DEFAULT_SCRIPT_URL;
+static char param_tz[48] = "UTC", param_url[256] = DEFAULT_SCRIPT_URL, param_syslog[64] = "", param_ota_url[128] = "", param_fleet[32] = "";
+static int param_sync_max = DEF_SYNC_MAX, param_hold_max = DEF_HOLD_MAX, param_acc_bound = DEF_ACC_BOUND;
+static char buf_timezone[48] = "", buf_clock_time[10] = "", buf_script_url[256] = DEFAULT_SCRIPT_URL, buf_syslog[64] = "", buf_sync_max[4] = "", buf_hold_max[4] = "", buf_acc_bound[5] = "";
+static char buf_ota_url[128] = "", buf_fleet[32] = "";
 static esp_sleep_wakeup_cause_t wake_cause;
+static bool wifi_preconnecting = false;
 static AsyncWebServer server(80);
 static DNSServer dns;
 static AsyncWiFiManager wifimgr(&server, &dns);
 AsyncWiFiManagerParameter form_clockTime("clockTime", "Time on clock (12-hr HHMMSS)", buf_clock_time, sizeof(buf_clock_time)-1,
   "type=\"number\" autocomplete=\"off\"");
 AsyncWiFiManagerParameter form_timezone("timezone", "TZ database timezone code", buf_timezone, sizeof(buf_timezone)-1);
-AsyncWiFiManagerParameter form_scriptUrl("scriptUrl", "URL to ESPCLOCK script", buf_script_url, sizeof(buf_script_url)-1);
-
-#ifdef DEBUG 
-  void debug_vars(const char* prefix) {
-    debug("%s: wcause=%d, wreason=%d, ct=%02d:%02d:%02d, nt=%02d:%02d:%02d, pause_clock=%d, tickpin=%d, tick_action=%d, "
-      "tick_delay=%d, sleep_count=%05d, sleep_interval=%05d, adc_vdd=%d, adc_vddl=%d, adc_vddh=%d, tune_level=%d, ulp_timer=%d, ulp_call_count=%d, dbg=%d",
-      prefix, wake_cause, _get(VAR_WAKE_REASON), _get(VAR_CLK_HH), _get(VAR_CLK_MM), _get(VAR_CLK_SS), _get(VAR_NET_HH), _get(VAR_NET_MM), _get(VAR_NET_SS), 
-      _get(VAR_PAUSE_CLOCK), _get(VAR_TICKPIN), _get(VAR_TICK_ACTION), _get(VAR_TICK_DELAY), _get(VAR_SLEEP_COUNT), _get(VAR_SLEEP_INTERVAL),
-      _get(VAR_ADC_VDD), _get(VAR_ADC_VDDL), _get(VAR_ADC_VDDH), _get(VAR_TUNE_LEVEL), VAR_ULP_TIMER(), _get(VAR_ULP_CALL_COUNT), _get(VAR_DEBUG)
-    );
+AsyncWiFiManagerParameter form_scriptUrl("scriptUrl", "URLs to ESPCLOCK script (separated by spaces)", buf_script_url, sizeof(buf_script_url)-1);
+AsyncWiFiManagerParameter form_syslog("syslog", "Syslog server host[:port] (optional)", buf_syslog, sizeof(buf_syslog)-1);
+AsyncWiFiManagerParameter form_syncMax("syncMax", "Longest interval between time syncs (mins, 5-120)", buf_sync_max, sizeof(buf_sync_max)-1,
+  "type=\"number\" min=\"5\" max=\"120\"");
+AsyncWiFiManagerParameter form_holdMax("holdMax", "Wait for the time to catch up when the clock is this far ahead (secs, 0-600)", buf_hold_max,
+  sizeof(buf_hold_max)-1, "type=\"number\" min=\"0\" max=\"600\"");
+AsyncWiFiManagerParameter form_accBound("accBound", "Count the time when the clock is off by more than this (secs, 1-3600)", buf_acc_bound,
+  sizeof(buf_acc_bound)-1, "type=\"number\" min=\"1\" max=\"3600\"");
+AsyncWiFiManagerParameter form_otaUrl("otaUrl", "Firmware update server URL (optional)", buf_ota_url, sizeof(buf_ota_url)-1);
+AsyncWiFiManagerParameter form_fleet("fleet", "Fleet name, to share time with nearby clocks (optional)", buf_fleet, sizeof(buf_fleet)-1);
+
+// Number of stack words the ULP has ever written to, found by scanning down from the canary for non-zero words
+int ulp_stack_high_water() {
+  int limit = _get(VAR_STACK_LIMIT);
+  for (int addr=limit-1; addr>=VAR_STACK_REGION; addr--) {
+    if (RTC_SLOW_MEM[addr] != 0) return addr - VAR_STACK_REGION + 1;
   }
-#else // !DEBUG
-  void debug_vars(const char* prefix) {}
-#endif // DEBUG
+  return 0;
+}
+
+// Log EV_VARS snapshot: wake cause, all variables up to VAR_STACK_LIMIT, then the ULP stack high-water mark
+void log_vars() {
+  int32_t args[VAR_STACK_LIMIT+2];
+  args[0] = wake_cause;
+  for (int i=0; i<VAR_STACK_LIMIT; i++) args[i+1] = _get(i);
+  args[VAR_STACK_LIMIT+1] = ulp_stack_high_water();
+  event_log_args(EV_VARS, VAR_STACK_LIMIT+2, args);
+  debug("vars: wcause=%d, wreason=%d, ct=%02d:%02d:%02d, nt=%02d:%02d:%02d, pause_clock=%d, tickpin=%d, tick_action=%d, "
+    "tick_delay=%d, sleep_count=%05d, sleep_interval=%05d, adc_vdd=%d, adc_vddl=%d, adc_vddh=%d, tune_level=%d, ulp_timer=%d, ulp_call_count=%d, "
+    "stack=%d/%d, dbg=%d",
+    wake_cause, _get(VAR_WAKE_REASON), _get(VAR_CLK_HH), _get(VAR_CLK_MM), _get(VAR_CLK_SS), _get(VAR_NET_HH), _get(VAR_NET_MM), _get(VAR_NET_SS), 
+    _get(VAR_PAUSE_CLOCK), _get(VAR_TICKPIN), _get(VAR_TICK_ACTION), _get(VAR_TICK_DELAY), _get(VAR_SLEEP_COUNT), _get(VAR_SLEEP_INTERVAL),
+    _get(VAR_ADC_VDD), _get(VAR_ADC_VDDL), _get(VAR_ADC_VDDH), _get(VAR_TUNE_LEVEL), VAR_ULP_TIMER(), _get(VAR_ULP_CALL_COUNT), 
+    args[VAR_STACK_LIMIT+1], _get(VAR_STACK_LIMIT) - VAR_STACK_REGION, _get(VAR_DEBUG)
+  );
+}
 
-// Application Javascript to be injected into WiFiManager's config page
+// Application Javascript for WiFiManager's config page; the script itself is in portal/espclock.js and served by init_portal()
 #define QUOTE(...) #__VA_ARGS__
 const char* jscript = QUOTE(
-  <script>
-    document.addEventListener('DOMContentLoaded', tzinit, false); 
-    function tzinit() {
-      document.getElementById("timezone").value = Intl.DateTimeFormat().resolvedOptions().timeZone;
-    }
-  </script>
+  <script src="/espclock.js"></script>
 );
 
 /*
@@ -60,9 +80,16 @@ const char* jscript = QUOTE(
  *
  * <?php
  * if (isset($_REQUEST['tz'])) {
+ *   $tz = new DateTimeZone($_REQUEST['tz']);
  *   $time = new DateTime();
- *   $time->setTimezone(new DateTimeZone($_REQUEST['tz']));
+ *   $time->setTimezone($tz);
  *   print $time->format('h:i:s');
+ *   // Optional: secs until the next change of UTC offset and its size in secs (see dst.h)
+ *   $now = $time->getTimestamp();
+ *   $transitions = $tz->getTransitions($now, $now + 366*24*60*60);
+ *   if (count($transitions) > 1) {
+ *     print ' ' . ($transitions[1]['ts'] - $now) . ' ' . ($transitions[1]['offset'] - $transitions[0]['offset']);
+ *   }
  * }
  * ?>
  *
@@ -101,7 +128,10 @@ void fatal_error() {
 }
 
 void init_vars() {
-  memset((void*)RTC_SLOW_MEM, 0, 8192);
+  memset((void*)RTC_SLOW_MEM, 0, VAR_STACK_REGION*sizeof(uint32_t)); // Stack is set up and code loaded by load_and_run_ulp()
+  // RTC_SLOW_MEM is not initialized on power on; main CPU data from ULP_CODE_END up (see ulpdefs.h) starts out zeroed
+  memset((void*)&RTC_SLOW_MEM[ULP_CODE_END], 0, (ULP_MEM_END-ULP_CODE_END)*sizeof(uint32_t));
+  accuracy_init();
   _set(VAR_SLEEP_INTERVAL, TUNE_INTERVALS[_get(VAR_TUNE_LEVEL)]);
   _set(VAR_ULP_TIMERH, HI_WORD(DEF_ULP_TIMER));
   _set(VAR_ULP_TIMERL, LO_WORD(DEF_ULP_TIMER));
@@ -141,13 +171,50 @@ void init_adc() {
 
 void load_and_run_ulp() {
   ulp_set_wakeup_period(0, VAR_ULP_TIMER());
+  // Size stack according to worst-case usage, then place canary word and code right after it
+  ulp_stack_info_t stack;
+  uint32_t stack_limit = ULP_PROG_START - 1;
+  if (ulp_stack_usage(ulp_code, sizeof(ulp_code) / sizeof(ulp_insn_t), &stack)) {
+    stack_limit = VAR_STACK_REGION + stack.stack_words;
+  } else {
+    debug("load_and_run_ulp: ulp_stack_usage() failed; using default layout");
+  }
+  memset((void*)&RTC_SLOW_MEM[VAR_STACK_REGION], 0, (stack_limit - VAR_STACK_REGION)*sizeof(uint32_t));
+  RTC_SLOW_MEM[stack_limit] = ULP_STACK_CANARY;
+  _set(VAR_STACK_LIMIT, stack_limit);
+  uint32_t load_addr = stack_limit + 1;
   size_t size = sizeof(ulp_code) / sizeof(ulp_insn_t);
-  int rc = patched_ulp_process_macros_and_load(ULP_PROG_START, ulp_code, &size);
+  const ulp_insn_t* program = ulp_code;
+  #ifdef ULP_OPTIMIZE
+    // Optimize a copy of the program; fall back to the original if there is no memory for it
+    ulp_insn_t* optimized = (ulp_insn_t*)malloc(sizeof(ulp_code));
+    if (optimized != NULL) {
+      ulp_opt_stats_t stats;
+      memcpy(optimized, ulp_code, sizeof(ulp_code));
+      size = ulp_optimize(optimized, size, &stats);
+      program = optimized;
+      debug("load_and_run_ulp: ulp_optimize() words=%d->%d", stats.words_before, stats.words_after);
+      for (int i=0; i<stats.num_sections; i++) {
+        ulp_opt_section_t* s = &stats.sections[i];
+        debug("load_and_run_ulp: label=%d, words=%d->%d, cycles=%d->%d", 
+          s->label, s->words_before, s->words_after, s->cycles_before, s->cycles_after);
+      }
+    }
+  #endif
+  int rc = patched_ulp_process_macros_and_load(load_addr, program, &size);
+  #ifdef ULP_OPTIMIZE
+    free(optimized);
+  #endif
   if (rc != ESP_OK) {
     debug("patched_ulp_process_macros_and_load() error: %d", rc);
     fatal_error();
   }
-  debug("load_and_run_ulp: ULP code size=%d", size);
+  debug("load_and_run_ulp: ULP code size=%d, stack=%d-%d, code=%d-%d, free=%d", 
+    size, VAR_STACK_REGION, stack_limit-1, load_addr, load_addr+size-1, (int)(ULP_CODE_END-(load_addr+size)));
+  if (load_addr + size > ULP_CODE_END) {
+    debug("load_and_run_ulp: ULP code overlaps main CPU data at %d", ULP_CODE_END);
+    fatal_error();
+  }
   // Calibrate 8M/256 clock against XTAL and patch up I_DELAY() instructions with recalibrated values
   uint32_t rtc_8md256_period;
   while(true) {
@@ -159,14 +226,15 @@ void load_and_run_ulp() {
   uint32_t rtc_fast_freq_hz = 1000000ULL * (1 << RTC_CLK_CAL_FRACT) * 256 / rtc_8md256_period;
   uint32_t ulp_cycles_1ms = round((1.0/1000)/(1.0/rtc_fast_freq_hz));
   for (int i=0; i<size; i++) {
-    int old_inst = RTC_SLOW_MEM[ULP_PROG_START+i];
+    int old_inst = RTC_SLOW_MEM[load_addr+i];
     if ((old_inst & 0xffff0000) == 0x40000000) {
       int interval = old_inst & 0x0000ffff;
       interval *= ulp_cycles_1ms / 8000.0;
-      RTC_SLOW_MEM[ULP_PROG_START+i] = 0x40000000 | interval; 
+      RTC_SLOW_MEM[load_addr+i] = 0x40000000 | interval; 
     }
   }
-  ulp_run(ULP_PROG_START);
+  jitter_calibrate();
+  ulp_run(load_addr);
 }
 
 // Read config parameters from flash
@@ -182,10 +250,16 @@ void load_config(int whichvars = 0) {
   // debug("load_config(): json = %s", json.c_str());
   if (json.length() == 0) return;
   // Parse JSON
-  DynamicJsonDocument dict(512);
+  DynamicJsonDocument dict(1024);
   deserializeJson(dict, json);
   strncpy(param_tz, dict["tz"], sizeof(param_tz)-1);
   strncpy(param_url, dict["url"], sizeof(param_url)-1);
+  if (dict.containsKey("syslog")) strncpy(param_syslog, dict["syslog"], sizeof(param_syslog)-1);
+  if (dict.containsKey("sync_max")) param_sync_max = dict["sync_max"];
+  if (dict.containsKey("hold_max")) param_hold_max = dict["hold_max"];
+  if (dict.containsKey("acc_bound")) param_acc_bound = dict["acc_bound"];
+  if (dict.containsKey("ota_url")) strncpy(param_ota_url, dict["ota_url"], sizeof(param_ota_url)-1);
+  if (dict.containsKey("fleet")) strncpy(param_fleet, dict["fleet"], sizeof(param_fleet)-1);
   if (whichvars != SKIP_RTC_VARS) {
     if (dict.containsKey("hh")) {
       _set(VAR_CLK_HH, dict["hh"]);  
@@ -211,6 +285,9 @@ void load_config(int whichvars = 0) {
       _set(VAR_ULP_TIMERH, HI_WORD(ulp_timer));
       _set(VAR_ULP_TIMERL, LO_WORD(ulp_timer));
     }
+    if (dict.containsKey("drift_rate")) {
+      drift_set_rate(dict["drift_rate"]);
+    }
   }
 //  debug("load_config(): ctime=%02d:%02d:%02d, ntime=%02d:%02d:%02d, tz=%s", 
 //    _get(VAR_CLK_HH), _get(VAR_CLK_MM), _get(VAR_CLK_SS), _get(VAR_NET_HH), _get(VAR_NET_MM), _get(VAR_NET_SS), param_tz);
@@ -218,29 +295,57 @@ void load_config(int whichvars = 0) {
 
 // Write config parameters to flash
 void save_config() {
-  DynamicJsonDocument dict(512);
+  awake_phase(PHASE_SAVE);
+  DynamicJsonDocument dict(1024);
   dict["tz"] = param_tz;
   dict["url"] = param_url;
+  dict["syslog"] = param_syslog;
+  dict["sync_max"] = param_sync_max;
+  dict["hold_max"] = param_hold_max;
+  dict["acc_bound"] = param_acc_bound;
+  dict["ota_url"] = param_ota_url;
+  dict["fleet"] = param_fleet;
   dict["hh"] = _get(VAR_CLK_HH);
   dict["mm"] = _get(VAR_CLK_MM);
   dict["ss"] = _get(VAR_CLK_SS);
   dict["tickpin"] = _get(VAR_TICKPIN);
   dict["tune_level"] = _get(VAR_TUNE_LEVEL);
   dict["ulp_timer"] = VAR_ULP_TIMER();
+  dict["drift_rate"] = drift_rate();
   File file = FILESYS.open(CONFIG_FILE, FILE_WRITE);
   if (!file) fatal_error();
   serializeJson(dict, file);
   file.close();
+  profile_mark(PHASE_SAVE);
   debug("save_config(): ctime=%02d:%02d:%02d, ntime=%02d:%02d:%02d, tz=%s", 
     _get(VAR_CLK_HH), _get(VAR_CLK_MM), _get(VAR_CLK_SS), _get(VAR_NET_HH), _get(VAR_NET_MM), _get(VAR_NET_SS), param_tz);
 }
 
+// If the ULP stack has overrun into the canary word, its code may have been corrupted as well.
+// Save the clock position while it is still trustworthy and restart from scratch.
+void check_ulp_stack() {
+  if (RTC_SLOW_MEM[_get(VAR_STACK_LIMIT)] == ULP_STACK_CANARY) return;
+  event_log(EV_STACK_OVERFLOW, 1, _get(VAR_STACK_LIMIT) - VAR_STACK_REGION);
+  log_vars();
+  snapshot_log(SNAP_STACK_OVERFLOW);
+  trace_dump();
+  save_config();
+  rtc_reset();
+}
+
 // Parse config values entered in WifiManager's form
 void parse_config() {
   char clocktime[7] = {0};
   strncpy(param_tz, form_timezone.getValue(), sizeof(param_tz) - 1);
   strncpy(param_url, form_scriptUrl.getValue(), sizeof(param_url) - 1);
+  strncpy(param_syslog, form_syslog.getValue(), sizeof(param_syslog) - 1);
+  strncpy(param_ota_url, form_otaUrl.getValue(), sizeof(param_ota_url) - 1);
+  strncpy(param_fleet, form_fleet.getValue(), sizeof(param_fleet) - 1);
   strncpy(clocktime, form_clockTime.getValue(), sizeof(clocktime) - 1); 
+  int sync_max = atoi(form_syncMax.getValue()) * 60;
+  if (sync_max > 0) param_sync_max = max(TUNE_INTERVALS[0], min(sync_max, DEF_SYNC_MAX));
+  if (strlen(form_holdMax.getValue()) > 0) param_hold_max = max(0, min(atoi(form_holdMax.getValue()), HOLD_MAX_LIMIT));
+  if (atoi(form_accBound.getValue()) > 0) param_acc_bound = min(atoi(form_accBound.getValue()), ACC_BOUND_LIMIT);
   int clock = atoi(clocktime);
   if (clock < 10000) clock *= 100;
   int ss = clock % 100; if (ss >= 60) ss = 0;
@@ -267,32 +372,128 @@ char* getClockName() {
   return clockname;
 }
 
+// Serve the gzipped assets generated by portalbuilder.py straight from flash, plus the pulse table for espclock.js
+void init_portal() {
+  static bool done = false;
+  if (done) return;
+  done = true;
+  for (size_t i=0; i<sizeof(portal_assets)/sizeof(portal_asset_t); i++) {
+    const portal_asset_t* asset = &portal_assets[i];
+    server.on(asset->path, HTTP_GET, [asset](AsyncWebServerRequest* request) {
+      AsyncWebServerResponse* response = request->beginResponse_P(200, asset->content_type, asset->data, asset->len);
+      response->addHeader("Content-Encoding", "gzip");
+      response->addHeader("Cache-Control", "max-age=86400");
+      request->send(response);
+    });
+  }
+  server.on("/pulse.json", HTTP_GET, [](AsyncWebServerRequest* request) {
+    char json[256];
+    snprintf(json, sizeof(json), "{\"profile\":\"%s\",\"norm\":[%d,%d,%d],\"fwd\":[%d,%d,%d],\"reva\":[%d,%d,%d,%d],\"revb\":[%d,%d,%d,%d],\"rev\":%d}",
+      CLOCK_PROFILE, NORM_TICK_MS, NORM_TICK_ON_US, NORM_COUNT_MASK, FWD_TICK_MS, FWD_TICK_ON_US, FWD_COUNT_MASK,
+      REV_TICKA_T1_MS, REV_TICKA_T2_MS, REV_TICKA_T3_MS, REV_TICKA_ON_US, REV_TICKB_T1_MS, REV_TICKB_T2_MS, REV_TICKB_T3_MS, REV_TICKB_ON_US,
+      REV_COUNT_MASK);
+    request->send(200, "application/json", json);
+  });
+}
+
+// On a ULP wake for net time, start associating with the stored credentials before flash is even mounted. The WiFi
+// driver runs association and DHCP in its own task on the other core, so it overlaps mounting, loading the config
+// and collecting the batch on this one; init_wifi() then only waits for what is left of it. Not for a fleet follower,
+// which may get net time from a beacon without associating at all (see fleet.h).
+void wifi_preconnect() {
+  wifi_preconnecting = false;
+  if (!(_get(VAR_WAKE_JOBS) & (JOB_SYNC | JOB_TUNE)) || _get(VAR_ADC_VDD) < _get(VAR_ADC_VDDL) || fleet_follower()) return;
+  session_begin(_get(VAR_WAKE_REASON)); // The radio is on from now
+  WiFi.mode(WIFI_STA);
+  WiFi.begin();
+  wifi_preconnecting = true;
+}
+
+// Called by WiFiManager once WiFi connects with the credentials submitted in the config portal
+void save_config_callback() {
+  shouldSaveConfig = true;
+}
+
+// Nobody completed the config portal within SETUP_PORTAL_SECS. Rather than keep the radio up until someone does, the
+// clock goes to deep sleep paused the same way as with the button (VAR_PAUSE_CLOCK == 2), with the ULP watching it.
+// A click restarts the clock and wakes the main CPU, which finds no config on flash and opens the portal again (see
+// wakeup_ulp()); RTC memory, including the event log, is kept meanwhile.
+void await_setup() {
+  event_log(EV_SETUP_WAIT, 1, SETUP_PORTAL_SECS);
+  _set(VAR_PAUSE_CLOCK, 2);
+  _set(VAR_WAKE_JOBS, 0);
+}
+
 // Connect to WiFi using WiFiManager
 bool init_wifi(int timeout = 10) {
+  init_portal();
   wifimgr.setDebugOutput(false);
   wifimgr.setCustomHeadElement(jscript);
   wifimgr.addParameter(&form_clockTime);
   wifimgr.addParameter(&form_timezone);
   wifimgr.addParameter(&form_scriptUrl);
+  wifimgr.addParameter(&form_syslog);
+  wifimgr.addParameter(&form_syncMax);
+  wifimgr.addParameter(&form_holdMax);
+  wifimgr.addParameter(&form_accBound);
+  wifimgr.addParameter(&form_otaUrl);
+  wifimgr.addParameter(&form_fleet);
+  awake_phase(PHASE_WIFI);
 	
   pinMode(LED_BUILTIN, OUTPUT);
   digitalWrite(LED_BUILTIN, HIGH); // Note: built-in LED for ESP32 D1 Mini is active high
 
   bool success = false;
+  int reason = wake_cause == ESP_SLEEP_WAKEUP_ULP ? _get(VAR_WAKE_REASON) : WAKE_NONE;
   if (FILESYS.exists(CONFIG_FILE)) {
 //    debug("wifimgr.autoConnect()");
-    wifimgr.setConfigPortalTimeout(timeout);
-    success = wifimgr.autoConnect(getClockName());
-    debug("wifimgr.autoConnect(); success = %d", success);
+    // Split what is left of the session between connecting and the config portal opened if that fails
+    session_begin(reason);
+    int secs = session_remaining_ms() / 1000;
+    if (secs < 1) {
+      session_overrun(SESSION_CONNECT);
+      return false;
+    }
+    int portal_secs = min(timeout, max(secs/2, SESSION_MIN_PORTAL_SECS));
+    wifimgr.setConfigPortalTimeout(portal_secs);
+    if (wifi_preconnecting) {
+      // Association started by wifi_preconnect() gets what is left of the connect time; the portal opens if it fails
+      wl_status_t status;
+      uint32_t start = millis(), wait_ms = (uint32_t)max(secs - portal_secs, 1) * 1000;
+      while ((status = WiFi.status()) != WL_CONNECTED && status != WL_NO_SSID_AVAIL && status != WL_CONNECT_FAILED
+        && millis() - start < wait_ms) delay(1);
+      wifi_preconnecting = false;
+      success = status == WL_CONNECTED || wifimgr.startConfigPortal(getClockName());
+    } else {
+      wifimgr.setConnectTimeout(max(secs - portal_secs, 1));
+      success = wifimgr.autoConnect(getClockName());
+    }
+    event_log(EV_WIFI, 2, 0, success);
+    if (!success && session_expired()) session_overrun(SESSION_CONNECT);
   } else {
+    // Open for SETUP_PORTAL_SECS at most (kept open while a device is connected to it); nobody completing the form
+    // by then leaves the clock awaiting setup
     debug("wifimgr.startConfigPortal()");
+    awake_suspend();
+    shouldSaveConfig = false;
+    wifimgr.setSaveConfigCallback(save_config_callback);
+    wifimgr.setConfigPortalTimeout(SETUP_PORTAL_SECS);
     success = wifimgr.startConfigPortal(getClockName());
-    parse_config();
-    save_config();
-    debug("wifimgr.startConfigPortal(); success = %d", success);
+    profile_mark(PHASE_WIFI);
+    if (shouldSaveConfig) {
+      parse_config();
+      save_config();
+      _set(VAR_PAUSE_CLOCK, 0);
+    } else {
+      await_setup();
+    }
+    event_log(EV_WIFI, 2, 1, success);
+    session_begin(reason, true); // Time spent by the user in the portal does not count
+    awake_begin(reason, true);
   }
   
 	digitalWrite(LED_BUILTIN, LOW);
+  profile_mark(PHASE_WIFI);
 
   if (!success) return false;
 
@@ -302,180 +503,228 @@ bool init_wifi(int timeout = 10) {
   return true; 
 }
 
+// Get network time from the configured time sources (see nettime.h)
 bool get_nettime() {
-  String url = param_url;
-  String tz = param_tz;
-  tz.replace("/", "%2F");
-  url.replace("[tz]", tz);
-  WiFiClient wifi;
-  HTTPClient http;
-  http.begin(wifi, url.c_str());
-  int rc = http.GET();
-  if (rc == HTTP_CODE_OK) {
-    String payload = http.getString();
-    if (payload.length() >= 8) {
-      int hh = payload.substring(0, 2).toInt();
-      int mm = payload.substring(3, 5).toInt();
-      int ss = payload.substring(6, 8).toInt();
-      if (hh >= 12) hh -= 12;
-      if (hh < 0 || hh > 23) hh = 0;
-      if (mm < 0 || mm > 59) mm = 0;
-      if (ss < 0 || ss > 59) ss = 0;
-      _set(VAR_DEBUG, 0);
-      _set(VAR_NET_HH, hh);
-      _set(VAR_NET_MM, mm);
-      _set(VAR_NET_SS, ss);
-      return true;
-    }
-  }
-  return false;
+  int secs;
+  net_transition_t transition;
+  awake_phase(PHASE_NETTIME);
+  bool success = nettime_query(param_url, param_tz, &secs, &transition);
+  profile_mark(PHASE_NETTIME);
+  if (!success) return false;
+  accuracy_sync(secs);
+  tune_synced();
+  _set(VAR_DEBUG, 0);
+  _set(VAR_NET_HH, secs / 3600);
+  _set(VAR_NET_MM, (secs / 60) % 60);
+  _set(VAR_NET_SS, secs % 60);
+  dst_plan(&transition);
+  fleet_set_time(secs, &transition);
+  profile_report();
+  return true;
 }
 
-// Get network time and match against internal network time to adjust ULP interval so that we get as close as possible to 1sec
-void tune_ulp_timer() {
+// Get network time (from a fleet beacon if there is one, see fleet.h) and match against internal network time to adjust
+// ULP interval so that we get as close as possible to 1sec. Returns false if no net time was obtained.
+bool tune_ulp_timer() {
   int nethh = _get(VAR_NET_HH), netmm = _get(VAR_NET_MM), netss = _get(VAR_NET_SS), old_sleep_count = _get(VAR_SLEEP_COUNT);
-  if (!init_wifi() || !get_nettime()) {
-    debug("tune_ulp_timer() failed: ct=%02d:%02d:%02d, nt=%02d:%02d:%02d, tune_level=%d, ulp_sleep=%d, vlow=%d, vhigh=%d, vdd=%d", 
-      _get(VAR_CLK_HH), _get(VAR_CLK_MM), _get(VAR_CLK_SS), _get(VAR_NET_HH), _get(VAR_NET_MM), _get(VAR_NET_SS), _get(VAR_TUNE_LEVEL), VAR_ULP_TIMER(), 
-      adc_to_voltage(_get(VAR_ADC_VDDL))*2, adc_to_voltage(_get(VAR_ADC_VDDH))*2, adc_to_voltage(_get(VAR_ADC_VDD))*2);
-    return;
+  int interval = tune_elapsed(); // Longer than VAR_SLEEP_INTERVAL after failed tries (see tune.h)
+  awake_phase(PHASE_WIFI);
+  if (!fleet_listen(param_fleet, param_tz) && (!init_wifi() || !get_nettime())) {
+    event_log(EV_TUNE_FAILED, 3, _get(VAR_TUNE_LEVEL), VAR_ULP_TIMER(), _get(VAR_ADC_VDD));
+    return false;
   }
   int offset = _get(VAR_SLEEP_COUNT) - old_sleep_count;
   time_t diff = ((nethh * 3600L) + (netmm * 60L) + (netss + offset)) - ((_get(VAR_NET_HH) * 3600L) + (_get(VAR_NET_MM) * 60L) + _get(VAR_NET_SS));
   if (abs(diff) > 60) {
-    char prefix[512]; 
-    sprintf(prefix, "tune_ulp_timer() aborted (mac=%s, old_nt=%02d:%02d:%02d, offset=%d, diff=%d)", 
-      WiFi.macAddress().c_str(), nethh, netmm, netss, offset, diff);
-    debug_vars(prefix);
-    return; // Do not adjust timer if net time is off by > 60secs
+    event_log(EV_TUNE_ABORTED, 5, nethh, netmm, netss, offset, (int)diff);
+    log_vars();
+    snapshot_log(SNAP_TUNE_ABORTED);
+    trace_dump();
+    return true; // Do not adjust timer if net time is off by > 60secs
   }
-  float multipler = (float)(_get(VAR_SLEEP_INTERVAL) + diff) / (_get(VAR_SLEEP_INTERVAL));
+  float multipler = drift_update(diff, interval);
   int old_timer = VAR_ULP_TIMER();
   int new_timer = old_timer * multipler;
-  {
-    char prefix[512]; 
-    sprintf(prefix, "tune_ulp_timer() update (mac=%s, old_nt=%02d:%02d:%02d, offset=%d, diff=%d, multiplier=%f, old_ulp_sleep=%d, new_ulp_sleep=%d)", 
-      WiFi.macAddress().c_str(), nethh, netmm, netss, offset, diff, multipler, old_timer, new_timer);
-    debug_vars(prefix);
-  }
+  event_log(EV_TUNE_UPDATE, 8, nethh, netmm, netss, offset, (int)diff, (int)(multipler*1000), old_timer, new_timer);
+  log_vars();
   int tune_level = _get(VAR_TUNE_LEVEL);
-  if (tune_level < (sizeof(TUNE_INTERVALS)/sizeof(int))-1) {
+  if (tune_level < (sizeof(TUNE_INTERVALS)/sizeof(int))-1 && TUNE_INTERVALS[tune_level+1] <= param_sync_max) {
     tune_level += 1;
     _set(VAR_TUNE_LEVEL, tune_level);
     _set(VAR_SLEEP_INTERVAL, TUNE_INTERVALS[tune_level]);
   }
-  if (abs(diff) <= 5) return; // Do not adjust ULP timer if net time is off by <= 5secs
   _set(VAR_ULP_TIMERH, HI_WORD(new_timer));
   _set(VAR_ULP_TIMERL, LO_WORD(new_timer));
   if (old_timer != new_timer) { 
     ulp_set_wakeup_period(0, VAR_ULP_TIMER());
   }
+  return true;
 }
 
-void startup() {
-  // Perform factory reset?
-  pinMode(RESETBTN_PIN_GPIO, INPUT_PULLUP);
-  bool reset_btn = !digitalRead(RESETBTN_PIN_GPIO);
-  if (reset_btn && FILESYS.exists(CONFIG_FILE)) {
-    delay(500);
-    FILESYS.remove(CONFIG_FILE);
-    clear_wifi_credentials();
-    rtc_reset();
+// Download a firmware update from the update server if a check is due, then apply it with the radio off and
+// restart into the new image (see ota.h). The clock position is saved first, as in check_ulp_stack(). A check is
+// left due for the next tune if the awake time budget is spent (see awake.h).
+void update_firmware() {
+  if (!ota_due(param_ota_url) || !awake_allows(JOB_OTA_CHECK)) return;
+  awake_phase(PHASE_NETTIME);
+  int rc = ota_download(param_ota_url);
+  profile_mark(PHASE_NETTIME);
+  if (rc != OTA_READY) return;
+  log_flush(param_syslog);
+  WiFi.disconnect(true);
+  awake_suspend(); // An update being written to flash is never cut short
+  if (ota_apply() != OTA_OK) {
+    awake_resume();
+    return;
   }
+  save_config();
+  rtc_reset();
+}
 
-  // Init config and overwrite with config from flash if available
-  init_vars();
-  load_config();
+// On cold boot, or on resume from awaiting setup (see await_setup()) with the ULP already running
+void startup(bool resume = false) {
+  if (!resume) {
+    // Perform factory reset?
+    pinMode(RESETBTN_PIN_GPIO, INPUT_PULLUP);
+    bool reset_btn = !digitalRead(RESETBTN_PIN_GPIO);
+    if (reset_btn && FILESYS.exists(CONFIG_FILE)) {
+      delay(500);
+      FILESYS.remove(CONFIG_FILE);
+      clear_wifi_credentials();
+      rtc_reset();
+    }
 
-  // Initialize ADC and GPIO
-  init_adc(); _set(VAR_ADC_VDD, _get(VAR_ADC_VDDH));
-  init_gpio();
+    // Init config and overwrite with config from flash if available
+    init_vars();
+    load_config();
+    profile_mark(PHASE_CONFIG);
+
+    // Initialize ADC and GPIO
+    init_adc(); _set(VAR_ADC_VDD, _get(VAR_ADC_VDDH));
+    init_gpio();
+  }
 
   // Skip if VDD is below minimum threshold
   if (_get(VAR_ADC_VDD) >= _get(VAR_ADC_VDDL)) {
-    if (!FILESYS.exists(CONFIG_FILE)) {
-      init_wifi();
-      debug("startup(): factory reset");
-    } else {
-      debug("startup(): normal");
-    }
-    // Schedule net time update in 5s
-    _set(VAR_UPDATE_PENDING, 5);
+    // Update net time in the same WiFi session as the config portal, rather than waking for it (see jobs.h)
+    bool configured = FILESYS.exists(CONFIG_FILE);
+    jobs_startup();
+    bool connected = init_wifi();
+    if (!FILESYS.exists(CONFIG_FILE)) return; // Awaiting setup
+    int oldhh = _get(VAR_NET_HH), oldmm = _get(VAR_NET_MM), oldss = _get(VAR_NET_SS); // From the portal or the saved config
+    event_log(EV_STARTUP, 1, !configured);
+    bool rc = connected && get_nettime();
+    if (connected) event_log(EV_NETTIME_UPDATE, 4, rc, oldhh, oldmm, oldss);
+    // Otherwise try again in 5s
+    if (!rc) _set(VAR_UPDATE_PENDING, 5);
+  } else if (resume) {
+    await_setup();
   }
 }
 
-void wakeup_ulp() {
+// Called on a ULP wake before flash is mounted
+void wakeup_ulp_early() {
   // This needs to be done ASAP, otherwise ULP will hang at I_ADC()
   adc1_ulp_enable();
+  trace_snapshot();
+  wifi_preconnect();
+}
+
+void wakeup_ulp() {
+  // Awaiting setup, and the button has restarted the clock: open the config portal again, with the hands held
+  if (!FILESYS.exists(CONFIG_FILE)) {
+    _set(VAR_PAUSE_CLOCK, 1);
+    _set(VAR_WAKE_JOBS, 0);
+    startup(true);
+    return;
+  }
 
   // If VDD is below minimum level, save config to flash and fall back to deep sleep
   load_config(SKIP_RTC_VARS);
+  profile_mark(PHASE_CONFIG);
+  check_ulp_stack();
   if (_get(VAR_ADC_VDD) < _get(VAR_ADC_VDDL)) {
+    event_log(EV_LOW_VDD, 2, _get(VAR_ADC_VDD), _get(VAR_ADC_VDDL));
+    _set(VAR_WAKE_JOBS, 0); // Dropped; the ULP restarts the clock with a net time update once VDD recovers
     save_config();
     return;
   }
 
-  // Otherwise, handle ULP wakeup reason
-  switch(_get(VAR_WAKE_REASON)) {
-    case WAKE_UPDATE_NETTIME: {
-      int oldhh = _get(VAR_NET_HH), oldmm = _get(VAR_NET_MM), oldss = _get(VAR_NET_SS);
-      if (init_wifi()) {
-        bool rc = get_nettime();
-        char prefix[64]; 
-        sprintf(prefix, "Update nettime (rc=%d; old_nt=%02d:%02d:%02d)", rc, oldhh, oldmm, oldss);
-        debug_vars(prefix);
+  // Otherwise, run the batch of jobs due (see jobs.h); the network jobs share one WiFi session, and the awake time
+  // budget follows the batch
+  int jobs = jobs_collect(param_fleet);
+  awake_begin(_get(VAR_WAKE_REASON));
+  if (jobs & JOB_BUTTON) {
+    if (_get(VAR_PAUSE_CLOCK) == 1) {
+      // For the next second, check if reset button is held down. If so, perform reset.
+      bool long_press = true;
+      for (int i=0; i<1000/5; i++) {
+        if (digitalRead(RESETBTN_PIN_GPIO) == HIGH) {
+          long_press = false;
+          break;
+        }
+        delay(5);
       }
-      save_config();
-      break;
-    }
-    case WAKE_TUNE_ULP_TIMER: {
-      tune_ulp_timer();
-      save_config();
-      if (!WiFi.isConnected()) {
-        debug("WiFi disconnected; temporarily reset sleep_interval to 5 mins");
-        _set(VAR_SLEEP_INTERVAL, TUNE_INTERVALS[0]);
+      if (long_press) {
+        event_log(EV_LONG_PRESS, 0);
+        save_config();
+        delay(500);
+        rtc_reset();
       } else {
-        _set(VAR_SLEEP_INTERVAL, TUNE_INTERVALS[_get(VAR_TUNE_LEVEL)]);
+        event_log(EV_PAUSED, 0);
+        trace_dump();
+        // Queued until the next WiFi session, at the latest when the clock is restarted
+        status("Clocked paused C[%02d:%02d:%02d], N[%02d:%02d:%02d]", 
+         _get(VAR_CLK_HH), _get(VAR_CLK_MM), _get(VAR_CLK_SS), _get(VAR_NET_HH), _get(VAR_NET_MM), _get(VAR_NET_SS));
+        _set(VAR_PAUSE_CLOCK, 2);
       }
-      break;
     }
-    case WAKE_RESET_BUTTON: {
-      save_config();
-      if (_get(VAR_PAUSE_CLOCK) == 1) {
-        // For the next second, check if reset button is held down. If so, perform reset.
-        bool long_press = true;
-        for (int i=0; i<1000/5; i++) {
-          if (digitalRead(RESETBTN_PIN_GPIO) == HIGH) {
-            long_press = false;
-            break;
-          }
-          delay(5);
-        }
-        if (long_press) {
-          delay(500);
-          rtc_reset();
-        } else {
-          if (init_wifi()) {
-            status("Clocked paused C[%02d:%02d:%02d], N[%02d:%02d:%02d]", 
-             _get(VAR_CLK_HH), _get(VAR_CLK_MM), _get(VAR_CLK_SS), _get(VAR_NET_HH), _get(VAR_NET_MM), _get(VAR_NET_SS));
-          }
-          _set(VAR_PAUSE_CLOCK, 2);
-        }
-      }
-      break;
+  }
+  if (jobs & JOB_DST) {
+    dst_transition();
+    accuracy_shift((int16_t)_get(VAR_DST_SHIFT) * 60);
+  }
+  if (jobs & JOB_TUNE) {
+    if (tune_ulp_timer()) {
+      backoff_reset();
+      _set(VAR_SLEEP_INTERVAL, TUNE_INTERVALS[_get(VAR_TUNE_LEVEL)]);
+      fleet_lead(param_fleet, param_tz);
+      fleet_schedule(param_fleet);
+    } else {
+      _set(VAR_SLEEP_INTERVAL, backoff_failed(WiFi.isConnected() ? BACKOFF_SERVER_FAILING : BACKOFF_AP_MISSING));
     }
+  } else if (jobs & JOB_SYNC) {
+    int oldhh = _get(VAR_NET_HH), oldmm = _get(VAR_NET_MM), oldss = _get(VAR_NET_SS);
+    if (init_wifi()) {
+      bool rc = get_nettime();
+      event_log(EV_NETTIME_UPDATE, 4, rc, oldhh, oldmm, oldss);
+      log_vars();
+    }
+  }
+  if (jobs & (JOB_TUNE | JOB_SYNC)) {
+    jitter_report();
+    accuracy_report();
   }
+  if (jobs & JOB_SAVE_CONFIG) save_config();
+  if (jobs & JOB_OTA_CHECK) update_firmware();
 }
 
 void setup() {
   // Initialization
+  profile_begin();
+  profile_mark(PHASE_BOOT);
   setCpuFrequencyMhz(80); // Reduce CPU frequency to save power
   WRITE_PERI_REG(RTC_CNTL_BROWN_OUT_REG, 0); // Disable brownout for more stable battery operation
   init_debug();
-  if (!FILESYS.begin(true)) fatal_error();
 
   // This function is called either due to initial powerup or ULP wakeup
   wake_cause = esp_sleep_get_wakeup_cause();
+  #ifndef STRESS_TEST
+    if (wake_cause == ESP_SLEEP_WAKEUP_ULP) wakeup_ulp_early();
+  #endif
+  if (!FILESYS.begin(true)) fatal_error();
+  profile_mark(PHASE_FILESYS);
+
   #ifdef STRESS_TEST
     switch(wake_cause) {
       case ESP_SLEEP_WAKEUP_UNDEFINED: {
@@ -504,10 +753,11 @@ void setup() {
         break;
     }
   #else // !STRESS_TEST
+    awake_begin(wake_cause == ESP_SLEEP_WAKEUP_ULP ? _get(VAR_WAKE_REASON) : WAKE_NONE);
     switch(wake_cause) {
       case ESP_SLEEP_WAKEUP_UNDEFINED:
         startup();
-        debug_vars("startup()");
+        log_vars();
         break;
       case ESP_SLEEP_WAKEUP_ULP:
         wakeup_ulp();
@@ -515,12 +765,25 @@ void setup() {
     }
   #endif // STRESS_TEST
 
+  // Send queued syslog records while WiFi is still up from this batch, if at all
+  if ((jobs_batch & JOB_FLUSH_LOG) && awake_allows(JOB_FLUSH_LOG)) {
+    awake_phase(PHASE_REPORT);
+    log_flush(param_syslog);
+  }
+
+  // Apply the configured hold limit and accuracy bound, which may have just been loaded or changed in the portal
+  hold_plan(param_hold_max);
+  accuracy_plan(param_acc_bound);
+
   // Power off RTC FAST MEM during deep sleep to save power
   esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_FAST_MEM, ESP_PD_OPTION_OFF);
 
   // Sleep now and let ULP take over
   if (wake_cause == ESP_SLEEP_WAKEUP_UNDEFINED) load_and_run_ulp(); 
   esp_sleep_enable_ulp_wakeup(); 
+  session_end();
+  awake_end();
+  profile_end(wake_cause == ESP_SLEEP_WAKEUP_ULP ? _get(VAR_WAKE_REASON) : WAKE_NONE);
   esp_deep_sleep_start();
 }
 
@@ -27,7 +27,6 @@
 #include <WiFiClient.h>
 #include <ESPAsyncWebServer.h>
 #include <ESPAsyncWiFiManager.h>
-#include <HTTPClient.h>
 #include <EEPROM.h>
 
 // Uncomment to perform stress test of fastforward/reverse clock movement
@@ -39,6 +38,15 @@
 // Uncomment to make debugging function "serial()" via serial interface available
 //#define DEBUG
 
+// Comment out to load the ULP program exactly as written, without the peephole optimizer pass
+#define ULP_OPTIMIZE
+
+// Comment out to disable wake phase timing and its report via "status()" after each time sync
+#define PROFILE
+
+// Uncomment to have the ULP trace its control flow into RTC memory, dumped to the event log when the clock is paused or a tune is aborted
+//#define ULP_TRACE
+
 #include "debug.h"
 
 // Default values
@@ -46,6 +54,11 @@
 #define CONFIG_FILE             "/espclock.ini"
 #define FILESYS                 LittleFS
 
+// Public key (PEM) of the update server's signing key (see otaserver.py); firmware updates are refused without one
+#ifndef OTA_PUBLIC_KEY
+#define OTA_PUBLIC_KEY          ""
+#endif
+
 // Utility macros
 #define LO_WORD(x)            ((uint16_t)((x) & 0x0000ffff))
 #define HI_WORD(x)            ((uint16_t)(((x) & 0xffff0000) >> 16))
@@ -58,6 +71,67 @@
 // Tuning intervals for ULP timer so that we get as close to 1sec/tick as possible
 // Start with: 5min, 15min, 30min, 1hr, 2hr (max)
 int TUNE_INTERVALS[] = { 5*60, 15*60, 30*60, 60*60, 2*60*60 };
+#define DEF_SYNC_MAX          (2*60*60)                           // Default for the longest tuning interval; can be lowered in the config portal
+#define DEF_HOLD_MAX          120                                 // Default for the largest lead (secs) held rather than reversed; see hold.h
+#define DEF_ACC_BOUND         10                                  // Default for the error (secs) beyond which the time is counted; see accuracy.h
+#define SETUP_PORTAL_SECS     600                                 // How long the config portal stays open for setup before the clock waits for the button
 
 // ULP program
 #include "ulpcode.h"
+
+// Binary event log
+#include "eventlog.h"
+
+// RTC state snapshots for replay on the native build
+#include "snapshot.h"
+
+// Wake phase profiler
+#include "profile.h"
+
+// Network session deadline
+#include "session.h"
+
+// Time since the last sync
+#include "tune.h"
+
+// Awake time budget for each wake
+#include "awake.h"
+
+// Network time sources
+#include "nettime.h"
+
+// Planned DST transitions
+#include "dst.h"
+
+// Holding the hands instead of reversing
+#include "hold.h"
+
+// Fractional drift correction
+#include "drift.h"
+
+// Displayed time error summary
+#include "accuracy.h"
+
+// Backoff of failed tunes
+#include "backoff.h"
+
+// Delta firmware updates
+#include "ota.h"
+
+// Peer time sharing over ESP-NOW
+#include "fleet.h"
+
+// Job batches for each wake of the main CPU
+#include "jobs.h"
+
+// ULP slot length histogram
+#include "jitter.h"
+
+// ULP execution trace
+#include "trace.h"
+
+// Buffered syslog
+#include "netlog.h"
+
+// Config portal assets (generated by portalbuilder.py)
+#include "portal_assets.h"
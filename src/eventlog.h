@@ -0,0 +1,121 @@
+/*
+ * eventlog.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Binary event log. Each record is a few bytes: event ID, length of args, network time (secs since 00:00:00,
+// 12-hr) and the integer args as zigzag varints. Records are kept in RTC_SLOW_MEM (oldest dropped when full)
+// and sent as hex by log_flush() in netlog.h. eventlog.py expands them back into text using the formats
+// below, which it reads from this file; DEBUG builds also print them to Serial as they are logged.
+// Only append new events at the end of the table so that old logs still decode correctly.
+
+#define EVENT_TABLE(EVENT) \
+  EVENT(EV_VARS,            "vars") /* Snapshot of wake cause, VAR_* and ULP stack high-water mark; see log_vars() */ \
+  EVENT(EV_STARTUP,         "startup(): factory_reset=%d") \
+  EVENT(EV_STACK_OVERFLOW,  "check_ulp_stack(): stack canary overwritten, stack_words=%d") \
+  EVENT(EV_LOW_VDD,         "wakeup_ulp(): low VDD, adc_vdd=%d, adc_vddl=%d") \
+  EVENT(EV_WIFI,            "init_wifi(): portal=%d, success=%d") \
+  EVENT(EV_NETTIME,         "get_nettime(): http_rc=%d") /* No longer logged; see EV_NETTIME_SOURCE */ \
+  EVENT(EV_NETTIME_UPDATE,  "Update nettime (rc=%d; old_nt=%02d:%02d:%02d)") \
+  EVENT(EV_TUNE_FAILED,     "tune_ulp_timer() failed: tune_level=%d, ulp_sleep=%d, adc_vdd=%d") \
+  EVENT(EV_TUNE_ABORTED,    "tune_ulp_timer() aborted (old_nt=%02d:%02d:%02d, offset=%d, diff=%d)") \
+  EVENT(EV_TUNE_UPDATE,     "tune_ulp_timer() update (old_nt=%02d:%02d:%02d, offset=%d, diff=%d, multiplier=%d/1000, old_ulp_sleep=%d, new_ulp_sleep=%d)") \
+  EVENT(EV_WIFI_DOWN,       "WiFi disconnected; temporarily reset sleep_interval to %d secs") /* No longer logged; see EV_BACKOFF */ \
+  EVENT(EV_PAUSED,          "Clock paused") \
+  EVENT(EV_LONG_PRESS,      "Reset button long press") \
+  EVENT(EV_PROFILE,         "Wake profile: reason=%d, boot=%d, fs=%d, cfg=%d, wifi=%d, net=%d, rpt=%d, save=%d, sleep=%d (ms)") \
+  EVENT(EV_NETTIME_SOURCE,  "get_nettime(): source=%d, latency=%d ms, secs=%d") \
+  EVENT(EV_NETTIME_RESULT,  "get_nettime(): sources=%d, answers=%d, secs=%d") \
+  EVENT(EV_SESSION_OVERRUN, "Network session deadline reached: step=%d, elapsed=%d ms, budget=%d ms") \
+  EVENT(EV_DST_PLAN,        "DST transition planned in %d secs, shift=%d mins") \
+  EVENT(EV_DST_TRANSITION,  "DST transition: shift=%d mins, hold=%d secs") \
+  EVENT(EV_HOLD_PLAN,       "Hold hands up to %d secs ahead: saves %d ms of pulses over reversing in %d secs") \
+  EVENT(EV_DRIFT_UPDATE,    "Drift correction: %d -> %d ppm") \
+  EVENT(EV_OTA_DOWNLOAD,    "ota_download(): http_rc=%d, received=%d, staged=%d/%d bytes, elapsed=%d ms") \
+  EVENT(EV_OTA_APPLY,       "ota_apply(): rc=%d, written=%d bytes, elapsed=%d ms") \
+  EVENT(EV_FLEET_LISTEN,    "fleet_listen(): leader=%d, elapsed=%d ms, secs=%d") \
+  EVENT(EV_FLEET_LEAD,      "fleet_lead(): window=%d, beacons=%d, yielded_to=%d") \
+  EVENT(EV_JOBS,            "jobs_collect(): woken=0x%02x, batch=0x%02x, tune_in=%d secs") \
+  EVENT(EV_ULP_TRACE,       "ULP trace") /* Trace records, oldest first, two per arg; see trace.h */ \
+  EVENT(EV_AWAKE_SKIPPED,   "Awake time budget spent: job=0x%02x skipped, elapsed=%d ms, budget=%d ms") \
+  EVENT(EV_AWAKE_OVERRUN,   "Awake time budget overrun: forced to sleep in phase=%d, elapsed=%d ms, budget=%d ms") \
+  EVENT(EV_SNAPSHOT,        "RTC snapshot") /* Version, cause, number of VAR_* words, then the words; see snapshot.h */ \
+  EVENT(EV_SNAPSHOT_STACK,  "RTC snapshot stack") /* ULP stack words from VAR_STACK_REGION */ \
+  EVENT(EV_ACCURACY,        "Accuracy at sync: hands=%d secs, drift=%d secs, interval=%d secs") \
+  EVENT(EV_BACKOFF,         "Tune backoff: kind=%d, failures=%d, retry in %d secs") \
+  EVENT(EV_SETUP_WAIT,      "Config portal closed after %d secs; awaiting setup until the button is pressed")
+
+#define EVENT_ID(id, format)      id,
+#define EVENT_FORMAT(id, format)  format,
+enum { EVENT_TABLE(EVENT_ID) };
+
+#define EVENT_BYTES             ((RTC_EVENT_WORDS-1)*4)           // First word holds bytes used (bits 0-15) and records dropped (bits 16-31)
+#define EVENT_MAX_ARGS          48                                // Record size is one byte, so at most 51 args of 5 bytes
+#define EVENT_HEADER            RTC_SLOW_MEM[RTC_EVENT_START]
+#define EVENT_DATA              ((volatile uint8_t*)&RTC_SLOW_MEM[RTC_EVENT_START+1])
+
+static_assert(VAR_STACK_LIMIT + 2 <= EVENT_MAX_ARGS, "EVENT_MAX_ARGS too small for EV_VARS");
+
+// Append a record; args are packed as zigzag varints so that small values of either sign take 1 byte
+void event_log_args(int id, int argc, const int32_t* args) {
+  uint8_t rec[4 + EVENT_MAX_ARGS*5];
+  int len = 4;
+  uint16_t ts = _get(VAR_NET_HH)*3600 + _get(VAR_NET_MM)*60 + _get(VAR_NET_SS);
+  for (int i=0; i<argc && i<EVENT_MAX_ARGS; i++) {
+    uint32_t v = ((uint32_t)args[i] << 1) ^ (uint32_t)(args[i] >> 31);
+    while (v >= 0x80) {
+      rec[len++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    rec[len++] = v;
+  }
+  rec[0] = id; rec[1] = len-4; rec[2] = ts & 0xff; rec[3] = ts >> 8;
+
+  // Drop oldest records until the new one fits
+  int used = LO_WORD(EVENT_HEADER), dropped = HI_WORD(EVENT_HEADER);
+  if (used > EVENT_BYTES) used = dropped = 0;
+  int skip = 0;
+  while (used - skip + len > EVENT_BYTES) {
+    skip += 4 + EVENT_DATA[skip+1];
+    dropped++;
+  }
+  if (skip > used) skip = used;
+  if (skip > 0) {
+    for (int i=skip; i<used; i++) EVENT_DATA[i-skip] = EVENT_DATA[i];
+    used -= skip;
+  }
+  for (int i=0; i<len; i++) EVENT_DATA[used+i] = rec[i];
+  EVENT_HEADER = MAKE_INT(dropped, used+len);
+}
+
+void event_log(int id, int argc, ...) {
+  int32_t args[EVENT_MAX_ARGS];
+  va_list ap;
+  va_start(ap, argc);
+  for (int i=0; i<argc && i<EVENT_MAX_ARGS; i++) args[i] = va_arg(ap, int);
+  va_end(ap);
+  event_log_args(id, argc, args);
+  #ifdef DEBUG
+    static const char* formats[] = { EVENT_TABLE(EVENT_FORMAT) };
+    if (id != EV_VARS) {
+      char buf[300];
+      va_start(ap, argc);
+      vsnprintf(buf, sizeof(buf), formats[id], ap);
+      va_end(ap);
+      Serial.println(buf);
+    }
+  #endif
+}
@@ -0,0 +1,198 @@
+/*
+ * fleet.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Peer time sharing. Clocks given the same fleet name in the portal (and set to the same timezone) take
+// turns to fetch net time for each other. They all sync at fleet windows, net times that are a multiple
+// of their tuning interval: fleet_schedule() moves the next tune wake onto the next window after every
+// sync. The leader wakes FLEET_LEAD_SECS early, syncs over WiFi as usual, then broadcasts its net time
+// with ESP-NOW every FLEET_BEACON_MS until FLEET_GUARD_SECS past the window. The others only turn the
+// radio on for up to FLEET_LISTEN_MS on the channel of the access point, without associating, and fall
+// back to init_wifi()/get_nettime() if no beacon arrives.
+//
+// There is no election as such. A follower that had to fall back leads from then on, beaconing for what
+// is left of the window, and a leader that hears a beacon from a lower ID steps down. A clock that has
+// never associated does not know the channel yet and syncs over WiFi.
+
+#include <esp_now.h>
+
+#define FLEET_MAGIC             0x54454c46                        // "FLET"
+#define FLEET_LEAD_SECS         6                                 // Leader wakes this much before the window to sync over WiFi first
+#define FLEET_GUARD_SECS        3                                 // Beacons go on this long past the window, for followers whose clock is behind
+#define FLEET_BEACON_MS         20
+#define FLEET_MAX_BEACON_SECS   30                                // Leader that woke this far before a window (before tuning is done) does not beacon
+#define FLEET_LISTEN_MS         60                                // Three beacons
+#define FLEET_STATE             RTC_SLOW_MEM[RTC_FLEET_START]     // Bits 0-7 = AP channel (0 = not known yet), bit 8 = leader
+#define FLEET_LEADER            0x100
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint32_t fleet;                                                 // fleet_hash() of the fleet name and timezone
+  uint32_t id;                                                    // Low 32 bits of the sender's MAC; lowest leader wins
+  uint16_t secs;                                                  // Net time (secs since 00:00:00, 12-hr) ...
+  uint16_t ms;                                                    // ... and ms since that sec began
+  int32_t transition_secs;                                        // Next change of UTC offset as of secs (see nettime.h)
+  int32_t transition_shift;
+} fleet_beacon_t;
+
+static const uint8_t fleet_broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static uint32_t fleet_group;
+static fleet_beacon_t fleet_rx;                                   // Beacon from the lowest ID heard so far
+static volatile bool fleet_received;
+static volatile uint32_t fleet_rx_ms;
+static bool fleet_heard;                                          // Net time of this wake came from a beacon
+static int fleet_net_secs = -1;                                   // Net time from the last WiFi sync, and millis() then
+static uint32_t fleet_net_ms;
+static net_transition_t fleet_transition;
+
+// FNV-1a of "name|tz": clocks in different timezones must not share net time
+uint32_t fleet_hash(const char* name, const char* tz) {
+  uint32_t hash = 0x811c9dc5;
+  for (const char* p = name; *p; p++) hash = (hash ^ (uint8_t)*p) * 0x01000193;
+  hash = (hash ^ '|') * 0x01000193;
+  for (const char* p = tz; *p; p++) hash = (hash ^ (uint8_t)*p) * 0x01000193;
+  return hash;
+}
+
+uint32_t fleet_id() {
+  return (uint32_t)ESP.getEfuseMac();
+}
+
+// Called by get_nettime() after every WiFi sync; beacons are timed from here
+void fleet_set_time(int secs, const net_transition_t* transition) {
+  fleet_net_secs = secs;
+  fleet_net_ms = millis();
+  fleet_transition = *transition;
+}
+
+static void fleet_on_receive(const uint8_t* mac, const uint8_t* data, int len) {
+  const fleet_beacon_t* beacon = (const fleet_beacon_t*)data;
+  if (len != sizeof(fleet_beacon_t) || beacon->magic != FLEET_MAGIC || beacon->fleet != fleet_group) return;
+  if (fleet_received && beacon->id >= fleet_rx.id) return;
+  memcpy(&fleet_rx, beacon, sizeof(fleet_rx));
+  fleet_rx_ms = millis();
+  fleet_received = true;
+}
+
+// Start ESP-NOW on the current channel; WiFi must be started
+bool fleet_begin(const char* name, const char* tz) {
+  fleet_group = fleet_hash(name, tz);
+  fleet_received = false;
+  if (esp_now_init() != ESP_OK) return false;
+  esp_now_peer_info_t peer;
+  memset(&peer, 0, sizeof(peer));
+  memcpy(peer.peer_addr, fleet_broadcast, sizeof(fleet_broadcast));
+  peer.ifidx = WIFI_IF_STA;
+  if (esp_now_register_recv_cb(fleet_on_receive) != ESP_OK || esp_now_add_peer(&peer) != ESP_OK) {
+    esp_now_deinit();
+    return false;
+  }
+  return true;
+}
+
+// Whether the next tune listens for a beacon before it syncs over WiFi; known before the config is loaded
+bool fleet_follower() {
+  return (FLEET_STATE & 0xff) != 0 && !(FLEET_STATE & FLEET_LEADER);
+}
+
+// Followers only: listen for a beacon and take net time from it. If none arrives, the radio is left on for init_wifi().
+bool fleet_listen(const char* name, const char* tz) {
+  fleet_heard = false;
+  int channel = FLEET_STATE & 0xff;
+  if (name[0] == 0 || !fleet_follower()) return false;
+  uint32_t start = millis();
+  WiFi.mode(WIFI_STA);
+  if (esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE) == ESP_OK && fleet_begin(name, tz)) {
+    while (!fleet_received && millis() - start < FLEET_LISTEN_MS) delay(1);
+    esp_now_deinit();
+  }
+  if (!fleet_received) {
+    event_log(EV_FLEET_LISTEN, 3, 0, (int)(millis() - start), -1);
+    return false;
+  }
+  WiFi.mode(WIFI_OFF);
+  // Rounded to the nearest sec, the same as net_answer_now()
+  uint32_t elapsed = fleet_rx.ms + (millis() - fleet_rx_ms);
+  int secs = (fleet_rx.secs + (elapsed + 500) / 1000) % NET_12HRS;
+  net_transition_t transition = { -1, 0 };
+  if (fleet_rx.transition_secs >= 0) {
+    transition.secs = max(0, (int)(fleet_rx.transition_secs - (elapsed + 500) / 1000));
+    transition.shift = fleet_rx.transition_shift;
+  }
+  accuracy_sync(secs);
+  tune_synced();
+  _set(VAR_DEBUG, 0);
+  _set(VAR_NET_HH, secs / 3600);
+  _set(VAR_NET_MM, (secs / 60) % 60);
+  _set(VAR_NET_SS, secs % 60);
+  dst_plan(&transition);
+  fleet_heard = true;
+  event_log(EV_FLEET_LISTEN, 3, (int)fleet_rx.id, (int)(millis() - start), secs);
+  return true;
+}
+
+// After a WiFi sync: lead, ie. beacon until FLEET_GUARD_SECS past the nearest window, unless a lower ID is heard first
+void fleet_lead(const char* name, const char* tz) {
+  if (name[0] == 0 || !WiFi.isConnected() || fleet_net_secs < 0) return;
+  FLEET_STATE = FLEET_LEADER | (WiFi.channel() & 0xff);
+  // Every window is a multiple of the shortest interval, whichever interval the sync was for
+  int interval = TUNE_INTERVALS[0];
+  uint32_t start = millis();
+  int secs = fleet_net_secs + (start - fleet_net_ms) / 1000;
+  int window = (secs + interval/2) / interval * interval;
+  int left_ms = (window + FLEET_GUARD_SECS - fleet_net_secs) * 1000 - (int)(start - fleet_net_ms);
+  int sent = 0;
+  uint32_t yielded = 0;
+  // Beacons stop when the awake time budget is spent (see awake.h); followers that miss them sync over WiFi
+  if (left_ms > 0 && awake_remaining_ms() < (uint32_t)left_ms) left_ms = awake_remaining_ms();
+  awake_phase(PHASE_NETTIME);
+  // Nothing to do if the sync was not near a window, eg. a retry after WiFi was down
+  if (left_ms > 0 && left_ms <= FLEET_MAX_BEACON_SECS * 1000 && fleet_begin(name, tz)) {
+    fleet_beacon_t beacon;
+    beacon.magic = FLEET_MAGIC;
+    beacon.fleet = fleet_group;
+    beacon.id = fleet_id();
+    beacon.transition_shift = fleet_transition.shift;
+    while ((int)(millis() - start) < left_ms) {
+      uint32_t elapsed = millis() - fleet_net_ms;
+      beacon.secs = (fleet_net_secs + elapsed / 1000) % NET_12HRS;
+      beacon.ms = elapsed % 1000;
+      beacon.transition_secs = fleet_transition.secs < 0 ? -1 : max(0, (int)(fleet_transition.secs - elapsed / 1000));
+      if (esp_now_send(fleet_broadcast, (const uint8_t*)&beacon, sizeof(beacon)) == ESP_OK) sent++;
+      delay(FLEET_BEACON_MS);
+      if (fleet_received && fleet_rx.id < beacon.id) {
+        FLEET_STATE &= ~FLEET_LEADER;
+        yielded = fleet_rx.id;
+        break;
+      }
+    }
+    esp_now_deinit();
+  }
+  event_log(EV_FLEET_LEAD, 3, window % NET_12HRS, sent, (int)yielded);
+}
+
+// After a successful sync: move the next tune wake onto the next fleet window, or FLEET_LEAD_SECS before it for the
+// leader. VAR_SLEEP_COUNT has been counting since the wake, so it is added in.
+void fleet_schedule(const char* name) {
+  if (name[0] == 0) return;
+  int interval = _get(VAR_SLEEP_INTERVAL);
+  int secs = _get(VAR_NET_HH) * 3600 + _get(VAR_NET_MM) * 60 + _get(VAR_NET_SS);
+  int lead = (FLEET_STATE & FLEET_LEADER) ? FLEET_LEAD_SECS : 0;
+  int wait = interval - (secs + lead) % interval;
+  if (wait < interval/2) wait += interval;
+  _set(VAR_SLEEP_INTERVAL, _get(VAR_SLEEP_COUNT) + wait);
+}
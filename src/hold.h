@@ -0,0 +1,62 @@
+/*
+ * hold.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Holding the hands instead of reversing them. When the clock is ahead by a few seconds, net time can
+// simply be left to catch up: TICK_HOLD sends no pulses at all, while TICK_REV sends the most expensive
+// pulses we have and then still ticks normally over the same time. Holding is therefore the cheaper way
+// to converge for any lead; what it costs is catch-up time, as the hands show the wrong time for as many
+// seconds as they are ahead instead of lead/(REV_TICKS_PER_SEC+1). The user sets how far ahead the hands
+// may be left waiting (the largest display error they accept while holding) in the config portal.
+//
+// The ULP cannot weigh costs every second, so hold_plan() turns the limit into VAR_HOLD_DIFF: the ULP
+// holds whenever diff(clock, net) >= VAR_HOLD_DIFF, and reverses only while the clock is further ahead
+// than that, handing over to TICK_HOLD for the rest of the way.
+
+#define HOLD_MAX_LIMIT          600                               // Largest lead (secs) that may be held
+#define NORM_TICKS_PER_SEC      (ULP_CALL_PER_SEC/(NORM_COUNT_MASK+1))
+#define REV_TICKS_PER_SEC       (ULP_CALL_PER_SEC/(REV_COUNT_MASK+1))
+
+// Coil drive per pulse in usecs (pulse length x duty cycle); the drive current is the same for every pulse
+#define NORM_TICK_CHARGE_US     (NORM_TICK_MS*NORM_TICK_ON_US*10)
+#define REV_TICKA_CHARGE_US     ((REV_TICKA_T1_MS+REV_TICKA_T3_MS)*REV_TICKA_ON_US*10)
+#define REV_TICKB_CHARGE_US     ((REV_TICKB_T1_MS+REV_TICKB_T3_MS)*REV_TICKB_ON_US*10)
+#define REV_TICK_CHARGE_US      ((REV_TICKA_CHARGE_US*(REV_TICKA_HI-REV_TICKA_LO) + REV_TICKB_CHARGE_US*(60-(REV_TICKA_HI-REV_TICKA_LO)))/60)
+
+// Coil drive (usecs) saved by holding through a lead of `lead` secs rather than reversing it away and
+// ticking normally for the rest of the time; *rev_secs is set to the catch-up time when reversing
+int hold_saving_us(int lead, int* rev_secs) {
+  *rev_secs = (lead + REV_TICKS_PER_SEC) / (REV_TICKS_PER_SEC + 1);
+  return *rev_secs * REV_TICKS_PER_SEC * REV_TICK_CHARGE_US + (lead - *rev_secs) * NORM_TICKS_PER_SEC * NORM_TICK_CHARGE_US;
+}
+
+// Largest lead (secs) held, from VAR_HOLD_DIFF
+int hold_limit() {
+  int packed = _get(VAR_HOLD_DIFF);
+  return max(0, min(12*60*60 - ((packed >> 12) * 3600 + ((packed >> 6) & 0x3f) * 60 + (packed & 0x3f)), HOLD_MAX_LIMIT));
+}
+
+// Set VAR_HOLD_DIFF from the largest lead (secs) that may be held; 0 always reverses
+void hold_plan(int limit) {
+  limit = max(0, min(limit, HOLD_MAX_LIMIT));
+  int diff = 12*60*60 - limit;                                    // 12:00:00 is above any diff, so it never holds
+  uint16_t packed = ((diff / 3600) << 12) | (((diff / 60) % 60) << 6) | (diff % 60);
+  if (_get(VAR_HOLD_DIFF) == packed) return;
+  _set(VAR_HOLD_DIFF, packed);
+  int rev_secs, saving_us = hold_saving_us(limit, &rev_secs);
+  event_log(EV_HOLD_PLAN, 3, limit, saving_us / 1000, rev_secs);
+}
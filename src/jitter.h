@@ -0,0 +1,72 @@
+/*
+ * jitter.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ULP slot length histogram. Every ULP call is meant to take 1000/ULP_CALL_PER_SEC ms from one entry to the next
+// (the ULP timer plus MAX_PULSE_MS of pulses and filler). At entry, the ULP code reads the RTC time counter and
+// counts the length of the previous call in RTC_SLOW_MEM[RTC_JITTER_START], one row of SLOT_BUCKETS per tick
+// action (TICK_NORMAL .. TICK_HOLD) that call began with. Buckets are about 1.7ms wide with the nominal length
+// in SLOT_NOMINAL_BUCKET, so the last bucket collects the calls that overran by more than about 8ms. The bucket edges
+// come from the calibrated RTC_SLOW_CLK period, which jitter_calibrate() turns into VAR_SLOT_BASE when the ULP
+// program is loaded. Counts saturate at 0xffff. Each tune or net time update wake reports and clears them via
+// status().
+
+static_assert(SLOT_BUCKETS == 8, "LBL_SLOT_TIME multiplies the row by SLOT_BUCKETS with a shift of 3");
+
+#define JITTER_UNIT_CYCLES      (1 << SLOT_TIME_SHIFT)            // RTC_SLOW_CLK cycles per unit of VAR_SLOT_TIME
+#define JITTER_BUCKET_UNITS     (1 << SLOT_BUCKET_SHIFT)
+#define JITTER_BUCKET(action, i) RTC_SLOW_MEM[RTC_JITTER_START + ((action)-1)*SLOT_BUCKETS + (i)]
+
+// Nominal call length in units of VAR_SLOT_TIME, from VAR_SLOT_BASE
+int jitter_nominal_units() {
+  return _get(VAR_SLOT_BASE) + SLOT_NOMINAL_BUCKET*JITTER_BUCKET_UNITS + JITTER_BUCKET_UNITS/2;
+}
+
+// Called by load_and_run_ulp() before the ULP is started
+void jitter_calibrate() {
+  uint32_t period = rtc_clk_cal(RTC_CAL_RTC_MUX, 1024);           // us per RTC_SLOW_CLK cycle << RTC_CLK_CAL_FRACT
+  if (period == 0) period = (1000000ULL << RTC_CLK_CAL_FRACT) / 150000;
+  int nominal = ((uint64_t)(1000000/ULP_CALL_PER_SEC) << RTC_CLK_CAL_FRACT) / period / JITTER_UNIT_CYCLES;
+  _set(VAR_SLOT_BASE, nominal - SLOT_NOMINAL_BUCKET*JITTER_BUCKET_UNITS - JITTER_BUCKET_UNITS/2);
+}
+
+// Send the counts of each tick action seen since the last report, each bucket labelled with where it starts (ms),
+// eg. "Slot length N(n=57600) <122.4=0 122.4=3 124.1=57580 125.8=15 ..." and clear them. A call counted by the ULP
+// between reading and clearing a bucket is lost.
+void jitter_report() {
+  static const char names[] = "NFRH";
+  char buf[512];
+  int len = snprintf(buf, sizeof(buf), "Slot length");
+  int nominal = jitter_nominal_units(), ms_x10 = 10000/ULP_CALL_PER_SEC;
+  bool any = false;
+  for (int action=TICK_NORMAL; action<=TICK_HOLD; action++) {
+    uint32_t n = 0, count[SLOT_BUCKETS];
+    for (int i=0; i<SLOT_BUCKETS; i++) {
+      count[i] = JITTER_BUCKET(action, i) & 0xffff;
+      JITTER_BUCKET(action, i) = 0;
+      n += count[i];
+    }
+    if (n == 0) continue;
+    any = true;
+    if (len < (int)sizeof(buf)) len += snprintf(buf+len, sizeof(buf)-len, " %c(n=%d)", names[action-1], n);
+    for (int i=0; i<SLOT_BUCKETS && len<(int)sizeof(buf); i++) {
+      int edge = (_get(VAR_SLOT_BASE) + max(i, 1)*JITTER_BUCKET_UNITS) * ms_x10 / nominal;
+      len += snprintf(buf+len, sizeof(buf)-len, " %s%d.%d=%d", i == 0 ? "<" : "", edge/10, edge%10, count[i]);
+    }
+  }
+  if (any) status("%s", buf);
+}
@@ -0,0 +1,77 @@
+/*
+ * jobs.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Job batches. Every wake of the main CPU runs a batch of jobs (JOB_* in ulpdefs.h) rather than the one job
+// that its wake reason stands for, and the network jobs of a batch share one WiFi session. Hard jobs have a
+// deadline, and their deadlines are the ULP countdowns in RTC_SLOW_MEM: VAR_UPDATE_PENDING for JOB_SYNC,
+// VAR_SLEEP_INTERVAL less VAR_SLEEP_COUNT for JOB_TUNE and VAR_DST_COUNT for JOB_DST. When one runs out,
+// the ULP sets the bit of the job in VAR_WAKE_JOBS and wakes the main CPU; jobs that fall due in the same
+// sec are woken for together. jobs_collect() then pulls in the hard jobs due soon enough to share the wake,
+// and adds the soft jobs (OTA check, config save, syslog flush), which never wake the main CPU themselves.
+
+#define JOBS_HORIZON_SECS       600                               // A tune due this soon runs with the batch of another hard job ...
+#define JOBS_HORIZON_DIV        4                                 // ... unless that cuts its interval by more than 1/JOBS_HORIZON_DIV
+#define JOBS_STATE              RTC_SLOW_MEM[RTC_JOBS_START]      // Bits 0-15 = jobs of the last batch, bits 16-31 = wakes saved since cold boot
+
+static int jobs_batch;                                            // Jobs of the current batch
+
+// Secs until the ULP wakes the main CPU for a hard job, or -1 if it is not scheduled
+int jobs_deadline(int job) {
+  switch(job) {
+    case JOB_SYNC: return _get(VAR_UPDATE_PENDING) > 0 ? _get(VAR_UPDATE_PENDING) : -1;
+    case JOB_TUNE: return max(0, (int)_get(VAR_SLEEP_INTERVAL) - (int)_get(VAR_SLEEP_COUNT));
+    case JOB_DST: return _get(VAR_DST_COUNT) > 0 ? _get(VAR_DST_COUNT) : -1;
+  }
+  return -1;
+}
+
+// Batch of the first wake after power on: net time is updated in the same session as the config portal
+void jobs_startup() {
+  jobs_batch = JOB_SYNC | JOB_FLUSH_LOG;
+}
+
+// Take the jobs the ULP woke the main CPU for and pull in the rest of the batch. A pending net time update is done
+// by a tune anyway. A tune due within JOBS_HORIZON_SECS is done now, over the interval so far, unless the clock is
+// paused or still catching up (the ULP would put it off too) or the tune is kept on a fleet window (see fleet.h).
+int jobs_collect(const char* fleet) {
+  int woken = _get(VAR_WAKE_JOBS), jobs = woken, saved = 0;
+  _set(VAR_WAKE_JOBS, _get(VAR_WAKE_JOBS) & ~woken);
+  int tune = (woken & JOB_TUNE) ? 0 : jobs_deadline(JOB_TUNE), count = _get(VAR_SLEEP_COUNT);
+  if (!(jobs & (JOB_TUNE | JOB_BUTTON)) && fleet[0] == 0 && _get(VAR_PAUSE_CLOCK) == 0 && _get(VAR_TICK_ACTION) == TICK_NORMAL
+    && tune <= JOBS_HORIZON_SECS && tune * JOBS_HORIZON_DIV <= count + tune) {
+    // As the ULP does when it wakes for a tune; count first so that the ULP does not wake for it meanwhile
+    _set(VAR_SLEEP_COUNT, 0);
+    _set(VAR_SLEEP_INTERVAL, count);
+    jobs |= JOB_TUNE;
+    saved++;
+  }
+  if ((jobs & JOB_TUNE) && jobs_deadline(JOB_SYNC) > 0) {
+    _set(VAR_UPDATE_PENDING, 0);
+    saved++;
+  }
+  // The session budget follows the network job of the batch (see session.h)
+  if (jobs & JOB_TUNE) {
+    _set(VAR_WAKE_REASON, WAKE_TUNE_ULP_TIMER);
+    jobs |= JOB_OTA_CHECK;
+  }
+  if (jobs & (JOB_BUTTON | JOB_SYNC | JOB_TUNE)) jobs |= JOB_SAVE_CONFIG | JOB_FLUSH_LOG;
+  jobs_batch = jobs;
+  JOBS_STATE = MAKE_INT(HI_WORD(JOBS_STATE) + saved, jobs);
+  event_log(EV_JOBS, 3, woken, jobs, tune);
+  return jobs;
+}
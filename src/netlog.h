@@ -0,0 +1,98 @@
+/*
+ * netlog.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Syslog records queued by status() and netdebug(). Records are kept as NUL-terminated strings in
+// RTC_SLOW_MEM so that they survive deep sleep, and are only sent when the main CPU is about to go
+// back to sleep with WiFi already connected. If the buffer fills up (eg. the router has been offline
+// for several wakes), the oldest records are dropped and the number dropped is reported on the next flush.
+
+#include <Syslog.h>
+
+#define LOG_BYTES               ((RTC_LOG_WORDS-1)*4)             // First word holds bytes used (bits 0-15) and records dropped (bits 16-31)
+#define LOG_MAX_RECORD          (LOG_BYTES/2)                     // Longer records are truncated
+#define LOG_DEFAULT_PORT        514
+#define LOG_HEADER              RTC_SLOW_MEM[RTC_LOG_START]
+#define LOG_DATA                ((volatile char*)&RTC_SLOW_MEM[RTC_LOG_START+1])
+
+void log_append(const char* msg) {
+  int used = LO_WORD(LOG_HEADER), dropped = HI_WORD(LOG_HEADER);
+  int len = strnlen(msg, LOG_MAX_RECORD-1) + 1;
+  if (used > LOG_BYTES) used = dropped = 0;
+  // Drop oldest records until the new one fits
+  int skip = 0;
+  while (used - skip + len > LOG_BYTES) {
+    while (skip < used && LOG_DATA[skip++] != 0);
+    dropped++;
+  }
+  if (skip > 0) {
+    for (int i=skip; i<used; i++) LOG_DATA[i-skip] = LOG_DATA[i];
+    used -= skip;
+  }
+  for (int i=0; i<len-1; i++) LOG_DATA[used+i] = msg[i];
+  LOG_DATA[used+len-1] = 0;
+  LOG_HEADER = MAKE_INT(dropped, used+len);
+}
+
+// Send all queued records to dest ("host" or "host:port") in one burst, followed by the binary event log
+// as "EVLOG <hex>" lines that eventlog.py can decode. Records are kept if WiFi is down, no destination
+// has been configured or the network session deadline has already been reached.
+void log_flush(const char* dest) {
+  int used = LO_WORD(LOG_HEADER), dropped = HI_WORD(LOG_HEADER);
+  int ev_used = LO_WORD(EVENT_HEADER), ev_dropped = HI_WORD(EVENT_HEADER);
+  if (used > LOG_BYTES) used = dropped = 0;
+  if (ev_used > EVENT_BYTES) ev_used = ev_dropped = 0;
+  if ((used == 0 && ev_used == 0) || dest[0] == 0 || WiFi.status() != WL_CONNECTED) return;
+  if (session_expired()) {
+    session_overrun(SESSION_FLUSH); // Keep records for the next session
+    return;
+  }
+  char host[64];
+  strncpy(host, dest, sizeof(host)-1); host[sizeof(host)-1] = 0;
+  int port = LOG_DEFAULT_PORT;
+  char* colon = strchr(host, ':');
+  if (colon != NULL) {
+    *colon = 0;
+    port = atoi(colon+1);
+  }
+  WiFiUDP udpClient;
+  Syslog syslog(udpClient, host, port, getClockName(), "", LOG_KERN, SYSLOG_PROTO_BSD);
+  char buf[LOG_MAX_RECORD];
+  if (dropped > 0 || ev_dropped > 0) {
+    snprintf(buf, sizeof(buf), "%d log records and %d event records dropped", dropped, ev_dropped);
+    syslog.log(buf);
+  }
+  for (int pos=0; pos<used; ) {
+    int len = 0;
+    while (pos < used && LOG_DATA[pos] != 0 && len < (int)sizeof(buf)-1) buf[len++] = LOG_DATA[pos++];
+    buf[len] = 0; pos++;
+    syslog.log(buf);
+  }
+  // Split event log on record boundaries so that a lost datagram does not garble the rest
+  for (int pos=0; pos<ev_used; ) {
+    int len = sprintf(buf, "EVLOG ");
+    while (pos < ev_used) {
+      int size = 4 + EVENT_DATA[pos+1];
+      if (len + size*2 >= (int)sizeof(buf)) break;
+      for (int i=0; i<size && pos<ev_used; i++) len += sprintf(buf+len, "%02x", EVENT_DATA[pos++]);
+    }
+    syslog.log(buf);
+  }
+  LOG_HEADER = 0;
+  EVENT_HEADER = 0;
+  profile_mark(PHASE_REPORT);
+}
@@ -0,0 +1,212 @@
+/*
+ * nettime.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Concurrent network time query. Up to NET_MAX_SOURCES time sources (space-separated http:// URLs, each
+// answering with "HH:MM:SS") are queried at the same time with AsyncClient. As soon as one answer agrees with
+// another to within NET_AGREE_SECS, it is taken and the remaining requests are dropped. If all sources have
+// answered (or timed out) without agreement, the median is taken when there are 3 or more answers. A single
+// configured source is trusted on its own, as before. A source may follow the time with the next change of
+// UTC offset, as " <secs until the change> <change in secs>" (see the PHP script in espclock4.cpp); it is
+// passed on from the chosen answer so that the change can be planned by dst.h.
+
+#include <AsyncTCP.h>
+
+#define NET_MAX_SOURCES         4
+#define NET_AGREE_SECS          2                                 // Max difference between answers that agree
+#define NET_TIMEOUT_MS          5000                              // Give up on sources that have not answered by then
+#define NET_RESPONSE_SIZE       512                               // Rest of the response is ignored
+#define NET_12HRS               (12*60*60)
+
+enum { NET_IDLE, NET_CONNECTING, NET_WAITING, NET_DONE, NET_FAILED };
+
+typedef struct {
+  int secs;                                                       // Secs until the next change of UTC offset, or -1 if unknown
+  int shift;                                                      // Change in secs (eg. 3600 when DST starts, -3600 when it ends)
+} net_transition_t;
+
+typedef struct {
+  AsyncClient client;
+  char host[64];
+  uint16_t port;
+  String request;
+  volatile int state;
+  volatile int len;
+  char response[NET_RESPONSE_SIZE];
+  uint32_t start_ms;
+  volatile uint32_t done_ms;
+  int secs;                                                       // Parsed answer in secs since 00:00:00 (12-hr), or -1
+  net_transition_t transition;
+} net_source_t;
+
+static net_source_t net_sources[NET_MAX_SOURCES];
+
+// Parse "http://host[:port]/path" into source, with "[tz]" replaced by the URL-encoded timezone
+bool net_parse_url(net_source_t* src, String url, const char* tz) {
+  String tzenc = tz;
+  tzenc.replace("/", "%2F");
+  url.replace("[tz]", tzenc);
+  if (!url.startsWith("http://")) return false;
+  url = url.substring(7);
+  int slash = url.indexOf('/');
+  String hostport = slash < 0 ? url : url.substring(0, slash);
+  String path = slash < 0 ? String("/") : url.substring(slash);
+  int colon = hostport.indexOf(':');
+  src->port = colon < 0 ? 80 : hostport.substring(colon+1).toInt();
+  strncpy(src->host, (colon < 0 ? hostport : hostport.substring(0, colon)).c_str(), sizeof(src->host)-1);
+  src->host[sizeof(src->host)-1] = 0;
+  src->request = "GET " + path + " HTTP/1.0\r\nHost: " + src->host + "\r\nConnection: close\r\n\r\n";
+  return true;
+}
+
+// Returns secs since 00:00:00 (12-hr) from an HTTP 200 response whose body starts with "HH:MM:SS", or -1
+int net_parse_response(const char* response, net_transition_t* transition) {
+  transition->secs = -1;
+  transition->shift = 0;
+  int code = 0;
+  if (sscanf(response, "HTTP/%*d.%*d %d", &code) != 1 || code != 200) return -1;
+  const char* body = strstr(response, "\r\n\r\n");
+  if (body == NULL) return -1;
+  body += 4;
+  for (int i=0; i<8; i++) {
+    if (i == 2 || i == 5 ? body[i] != ':' : !isdigit(body[i])) return -1;
+  }
+  int hh = atoi(body), mm = atoi(body+3), ss = atoi(body+6);
+  if (hh > 23 || mm > 59 || ss > 59) return -1;
+  if (sscanf(body+8, " %d %d", &transition->secs, &transition->shift) != 2 || transition->secs < 0 || transition->shift == 0) {
+    transition->secs = -1;
+    transition->shift = 0;
+  }
+  return (hh % 12) * 3600 + mm * 60 + ss;
+}
+
+// Answer of source as of now, allowing for the time since it arrived
+int net_answer_now(net_source_t* src) {
+  return (src->secs + (millis() - src->done_ms + 500) / 1000) % NET_12HRS;
+}
+
+int net_diff(int a, int b) {
+  int diff = abs(a - b);
+  return diff > NET_12HRS/2 ? NET_12HRS - diff : diff;
+}
+
+// Queries all sources in urls; on success returns true with the agreed time in *secs, and the next change of
+// UTC offset in *transition if the chosen source (or the first answer, for a median) announced one
+bool nettime_query(const char* urls, const char* tz, int* secs, net_transition_t* transition) {
+  // Start all requests
+  int count = 0;
+  String list = urls;
+  list.trim();
+  while (list.length() > 0 && count < NET_MAX_SOURCES) {
+    int space = list.indexOf(' ');
+    String url = space < 0 ? list : list.substring(0, space);
+    list = space < 0 ? String("") : list.substring(space+1);
+    list.trim();
+    net_source_t* src = &net_sources[count];
+    src->state = NET_IDLE; src->len = 0; src->secs = -1; src->transition.secs = -1;
+    if (!net_parse_url(src, url, tz)) continue;
+    src->client.onConnect([](void* arg, AsyncClient* client) {
+      net_source_t* src = (net_source_t*)arg;
+      src->state = NET_WAITING;
+      client->write(src->request.c_str());
+    }, src);
+    src->client.onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+      net_source_t* src = (net_source_t*)arg;
+      int n = min((int)len, NET_RESPONSE_SIZE-1 - src->len);
+      memcpy(src->response + src->len, data, n);
+      src->len += n;
+    }, src);
+    src->client.onDisconnect([](void* arg, AsyncClient* client) {
+      net_source_t* src = (net_source_t*)arg;
+      if (src->state == NET_DONE || src->state == NET_FAILED) return;
+      src->response[src->len] = 0;
+      src->done_ms = millis();
+      src->state = src->state == NET_WAITING && src->len > 0 ? NET_DONE : NET_FAILED;
+    }, src);
+    src->client.onError([](void* arg, AsyncClient* client, int8_t error) {
+      net_source_t* src = (net_source_t*)arg;
+      src->done_ms = millis();
+      src->state = NET_FAILED;
+    }, src);
+    src->start_ms = millis();
+    src->state = NET_CONNECTING;
+    if (!src->client.connect(src->host, src->port)) src->state = NET_FAILED;
+    count++;
+  }
+
+  // Wait for answers until two of them agree, all sources are done, or the session deadline is reached
+  int chosen = -1, answers = 0;
+  bool checked[NET_MAX_SOURCES] = {false};
+  uint32_t start = millis(), timeout = min((uint32_t)NET_TIMEOUT_MS, session_remaining_ms(SESSION_FLUSH_MS));
+  bool pending = false;
+  while (chosen < 0 && millis() - start < timeout) {
+    pending = false;
+    for (int i=0; i<count && chosen<0; i++) {
+      net_source_t* src = &net_sources[i];
+      if (src->state != NET_DONE && src->state != NET_FAILED) {
+        pending = true;
+        continue;
+      }
+      if (checked[i]) continue;
+      checked[i] = true;
+      if (src->state == NET_DONE) src->secs = net_parse_response(src->response, &src->transition);
+      event_log(EV_NETTIME_SOURCE, 3, i, src->done_ms - src->start_ms, src->secs);
+      if (src->secs < 0) continue;
+      answers++;
+      if (count == 1) chosen = i;
+      for (int j=0; j<count && chosen<0; j++) {
+        if (j != i && net_sources[j].secs >= 0 && net_diff(net_answer_now(src), net_answer_now(&net_sources[j])) <= NET_AGREE_SECS) {
+          chosen = i;
+        }
+      }
+    }
+    if (!pending) break;
+    if (chosen < 0) delay(10);
+  }
+  for (int i=0; i<count; i++) {
+    if (net_sources[i].state != NET_DONE && net_sources[i].state != NET_FAILED) net_sources[i].client.close(true);
+  }
+  if (chosen < 0 && pending && session_remaining_ms(SESSION_FLUSH_MS) == 0) session_overrun(SESSION_NETTIME);
+
+  int announced = chosen;
+  if (chosen >= 0) {
+    *secs = net_answer_now(&net_sources[chosen]);
+  } else if (answers >= 3) {
+    // No two answers agree; take the median (by difference from the first answer, to cope with wrapping at 12:00)
+    int values[NET_MAX_SOURCES], n = 0, base = -1;
+    for (int i=0; i<count; i++) {
+      if (net_sources[i].secs < 0) continue;
+      int t = net_answer_now(&net_sources[i]);
+      if (base < 0) { base = t; announced = i; }
+      int d = (t - base + NET_12HRS) % NET_12HRS;
+      if (d > NET_12HRS/2) d -= NET_12HRS;
+      int k = n++;
+      while (k > 0 && values[k-1] > d) { values[k] = values[k-1]; k--; }
+      values[k] = d;
+    }
+    *secs = (base + values[n/2] + NET_12HRS) % NET_12HRS;
+  }
+  transition->secs = -1;
+  transition->shift = 0;
+  if (announced >= 0 && (chosen >= 0 || answers >= 3) && net_sources[announced].transition.secs >= 0) {
+    net_source_t* src = &net_sources[announced];
+    transition->secs = max(0, (int)(src->transition.secs - (millis() - src->done_ms + 500) / 1000));
+    transition->shift = src->transition.shift;
+  }
+  event_log(EV_NETTIME_RESULT, 3, count, answers, chosen >= 0 || answers >= 3 ? *secs : -1);
+  return chosen >= 0 || answers >= 3;
+}
@@ -0,0 +1,248 @@
+/*
+ * ota.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Delta firmware updates. At most once every OTA_CHECK_MINS, a tune wake that still has WiFi up and a full
+// battery asks the update server configured in the portal (see otaserver.py) for a delta from the running
+// image to the latest one. The running image is identified by the SHA-256 of its ELF file, which the build
+// embeds in the app description; the server answers 204 if there is nothing newer. Delta format (integers
+// are little-endian):
+//
+//   header   "ESPD", length of the delta incl. header, source size, target size, CRC-32 of target, signature length
+//            (6 x uint32), ECDSA signature of the target's SHA-256 (DER, OTA_SIG_SIZE bytes padded with zeros)
+//   copy     varint (len << 1 | 1), varint offset    len bytes of the running image from offset
+//   insert   varint (len << 1), len bytes            len literal bytes
+//
+// The delta is appended to OTA_FILE as it arrives, so a download cut short by the session deadline carries on
+// from where it stopped at the next tune (the rest is asked for with &offset=). Once it is complete, the radio
+// is turned off and the delta is applied to the inactive OTA partition one buffer at a time, with copies read
+// straight from the running partition; radio time depends on the size of the delta rather than the image.
+// The new image is only booted if its CRC matches, the signature checks out against OTA_PUBLIC_KEY (see
+// espclock4.h) and esp_ota_end() has verified it. Without a public key, no update is looked for.
+
+#include <esp_ota_ops.h>
+#include <esp32/rom/crc.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/sha256.h>
+
+#define OTA_FILE                "/ota.delta"
+#define OTA_MAGIC               0x44505345                        // "ESPD"
+#define OTA_MAX_DELTA           (256*1024)                        // Larger deltas are refused; LittleFS must have room for them
+#define OTA_CHECK_MINS          (24*60)                           // Shortest interval between checks for an update
+#define OTA_MIN_SESSION_MS      3000                              // Session time left needed to start or resume a download
+#define OTA_BUF_SIZE            4096
+#define OTA_SIG_SIZE            72                                // Longest DER encoding of an ECDSA signature on P-256
+#define OTA_HEADER              RTC_SLOW_MEM[RTC_OTA_START]       // Bits 0-15 = mins since the last check
+
+enum { OTA_NONE, OTA_PARTIAL, OTA_READY };                        // Result of ota_download()
+enum { OTA_OK, OTA_BAD_DELTA, OTA_BAD_CRC, OTA_FLASH_ERROR, OTA_BAD_SIGNATURE }; // Result of ota_apply()
+
+typedef struct {
+  uint32_t magic;
+  uint32_t len;                                                   // Whole delta, including this header
+  uint32_t src_size;                                              // Copies must lie within this much of the running image
+  uint32_t dst_size;
+  uint32_t dst_crc;
+  uint32_t sig_len;
+  uint8_t sig[OTA_SIG_SIZE];
+} ota_header_t;
+
+static net_source_t ota_src;
+static File ota_file;
+static volatile int ota_code;                                     // HTTP status once the response headers are in, or -1
+static volatile uint32_t ota_received, ota_limit;
+
+// Called on every tune wake; true if a check (or an unfinished download) is due and the battery and session allow it
+bool ota_due(const char* url) {
+  OTA_HEADER = min((int)LO_WORD(OTA_HEADER) + (int)_get(VAR_SLEEP_INTERVAL)/60, 0xffff);
+  if (url[0] == 0 || OTA_PUBLIC_KEY[0] == 0 || WiFi.status() != WL_CONNECTED) return false;
+  if (LO_WORD(OTA_HEADER) < OTA_CHECK_MINS && !FILESYS.exists(OTA_FILE)) return false;
+  return _get(VAR_ADC_VDD) >= _get(VAR_ADC_VDDH) && session_remaining_ms(SESSION_FLUSH_MS) >= OTA_MIN_SESSION_MS;
+}
+
+// Length of the delta staged in OTA_FILE from its header, or 0 if the header is missing or invalid; *staged is set to
+// the bytes downloaded so far
+uint32_t ota_staged_len(uint32_t* staged) {
+  ota_header_t header;
+  File file = FILESYS.open(OTA_FILE, FILE_READ);
+  *staged = file ? file.size() : 0;
+  bool valid = file && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header);
+  if (file) file.close();
+  if (!valid || header.magic != OTA_MAGIC || header.len <= sizeof(header) || header.len > OTA_MAX_DELTA
+    || header.sig_len == 0 || header.sig_len > OTA_SIG_SIZE) return 0;
+  return header.len;
+}
+
+// Download the delta (or the rest of it) from url into OTA_FILE within the session deadline
+int ota_download(const char* url) {
+  OTA_HEADER = 0;
+  ota_file = FILESYS.open(OTA_FILE, FILE_APPEND);
+  if (!ota_file) return OTA_NONE;
+  uint32_t staged = ota_file.size(), start = millis();
+  char sha[17];
+  esp_ota_get_app_elf_sha256(sha, sizeof(sha));
+  String query = String(url) + (strchr(url, '?') ? "&" : "?") + "from=" + sha + "&offset=" + String((int)staged);
+  if (!net_parse_url(&ota_src, query, "")) {
+    ota_file.close();
+    return OTA_NONE;
+  }
+  ota_src.len = 0; ota_code = 0; ota_received = 0; ota_limit = OTA_MAX_DELTA - staged;
+  ota_src.client.onConnect([](void* arg, AsyncClient* client) {
+    ota_src.state = NET_WAITING;
+    client->write(ota_src.request.c_str());
+  }, NULL);
+  ota_src.client.onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+    uint8_t* bytes = (uint8_t*)data;
+    if (ota_code == 0) {
+      // Collect the response headers in ota_src.response; the body starts after the blank line
+      int n = min((int)len, NET_RESPONSE_SIZE-1 - ota_src.len);
+      memcpy(ota_src.response + ota_src.len, data, n);
+      ota_src.response[ota_src.len + n] = 0;
+      char* end = strstr(ota_src.response, "\r\n\r\n");
+      if (end == NULL) {
+        ota_src.len += n;
+        if (ota_src.len >= NET_RESPONSE_SIZE-1) ota_code = -1;
+        return;
+      }
+      int code, body = end + 4 - ota_src.response - ota_src.len;
+      ota_code = sscanf(ota_src.response, "HTTP/%*d.%*d %d", &code) == 1 ? code : -1;
+      bytes += body;
+      len -= body;
+    }
+    if (ota_code != 200 || len == 0) return;
+    if (ota_received + len > ota_limit) {
+      ota_code = -1; // Larger than OTA_MAX_DELTA
+      return;
+    }
+    ota_file.write(bytes, len);
+    ota_received += len;
+  }, NULL);
+  ota_src.client.onDisconnect([](void* arg, AsyncClient* client) {
+    if (ota_src.state != NET_FAILED) ota_src.state = NET_DONE;
+  }, NULL);
+  ota_src.client.onError([](void* arg, AsyncClient* client, int8_t error) {
+    ota_src.state = NET_FAILED;
+  }, NULL);
+  ota_src.state = NET_CONNECTING;
+  if (!ota_src.client.connect(ota_src.host, ota_src.port)) ota_src.state = NET_FAILED;
+
+  // Wait until the server is done or the session deadline is reached; what has arrived so far is kept
+  uint32_t timeout = session_remaining_ms(SESSION_FLUSH_MS);
+  while (ota_src.state != NET_DONE && ota_src.state != NET_FAILED && ota_code != -1 && millis() - start < timeout) delay(10);
+  if (ota_src.state != NET_DONE && ota_src.state != NET_FAILED) {
+    ota_src.client.close(true);
+    if (ota_code != -1 && session_remaining_ms(SESSION_FLUSH_MS) == 0) session_overrun(SESSION_OTA);
+  }
+  ota_file.close();
+  uint32_t len = ota_staged_len(&staged);
+
+  // Nothing newer (204) or an unknown image (404), a bad response or a delta that does not fit: start over next time
+  int result = OTA_PARTIAL;
+  if (ota_code != 200 && ota_code != 0) result = OTA_NONE;
+  else if (staged >= sizeof(ota_header_t) && (len == 0 || staged > len)) result = OTA_NONE;
+  else if (len > 0 && staged == len) result = OTA_READY;
+  if (result == OTA_NONE || staged == 0) FILESYS.remove(OTA_FILE);
+  event_log(EV_OTA_DOWNLOAD, 5, ota_code, ota_received, staged, len, (int)(millis() - start));
+  return result;
+}
+
+bool ota_read_varint(File& file, uint32_t* value) {
+  *value = 0;
+  for (int shift=0; shift<32; shift+=7) {
+    int b = file.read();
+    if (b < 0) return false;
+    *value |= (uint32_t)(b & 0x7f) << shift;
+    if (b < 0x80) return true;
+  }
+  return false;
+}
+
+// Whether the header carries the update server's signature of hash, the SHA-256 of the new image
+bool ota_verify(const ota_header_t* header, const uint8_t* hash) {
+  mbedtls_pk_context key;
+  mbedtls_pk_init(&key);
+  bool valid = header->sig_len <= OTA_SIG_SIZE
+    && mbedtls_pk_parse_public_key(&key, (const unsigned char*)OTA_PUBLIC_KEY, sizeof(OTA_PUBLIC_KEY)) == 0
+    && mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, hash, 32, header->sig, header->sig_len) == 0;
+  mbedtls_pk_free(&key);
+  return valid;
+}
+
+// Apply the delta in OTA_FILE to the inactive OTA partition and make it the boot partition if the result checks out.
+// The staged delta is removed either way.
+int ota_apply() {
+  static uint8_t buf[OTA_BUF_SIZE];
+  uint32_t start = millis();
+  ota_header_t header;
+  File file = FILESYS.open(OTA_FILE, FILE_READ);
+  if (!file) return OTA_BAD_DELTA;
+  int rc = OTA_BAD_DELTA;
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  const esp_partition_t* target = esp_ota_get_next_update_partition(NULL);
+  esp_ota_handle_t handle;
+  bool begun = false;
+  if (file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && header.magic == OTA_MAGIC && header.len == file.size()
+    && target != NULL && header.src_size <= running->size && header.dst_size <= target->size) {
+    begun = esp_ota_begin(target, header.dst_size, &handle) == ESP_OK;
+    rc = begun ? OTA_OK : OTA_FLASH_ERROR;
+  }
+  uint32_t written = 0, crc = 0;
+  uint8_t hash[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+  while (rc == OTA_OK && written < header.dst_size) {
+    uint32_t op, offset = 0;
+    if (!ota_read_varint(file, &op) || ((op & 1) && !ota_read_varint(file, &offset))) {
+      rc = OTA_BAD_DELTA;
+      break;
+    }
+    uint32_t len = op >> 1;
+    if (len == 0 || written + len > header.dst_size || ((op & 1) && (offset > header.src_size || len > header.src_size - offset))) {
+      rc = OTA_BAD_DELTA;
+      break;
+    }
+    while (rc == OTA_OK && len > 0) {
+      uint32_t n = min(len, (uint32_t)OTA_BUF_SIZE);
+      if (op & 1) {
+        if (esp_partition_read(running, offset, buf, n) != ESP_OK) rc = OTA_FLASH_ERROR;
+        offset += n;
+      } else if (file.read(buf, n) != n) {
+        rc = OTA_BAD_DELTA;
+      }
+      if (rc != OTA_OK) break;
+      crc = crc32_le(crc, buf, n);
+      mbedtls_sha256_update_ret(&sha, buf, n);
+      if (esp_ota_write(handle, buf, n) != ESP_OK) rc = OTA_FLASH_ERROR;
+      written += n;
+      len -= n;
+    }
+  }
+  file.close();
+  FILESYS.remove(OTA_FILE);
+  mbedtls_sha256_finish_ret(&sha, hash);
+  mbedtls_sha256_free(&sha);
+  if (rc == OTA_OK && crc != header.dst_crc) rc = OTA_BAD_CRC;
+  if (rc == OTA_OK && !ota_verify(&header, hash)) rc = OTA_BAD_SIGNATURE;
+  if (rc == OTA_OK) {
+    if (esp_ota_end(handle) != ESP_OK || esp_ota_set_boot_partition(target) != ESP_OK) rc = OTA_FLASH_ERROR;
+  } else if (begun) {
+    esp_ota_abort(handle);
+  }
+  event_log(EV_OTA_APPLY, 3, rc, written, (int)(millis() - start));
+  return rc;
+}
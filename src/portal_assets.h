@@ -0,0 +1,65 @@
+// Generated by portalbuilder.py from portal/; do not edit
+
+const uint8_t portal_espclock_js[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x85, 0x94, 0x4d, 0x6f, 0xdc, 0x38,
+  0x0c, 0x86, 0xef, 0xf9, 0x15, 0xcc, 0xa1, 0x95, 0x8c, 0x06, 0x72, 0xba, 0xed, 0xa1, 0x68, 0x50,
+  0x2c, 0xb6, 0x49, 0x0a, 0x14, 0x48, 0x93, 0x22, 0xfd, 0x02, 0x3a, 0x3b, 0x07, 0x8d, 0x4d, 0x8f,
+  0x95, 0x6a, 0x24, 0xad, 0x44, 0xcf, 0x74, 0x52, 0xf4, 0xbf, 0x97, 0xb2, 0x3d, 0x1f, 0x4d, 0x76,
+  0xb3, 0x07, 0x03, 0x94, 0x4c, 0x3e, 0x12, 0x5f, 0x91, 0x2c, 0x4b, 0xb8, 0xf0, 0xba, 0xc6, 0x1a,
+  0x66, 0x6b, 0xf8, 0x62, 0xde, 0x98, 0x77, 0xda, 0xe9, 0x39, 0x46, 0x91, 0xa0, 0xf2, 0xae, 0x31,
+  0x73, 0x08, 0xbc, 0x04, 0x99, 0x10, 0xe1, 0x26, 0x55, 0xd1, 0x04, 0x02, 0xe3, 0x00, 0x53, 0xa8,
+  0xac, 0xaf, 0xbe, 0x3d, 0x57, 0x55, 0x08, 0xc5, 0x41, 0xed, 0xab, 0x6e, 0x81, 0x8e, 0x94, 0xae,
+  0xeb, 0xf3, 0x25, 0x1b, 0x17, 0x26, 0x11, 0x3a, 0x8c, 0x52, 0x9c, 0x5d, 0xbd, 0x3b, 0xf5, 0x8e,
+  0xf2, 0x5e, 0x7f, 0x8e, 0x38, 0x82, 0xa6, 0x73, 0x15, 0x19, 0xef, 0x64, 0x01, 0x3f, 0x0e, 0x00,
+  0x96, 0x3a, 0x02, 0xdd, 0xc2, 0x2b, 0xd8, 0x52, 0xe6, 0x48, 0xe7, 0x16, 0xb3, 0xf9, 0x7a, 0xfd,
+  0xb6, 0x96, 0x82, 0xcc, 0x02, 0x6f, 0xbd, 0x43, 0x51, 0x9c, 0xb0, 0xbf, 0x69, 0x40, 0xb2, 0xff,
+  0xe3, 0xc7, 0x70, 0x48, 0xb7, 0x6a, 0xa9, 0x6d, 0x87, 0x05, 0x6c, 0x2c, 0xc6, 0xbc, 0x75, 0x64,
+  0xd5, 0x99, 0x26, 0xfc, 0xc8, 0x61, 0x6f, 0x7c, 0x5c, 0x68, 0x92, 0x85, 0x8a, 0x98, 0xbc, 0x5d,
+  0x62, 0x7d, 0x15, 0xf2, 0xd1, 0x89, 0x77, 0x32, 0xf5, 0x2b, 0x53, 0x4f, 0x0e, 0x18, 0x5a, 0x96,
+  0x70, 0xe5, 0xec, 0x1a, 0x82, 0xd5, 0x9c, 0x5e, 0x4b, 0x14, 0x5e, 0xf2, 0x56, 0x76, 0x81, 0xe4,
+  0xbb, 0x58, 0x61, 0x02, 0x1d, 0xd9, 0xee, 0x42, 0xf0, 0x91, 0x58, 0xae, 0x5e, 0x11, 0x87, 0x94,
+  0x5d, 0x54, 0x5b, 0x8c, 0x79, 0x74, 0xd1, 0x3e, 0x94, 0xc8, 0x20, 0xe0, 0xa7, 0x68, 0x77, 0x99,
+  0x70, 0x44, 0x91, 0xc3, 0xfe, 0x45, 0xba, 0xaa, 0xd5, 0x6e, 0x8e, 0xf7, 0x05, 0x1b, 0x8e, 0x9a,
+  0xe9, 0x9a, 0x8f, 0xca, 0x91, 0x7d, 0xe2, 0x8a, 0xa2, 0x59, 0x70, 0x56, 0x29, 0x58, 0x43, 0xb2,
+  0xfc, 0x3b, 0x3d, 0x29, 0x0b, 0xd5, 0x18, 0x4b, 0x4c, 0xda, 0xc6, 0x77, 0x0c, 0x80, 0x88, 0xd4,
+  0x45, 0x07, 0x5d, 0x56, 0xb0, 0x53, 0xc6, 0xd5, 0xf8, 0xfd, 0xaa, 0x91, 0x62, 0xcc, 0x59, 0x14,
+  0x70, 0xf8, 0x0a, 0x8e, 0x4f, 0xe0, 0x67, 0x7f, 0x45, 0xe8, 0x4f, 0x48, 0x48, 0xa7, 0x5d, 0x22,
+  0xbf, 0xf8, 0xac, 0xad, 0xa9, 0x0d, 0xad, 0x25, 0x9f, 0xae, 0x2c, 0xba, 0x39, 0xb5, 0xf0, 0x27,
+  0x88, 0x5e, 0xba, 0x8d, 0x68, 0x9f, 0xae, 0x2f, 0xee, 0x88, 0x25, 0xe0, 0x25, 0x88, 0x21, 0xe5,
+  0x4c, 0x1d, 0xe4, 0xfe, 0xd0, 0xfa, 0x15, 0x50, 0x8b, 0x10, 0x3a, 0x9b, 0x10, 0x48, 0xcf, 0x2c,
+  0x72, 0xcd, 0x2d, 0x82, 0xb1, 0x2c, 0xaf, 0x71, 0xe4, 0xfb, 0xbf, 0x8d, 0x89, 0x8b, 0x55, 0xa6,
+  0xcd, 0xd0, 0x8e, 0x01, 0x0d, 0xbf, 0xe9, 0xa8, 0x77, 0x36, 0xf7, 0x05, 0xff, 0xa7, 0xc3, 0xb8,
+  0xfe, 0x80, 0x16, 0x2b, 0xf2, 0xac, 0x60, 0xfe, 0xbd, 0x93, 0xfa, 0x30, 0x2f, 0x8b, 0x31, 0xff,
+  0xbc, 0xd9, 0x20, 0x55, 0xad, 0x14, 0x65, 0x7f, 0x03, 0x75, 0x93, 0xbc, 0x13, 0x5c, 0x16, 0x2d,
+  0xba, 0x9d, 0x62, 0x71, 0x4f, 0xb1, 0xd8, 0xbb, 0xc8, 0x22, 0x6b, 0x73, 0xc7, 0x2d, 0xec, 0xbf,
+  0x4c, 0xf4, 0xab, 0xc4, 0x97, 0x9a, 0x4c, 0xc4, 0xfb, 0x0c, 0xe6, 0x07, 0x14, 0x17, 0x83, 0x54,
+  0x72, 0x91, 0x8a, 0xbc, 0x3c, 0xeb, 0x68, 0x0d, 0xf2, 0x51, 0x6f, 0x7f, 0x34, 0xd5, 0xb7, 0x54,
+  0x26, 0xac, 0xc4, 0x74, 0x3a, 0x28, 0x9e, 0xe3, 0x55, 0xe8, 0x52, 0x2b, 0x27, 0xe2, 0x32, 0xd7,
+  0xaf, 0x65, 0xbf, 0xa0, 0x1c, 0x9b, 0x93, 0xe3, 0xe9, 0xd6, 0x7c, 0xca, 0xe6, 0x0b, 0x28, 0x41,
+  0x8e, 0xeb, 0x3f, 0xa6, 0xf0, 0x04, 0x9e, 0x16, 0xd3, 0xe2, 0x3e, 0x85, 0xbb, 0x80, 0x35, 0xac,
+  0x7b, 0x4c, 0xb3, 0xaa, 0x47, 0x4a, 0xb6, 0xf6, 0x20, 0x79, 0xf9, 0x00, 0xe3, 0x1a, 0x97, 0x18,
+  0xf9, 0xa1, 0xfe, 0xea, 0x29, 0x11, 0x97, 0x5a, 0x25, 0x6b, 0x2a, 0x94, 0xc7, 0x47, 0xf0, 0xac,
+  0x50, 0x37, 0xde, 0x38, 0x96, 0x52, 0x14, 0x9b, 0xbf, 0x93, 0x67, 0x3b, 0x34, 0xaf, 0xff, 0x97,
+  0xfb, 0x7a, 0xc3, 0x9d, 0x3d, 0xc8, 0x9d, 0x3d, 0xc4, 0xed, 0x47, 0x49, 0x5f, 0x48, 0x7b, 0x35,
+  0x51, 0x45, 0xe4, 0x61, 0x30, 0xf6, 0x21, 0x0f, 0x93, 0xfc, 0x5f, 0xec, 0x5f, 0x84, 0xcb, 0xe2,
+  0x5c, 0x73, 0x21, 0xec, 0x1e, 0xdd, 0xaf, 0x8e, 0xc0, 0x6c, 0x9e, 0x74, 0xc4, 0x46, 0x66, 0xf6,
+  0xb1, 0xdc, 0x32, 0x09, 0x23, 0x5d, 0xfb, 0x95, 0x1c, 0x29, 0x3d, 0xe7, 0x3e, 0xa6, 0x42, 0x6b,
+  0x77, 0x90, 0x11, 0x53, 0xff, 0xf7, 0xd5, 0x4c, 0x6e, 0x25, 0x1a, 0xba, 0x85, 0x5a, 0xb1, 0x85,
+  0x03, 0x47, 0x29, 0xc2, 0xef, 0x34, 0x0e, 0x52, 0x26, 0x64, 0xf4, 0xde, 0xef, 0xa8, 0x74, 0x08,
+  0xe8, 0xea, 0xd3, 0xd6, 0xd8, 0x5a, 0x52, 0xbd, 0x0d, 0xdd, 0x34, 0xf1, 0xcf, 0x3d, 0x81, 0x2a,
+  0xdd, 0x8f, 0xc0, 0x6d, 0x3a, 0xc3, 0x25, 0x4e, 0x87, 0xdd, 0x4d, 0x4a, 0xa3, 0xd3, 0x9d, 0x63,
+  0x87, 0x82, 0x1e, 0x25, 0x96, 0x82, 0xb5, 0x0f, 0x2a, 0x44, 0xcf, 0x63, 0x06, 0xd9, 0x16, 0x85,
+  0x18, 0x82, 0x73, 0x9f, 0xa9, 0xc0, 0x4d, 0xeb, 0xe8, 0xd2, 0xd7, 0xf8, 0xfb, 0xe5, 0x72, 0xec,
+  0x76, 0x14, 0xe4, 0xef, 0x17, 0x60, 0x9f, 0x38, 0x8e, 0x83, 0x06, 0x00, 0x00
+};
+
+typedef struct {
+  const char* path;
+  const char* content_type;
+  const uint8_t* data;
+  size_t len;
+} portal_asset_t;
+
+const portal_asset_t portal_assets[] = {
+  { "/espclock.js", "application/javascript", portal_espclock_js, sizeof(portal_espclock_js) },
+};
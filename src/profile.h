@@ -0,0 +1,129 @@
+/*
+ * profile.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Wake phase profiler. profile_mark() charges the time since the previous mark to the phase that has
+// just ended. When the main CPU goes back to sleep, the phase durations of the wake are stored in a
+// ring buffer in RTC_SLOW_MEM (one ring per wake reason, cold boot counted as WAKE_NONE), and every
+// successful time sync reports min/avg/max per phase over each ring via status().
+
+#include <esp_timer.h>
+
+enum {
+  PHASE_BOOT,             // From reset until setup() is entered
+  PHASE_FILESYS,          // FILESYS.begin()
+  PHASE_CONFIG,           // load_config()
+  PHASE_WIFI,             // init_wifi(), including the config portal
+  PHASE_NETTIME,          // get_nettime()
+  PHASE_REPORT,           // profile_report() and log_flush()
+  PHASE_SAVE,             // save_config()
+  PHASE_SLEEP,            // Everything else until esp_deep_sleep_start()
+  PHASE_COUNT,
+};
+
+#define PROFILE_REASONS         4                                 // WAKE_NONE .. WAKE_TUNE_ULP_TIMER
+#define PROFILE_SAMPLES         4                                 // Wakes kept per reason
+#define PROFILE_ENTRY_WORDS     4                                 // PHASE_COUNT durations in ms, 16 bits each
+#define PROFILE_NONE            0xffff                            // Phase not reached during the wake
+
+// Ring buffer layout: one header word per reason (bits 0-15 = samples stored, bits 16-31 = next slot), then the entries
+#define PROFILE_HEADER(reason)  RTC_SLOW_MEM[RTC_PROFILE_START + (reason)]
+#define PROFILE_ENTRY(reason, slot) \
+  (&RTC_SLOW_MEM[RTC_PROFILE_START + PROFILE_REASONS + ((reason) * PROFILE_SAMPLES + (slot)) * PROFILE_ENTRY_WORDS])
+
+#if PROFILE_REASONS + PROFILE_REASONS * PROFILE_SAMPLES * PROFILE_ENTRY_WORDS > RTC_PROFILE_WORDS
+  #error "RTC_PROFILE_WORDS too small for profiler ring buffers"
+#endif
+
+#ifdef PROFILE
+
+  static int64_t profile_last_us;
+  static uint32_t profile_us[PHASE_COUNT];
+  static bool profile_seen[PHASE_COUNT];
+
+  // Called at the start of setup(); esp_timer_get_time() starts counting at reset
+  void profile_begin() {
+    memset(profile_us, 0, sizeof(profile_us));
+    memset(profile_seen, 0, sizeof(profile_seen));
+    profile_last_us = 0;
+  }
+
+  void profile_mark(int phase) {
+    int64_t now = esp_timer_get_time();
+    profile_us[phase] += now - profile_last_us;
+    profile_seen[phase] = true;
+    profile_last_us = now;
+  }
+
+  // Store phase durations of this wake just before going back to deep sleep
+  void profile_end(int reason) {
+    profile_mark(PHASE_SLEEP);
+    if (reason >= PROFILE_REASONS) return;
+    uint32_t header = PROFILE_HEADER(reason);
+    int count = LO_WORD(header), slot = HI_WORD(header);
+    if (count > PROFILE_SAMPLES || slot >= PROFILE_SAMPLES) count = slot = 0;
+    volatile uint32_t* entry = PROFILE_ENTRY(reason, slot);
+    for (int i=0; i<PHASE_COUNT; i+=2) {
+      uint16_t ms[2];
+      for (int j=0; j<2; j++) {
+        uint32_t t = profile_us[i+j] / 1000;
+        ms[j] = !profile_seen[i+j] ? PROFILE_NONE : (t >= PROFILE_NONE ? PROFILE_NONE-1 : t);
+      }
+      entry[i/2] = MAKE_INT(ms[1], ms[0]);
+    }
+    if (count < PROFILE_SAMPLES) count++;
+    slot = (slot + 1) % PROFILE_SAMPLES;
+    PROFILE_HEADER(reason) = MAKE_INT(slot, count);
+    event_log(EV_PROFILE, 1+PHASE_COUNT, reason, entry[0] & 0xffff, entry[0] >> 16, entry[1] & 0xffff, entry[1] >> 16,
+      entry[2] & 0xffff, entry[2] >> 16, entry[3] & 0xffff, entry[3] >> 16);
+  }
+
+  // Send min/avg/max duration (ms) of each phase over the stored wakes, one group per wake reason
+  void profile_report() {
+    static const char* names[PHASE_COUNT] = { "boot", "fs", "cfg", "wifi", "net", "rpt", "save", "sleep" };
+    char buf[768];
+    int len = snprintf(buf, sizeof(buf), "Wake profile");
+    for (int reason=0; reason<PROFILE_REASONS; reason++) {
+      int count = LO_WORD(PROFILE_HEADER(reason));
+      if (count == 0 || count > PROFILE_SAMPLES) continue;
+      len += snprintf(buf+len, sizeof(buf)-len, " R%d(n=%d)", reason, count);
+      for (int phase=0; phase<PHASE_COUNT && len<(int)sizeof(buf); phase++) {
+        uint32_t min = PROFILE_NONE, max = 0, sum = 0, n = 0;
+        for (int slot=0; slot<count; slot++) {
+          uint32_t word = PROFILE_ENTRY(reason, slot)[phase/2];
+          uint16_t ms = (phase & 1) ? HI_WORD(word) : LO_WORD(word);
+          if (ms == PROFILE_NONE) continue;
+          if (ms < min) min = ms;
+          if (ms > max) max = ms;
+          sum += ms; n++;
+        }
+        if (n > 0) len += snprintf(buf+len, sizeof(buf)-len, " %s=%d/%d/%d", names[phase], min, sum/n, max);
+      }
+      if (len >= (int)sizeof(buf)) break;
+    }
+    status("%s", buf);
+    profile_mark(PHASE_REPORT);
+  }
+
+#else // !PROFILE
+
+  void profile_begin() {}
+  void profile_mark(int phase) {}
+  void profile_end(int reason) {}
+  void profile_report() {}
+
+#endif // PROFILE
@@ -0,0 +1,88 @@
+/*
+ * session.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Deadline for the network session of a wake. The session starts when the radio is turned on, by wifi_preconnect()
+// or init_wifi(), and every step after that (WiFi connect, DNS and time requests in nettime.h, log flush in
+// netlog.h) only gets the time left until the deadline. The budget depends on the wake reason and is scaled down from 100% at
+// VDDH to 50% at VDDL, so a weak battery spends less on each attempt. A step cut short by the deadline is
+// counted in RTC_SLOW_MEM and logged as EV_SESSION_OVERRUN.
+
+enum {
+  SESSION_CONNECT,        // WiFi association (and the config portal opened when it fails)
+  SESSION_NETTIME,        // Time requests
+  SESSION_FLUSH,          // Syslog flush
+  SESSION_OTA,            // Firmware update download (see ota.h)
+};
+
+// Budget (ms) at full battery per wake reason: WAKE_NONE, WAKE_RESET_BUTTON, WAKE_UPDATE_NETTIME, WAKE_TUNE_ULP_TIMER, WAKE_DEBUG,
+// WAKE_DST_TRANSITION. A DST transition only needs the radio when a net time update falls due with it (see jobs.h).
+const int SESSION_BUDGETS[] = { 20000, 8000, 15000, 15000, 15000, 15000 };
+static_assert(sizeof(SESSION_BUDGETS)/sizeof(int) == WAKE_COUNT, "SESSION_BUDGETS needs one entry per wake reason");
+
+#define SESSION_MIN_PORTAL_SECS 3                                 // Shortest config portal worth opening when WiFi fails to connect
+#define SESSION_FLUSH_MS        500                               // Kept back from the time requests so that the log can still be flushed
+#define SESSION_HEADER          RTC_SLOW_MEM[RTC_SESSION_START]   // Bits 0-15 = overruns, bits 16-31 = step of last overrun
+#define SESSION_WORST           RTC_SLOW_MEM[RTC_SESSION_START+1] // Longest session (ms) since cold boot
+
+static bool session_active = false;
+static uint32_t session_start_ms, session_budget_ms;
+
+// Scale a budget at full battery down to half at VDDL; also used for the awake time budget (see awake.h)
+int vdd_budget(int budget) {
+  int vdd = _get(VAR_ADC_VDD), vddl = _get(VAR_ADC_VDDL), vddh = _get(VAR_ADC_VDDH);
+  if (vddh <= vddl || vdd >= vddh) return budget;
+  if (vdd <= vddl) return budget / 2;
+  return budget / 2 + (int64_t)(budget / 2) * (vdd - vddl) / (vddh - vddl);
+}
+
+int session_budget(int reason) {
+  return vdd_budget(SESSION_BUDGETS[reason >= 0 && reason < WAKE_COUNT ? reason : WAKE_NONE]);
+}
+
+// Start the session unless one is already running; restart forces a new deadline (eg. after the config portal)
+void session_begin(int reason, bool restart = false) {
+  if (session_active && !restart) return;
+  session_active = true;
+  session_start_ms = millis();
+  session_budget_ms = session_budget(reason);
+}
+
+// Time left (ms) until the deadline less reserve_ms; no limit if no session has been started
+uint32_t session_remaining_ms(uint32_t reserve_ms = 0) {
+  if (!session_active) return UINT32_MAX;
+  uint32_t elapsed = millis() - session_start_ms + reserve_ms;
+  return elapsed >= session_budget_ms ? 0 : session_budget_ms - elapsed;
+}
+
+bool session_expired() {
+  return session_remaining_ms() == 0;
+}
+
+void session_overrun(int step) {
+  uint32_t elapsed = millis() - session_start_ms;
+  SESSION_HEADER = MAKE_INT(step, LO_WORD(SESSION_HEADER) + 1);
+  event_log(EV_SESSION_OVERRUN, 3, step, elapsed, session_budget_ms);
+}
+
+// Called before going back to sleep
+void session_end() {
+  if (!session_active) return;
+  uint32_t elapsed = millis() - session_start_ms;
+  if (elapsed > SESSION_WORST) SESSION_WORST = elapsed;
+  session_active = false;
+}
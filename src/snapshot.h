@@ -0,0 +1,53 @@
+/*
+ * snapshot.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// RTC state snapshots. Between wakes, the whole state of the clock is the VAR_* block shared with the ULP (net and
+// clock time, countdowns, tick action, ULP timer, drift correction) and the ULP stack below VAR_STACK_LIMIT, all of
+// which is gone after the next reset. When something worth a post-mortem happens (SNAP_* below), snapshot_log()
+// copies them into the event log, so that they go out with the next log flush:
+//
+//   EV_SNAPSHOT         SNAPSHOT_VERSION, SNAP_* cause, number of VAR_* words, then the VAR_* words from 0
+//   EV_SNAPSHOT_STACK   ULP stack words from VAR_STACK_REGION, trailing zero words dropped
+//
+// eventlog.py -s writes the last snapshot in a syslog file to a file that the native runner replays with -r (see
+// native/runner.cpp).
+
+#define SNAPSHOT_VARS           VAR_STACK_REGION                  // VAR_* words, up to VAR_STACK_PTR
+
+enum {
+  SNAP_TUNE_ABORTED,      // Net time more than 60 secs from where the ULP had counted it to
+  SNAP_STACK_OVERFLOW,    // ULP stack canary overwritten
+  SNAP_AWAKE_OVERRUN,     // Main CPU forced back to sleep by the awake time backstop; taken at the next wake
+};
+
+static_assert(SNAPSHOT_VARS + 3 <= EVENT_MAX_ARGS, "EVENT_MAX_ARGS too small for EV_SNAPSHOT");
+
+void snapshot_log(int cause) {
+  int32_t args[EVENT_MAX_ARGS];
+  args[0] = SNAPSHOT_VERSION;
+  args[1] = cause;
+  args[2] = SNAPSHOT_VARS;
+  for (int i=0; i<SNAPSHOT_VARS; i++) args[i+3] = _get(i);
+  event_log_args(EV_SNAPSHOT, SNAPSHOT_VARS+3, args);
+  int words = min((int)_get(VAR_STACK_LIMIT) - VAR_STACK_REGION, EVENT_MAX_ARGS), argc = 0;
+  for (int i=0; i<words; i++) {
+    args[i] = _get(VAR_STACK_REGION + i);
+    if (args[i] != 0) argc = i+1;
+  }
+  event_log_args(EV_SNAPSHOT_STACK, argc, args);
+}
@@ -0,0 +1,63 @@
+/*
+ * trace.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ULP execution trace (ULP_TRACE builds only). At each trace point (TRACE_* in ulpdefs.h) the ULP code writes
+// a 16-bit record into a ring buffer of RTC_TRACE_WORDS in RTC_SLOW_MEM:
+//
+//   bits 12-15   trace point ID (never 0, so empty slots read as 0)
+//   bits 9-11    VAR_ULP_CALL_COUNT
+//   bits 6-8     VAR_TICK_ACTION
+//   bits 0-5     secs of VAR_DIFF_PACKED
+//
+// VAR_TRACE_POS is the slot of the next record. The ULP goes on tracing while the main CPU runs, so the
+// buffer is copied at the start of each wake; trace_dump() logs that copy as EV_ULP_TRACE, oldest record
+// first and two records per arg, whenever something worth a post-mortem happens (see wakeup_ulp()).
+// eventlog.py decodes it.
+
+#if defined(ULP_TRACE) && !defined(ULP_OPTIMIZE)
+  #error "ULP_TRACE needs ULP_OPTIMIZE for the ULP code to fit below RTC_TRACE_START"
+#endif
+
+#ifdef ULP_TRACE
+
+  static_assert(RTC_TRACE_WORDS/2 <= EVENT_MAX_ARGS, "EVENT_MAX_ARGS too small for EV_ULP_TRACE");
+
+  static uint16_t trace_copy[RTC_TRACE_WORDS];
+
+  // Called as soon as the main CPU wakes; the copy is ordered oldest first
+  void trace_snapshot() {
+    int pos = _get(VAR_TRACE_POS);
+    for (int i=0; i<RTC_TRACE_WORDS; i++) trace_copy[i] = RTC_SLOW_MEM[RTC_TRACE_START + (pos + i) % RTC_TRACE_WORDS] & 0xffff;
+  }
+
+  void trace_dump() {
+    int32_t args[RTC_TRACE_WORDS/2];
+    int argc = 0;
+    for (int i=0; i<RTC_TRACE_WORDS; i+=2) {
+      if (trace_copy[i] == 0 && trace_copy[i+1] == 0) continue;
+      args[argc++] = MAKE_INT(trace_copy[i+1], trace_copy[i]);
+    }
+    event_log_args(EV_ULP_TRACE, argc, args);
+  }
+
+#else // !ULP_TRACE
+
+  void trace_snapshot() {}
+  void trace_dump() {}
+
+#endif // ULP_TRACE
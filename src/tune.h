@@ -0,0 +1,36 @@
+/*
+ * tune.h
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Time since the last sync. A tune measures the drift of the ULP's net time over the time since net time was last
+// set from the network. That is VAR_SLEEP_INTERVAL only if the tune before succeeded; after failed tries (WiFi down,
+// no time source answering), it is all of their intervals together, and dividing the drift by the last one alone
+// mis-tunes the ULP timer by as many times. TUNE_ELAPSED keeps count of it across wakes.
+
+#define TUNE_ELAPSED            RTC_SLOW_MEM[RTC_TUNE_START]      // Secs of the tune intervals since net time was last set, less VAR_SLEEP_COUNT then
+
+// Called whenever net time is set from the network
+void tune_synced() {
+  TUNE_ELAPSED = (uint32_t)(-(int)_get(VAR_SLEEP_COUNT));
+}
+
+// Called at the start of a tune, when the ULP has just counted down VAR_SLEEP_INTERVAL; returns the secs since net
+// time was last set
+int tune_elapsed() {
+  TUNE_ELAPSED = (uint32_t)((int32_t)TUNE_ELAPSED + _get(VAR_SLEEP_INTERVAL));
+  return (int32_t)TUNE_ELAPSED + _get(VAR_SLEEP_COUNT);
+}
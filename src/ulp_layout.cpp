@@ -0,0 +1,293 @@
+/*
+ * ulp_layout.cpp
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Computes the worst-case stack usage of the ULP program so that the stack can be sized exactly and the
+// program loaded right after it (see load_and_run_ulp()).
+//
+// The program is walked path by path from its entry point, tracking which registers hold the address
+// of VAR_STACK_PTR or a stack address, and the current stack depth as stored in VAR_STACK_PTR. A
+// direct branch taken right after a return address has been pushed (X_CALL()) is treated as a call:
+// the callee is analyzed once from depth 0, and its peak depth and net stack effect on return
+// (X_RETURN(num_args) pops num_args+1 words) are reused at every call site.
+//
+// Stores through registers whose value is not known (eg. variable addresses passed on the stack to
+// LBL_FN_INC_CLOCK) are assumed not to touch VAR_STACK_PTR or the stack.
+
+#include <stdlib.h>
+#include <string.h>
+#include "ulpdefs.h"
+
+#define ULP_LAYOUT_MAX_STATES   2048                              // Per subroutine
+#define ULP_LAYOUT_MAX_DEPTH    256
+#define ULP_LAYOUT_MAX_FUNCS    32
+#define NO_LABEL                0xffff
+
+// Abstract register value
+enum { AV_UNKNOWN, AV_STACK_PTR, AV_STACK, AV_LABEL };
+
+typedef struct {
+  uint8_t kind;                                                   // AV_STACK_PTR: holds VAR_STACK_PTR
+  int16_t value;                                                  // AV_STACK: stack depth it points to; AV_LABEL: label
+} ulp_aval_t;
+
+typedef struct {
+  uint16_t pos;                                                   // Position of instruction in macro stream
+  int16_t depth;                                                  // Stack depth relative to subroutine entry
+  uint16_t ret;                                                   // Return label pushed since the last branch, or NO_LABEL
+  ulp_aval_t r[4];
+} ulp_lstate_t;
+
+typedef struct {
+  uint16_t label;
+  uint8_t status;                                                 // 0 = not analyzed, 1 = in progress, 2 = done
+  int16_t peak, delta;
+  uint8_t call_depth;
+} ulp_func_t;
+
+typedef struct {
+  const ulp_insn_t* prog;
+  size_t size;
+  ulp_func_t funcs[ULP_LAYOUT_MAX_FUNCS];
+  int num_funcs;
+} ulp_layout_t;
+
+static bool is_label_macro(ulp_insn_t insn) {
+  return insn.macro.opcode == OPCODE_MACRO && insn.macro.sub_opcode == SUB_OPCODE_MACRO_LABEL;
+}
+
+// First real instruction at or after pos
+static int skip_macros(ulp_layout_t* ctx, int pos) {
+  while (pos < (int)ctx->size && ctx->prog[pos].macro.opcode == OPCODE_MACRO) pos++;
+  return pos < (int)ctx->size ? pos : -1;
+}
+
+// M_BRANCH/M_LABELPC macro attached to the instruction at pos, if any
+static int attached_macro(ulp_layout_t* ctx, int pos) {
+  for (int i = pos - 1; i >= 0 && ctx->prog[i].macro.opcode == OPCODE_MACRO; i--) {
+    if (!is_label_macro(ctx->prog[i])) return i;
+  }
+  return -1;
+}
+
+static int find_label(ulp_layout_t* ctx, uint16_t label) {
+  for (size_t i = 0; i < ctx->size; i++) {
+    if (is_label_macro(ctx->prog[i]) && ctx->prog[i].macro.label == label) return skip_macros(ctx, i);
+  }
+  return -1;
+}
+
+// Target of a relative branch that was not relocated by a macro
+static int relative_target(ulp_layout_t* ctx, int pos, int offset) {
+  int step = offset < 0 ? -1 : 1;
+  for (int n = abs(offset); n > 0 && pos >= 0; n--) {
+    do pos += step; while (pos >= 0 && pos < (int)ctx->size && ctx->prog[pos].macro.opcode == OPCODE_MACRO);
+    if (pos >= (int)ctx->size) return -1;
+  }
+  return pos;
+}
+
+static bool push_state(ulp_lstate_t* list, int* count, ulp_lstate_t* s) {
+  if (*count >= ULP_LAYOUT_MAX_STATES) return false;
+  list[(*count)++] = *s;
+  return true;
+}
+
+static bool same_state(ulp_lstate_t* a, ulp_lstate_t* b) {
+  if (a->pos != b->pos || a->depth != b->depth || a->ret != b->ret) return false;
+  for (int r = 0; r < 4; r++) {
+    if (a->r[r].kind != b->r[r].kind || a->r[r].value != b->r[r].value) return false;
+  }
+  return true;
+}
+
+static bool seen_state(ulp_lstate_t* list, int count, ulp_lstate_t* s) {
+  for (int i = 0; i < count; i++) {
+    if (same_state(&list[i], s)) return true;
+  }
+  return false;
+}
+
+static ulp_aval_t make_aval(uint8_t kind, int value) {
+  ulp_aval_t v;
+  v.kind = kind;
+  v.value = kind == AV_UNKNOWN || kind == AV_STACK_PTR ? 0 : value;
+  return v;
+}
+
+static bool analyze_func(ulp_layout_t* ctx, int entry, bool is_main, int* peak, int* delta, int* call_depth);
+
+// Peak depth, net stack effect and nesting depth of the subroutine at label, analyzed once
+static ulp_func_t* func_summary(ulp_layout_t* ctx, uint16_t label) {
+  ulp_func_t* f = NULL;
+  for (int i = 0; i < ctx->num_funcs; i++) if (ctx->funcs[i].label == label) f = &ctx->funcs[i];
+  if (f == NULL) {
+    if (ctx->num_funcs == ULP_LAYOUT_MAX_FUNCS) return NULL;
+    f = &ctx->funcs[ctx->num_funcs++];
+    memset(f, 0, sizeof(ulp_func_t));
+    f->label = label;
+  }
+  if (f->status == 1) return NULL;                                // Recursion
+  if (f->status == 2) return f;
+  f->status = 1;
+  int entry = find_label(ctx, label), peak, delta, depth;
+  if (entry < 0 || !analyze_func(ctx, entry, false, &peak, &delta, &depth)) return NULL;
+  f->peak = peak; f->delta = delta; f->call_depth = depth;
+  f->status = 2;
+  return f;
+}
+
+static bool analyze_func(ulp_layout_t* ctx, int entry, bool is_main, int* peak, int* delta, int* call_depth) {
+  ulp_lstate_t* pending = (ulp_lstate_t*)malloc(ULP_LAYOUT_MAX_STATES * sizeof(ulp_lstate_t));
+  ulp_lstate_t* visited = (ulp_lstate_t*)malloc(ULP_LAYOUT_MAX_STATES * sizeof(ulp_lstate_t));
+  int num_pending = 0, num_visited = 0;
+  bool ok = pending != NULL && visited != NULL, returned = false;
+  *peak = 0; *delta = 0; *call_depth = 0;
+
+  ulp_lstate_t s;
+  memset(&s, 0, sizeof(s));
+  s.pos = entry; s.ret = NO_LABEL;
+  if (ok) ok = push_state(pending, &num_pending, &s);
+  while (ok && num_pending > 0) {
+    s = pending[--num_pending];
+    if (seen_state(visited, num_visited, &s)) continue;
+    if (!(ok = push_state(visited, &num_visited, &s))) break;
+    if (s.depth > *peak) *peak = s.depth;
+    if (s.depth < -ULP_LAYOUT_MAX_DEPTH || s.depth > ULP_LAYOUT_MAX_DEPTH || (is_main && s.depth < 0)) { ok = false; break; }
+
+    ulp_insn_t insn = ctx->prog[s.pos];
+    int macro = attached_macro(ctx, s.pos);
+    uint16_t label = macro >= 0 ? ctx->prog[macro].macro.label : NO_LABEL;
+    int next = skip_macros(ctx, s.pos + 1);
+    ulp_lstate_t n = s;
+    bool fallthrough = true;
+
+    switch (insn.macro.opcode) {
+      case OPCODE_ALU:
+        if (insn.alu_imm.sub_opcode == SUB_OPCODE_ALU_IMM) {
+          ulp_aval_t src = s.r[insn.alu_imm.sreg];
+          if (insn.alu_imm.sel == ALU_SEL_MOV && macro >= 0) {
+            n.r[insn.alu_imm.dreg] = make_aval(AV_LABEL, label);
+          } else if (insn.alu_imm.sel == ALU_SEL_MOV && insn.alu_imm.imm == VAR_STACK_PTR) {
+            n.r[insn.alu_imm.dreg] = make_aval(AV_STACK_PTR, 0);
+          } else if (src.kind == AV_STACK && insn.alu_imm.sel == ALU_SEL_ADD) {
+            n.r[insn.alu_imm.dreg] = make_aval(AV_STACK, src.value + (int)insn.alu_imm.imm);
+          } else if (src.kind == AV_STACK && insn.alu_imm.sel == ALU_SEL_SUB) {
+            n.r[insn.alu_imm.dreg] = make_aval(AV_STACK, src.value - (int)insn.alu_imm.imm);
+          } else {
+            n.r[insn.alu_imm.dreg] = make_aval(AV_UNKNOWN, 0);
+          }
+        } else if (insn.alu_reg.sub_opcode == SUB_OPCODE_ALU_REG) {
+          n.r[insn.alu_reg.dreg] = insn.alu_reg.sel == ALU_SEL_MOV ? s.r[insn.alu_reg.sreg] : make_aval(AV_UNKNOWN, 0);
+        }
+        break;
+      case OPCODE_LD: {
+        bool sp = s.r[insn.ld.sreg].kind == AV_STACK_PTR && insn.ld.offset == 0;
+        n.r[insn.ld.dreg] = sp ? make_aval(AV_STACK, s.depth) : make_aval(AV_UNKNOWN, 0);
+        break;
+      }
+      case OPCODE_ST: {
+        ulp_aval_t addr = s.r[insn.st.dreg], value = s.r[insn.st.sreg];
+        if (addr.kind == AV_STACK_PTR && insn.st.offset == 0) {
+          if (value.kind != AV_STACK) { ok = false; break; }     // Stack pointer set to something we cannot follow
+          n.depth = value.value;
+        } else if (addr.kind == AV_STACK) {
+          int slot = addr.value + insn.st.offset;
+          if (slot + 1 > *peak) *peak = slot + 1;
+          n.ret = value.kind == AV_LABEL ? value.value : NO_LABEL;
+        }
+        break;
+      }
+      case OPCODE_RD_REG:
+        n.r[R0] = make_aval(AV_UNKNOWN, 0);
+        break;
+      case OPCODE_ADC:
+        n.r[insn.adc.dreg] = make_aval(AV_UNKNOWN, 0);
+        break;
+      case OPCODE_HALT:
+        if (!is_main || s.depth != 0) ok = false;                 // Stack must be balanced whenever the ULP halts
+        fallthrough = false;
+        break;
+      case OPCODE_BRANCH: {
+        int target = -1;
+        bool conditional = true;
+        if (insn.bx.sub_opcode == SUB_OPCODE_BX && insn.bx.reg) {
+          // Return from subroutine
+          if (is_main || (returned && *delta != s.depth)) { ok = false; break; }
+          returned = true;
+          *delta = s.depth;
+          fallthrough = false;
+          break;
+        }
+        if (insn.bx.sub_opcode == SUB_OPCODE_BX) {
+          if (label == NO_LABEL) { ok = false; break; }
+          target = find_label(ctx, label);
+          conditional = insn.bx.type != BX_JUMP_TYPE_DIRECT;
+        } else if (label != NO_LABEL) {
+          target = find_label(ctx, label);
+        } else if (insn.b.sub_opcode == SUB_OPCODE_B) {
+          target = relative_target(ctx, s.pos, insn.b.sign ? -(int)insn.b.offset : insn.b.offset);
+        } else {
+          target = relative_target(ctx, s.pos, insn.bs.sign ? -(int)insn.bs.offset : insn.bs.offset);
+        }
+        if (target < 0) { ok = false; break; }
+        n.ret = NO_LABEL;
+        if (!conditional && s.ret != NO_LABEL) {
+          // X_CALL(): continue at the return label with the callee's net stack effect applied
+          ulp_func_t* f = func_summary(ctx, label);
+          if (f == NULL || find_label(ctx, s.ret) != next) { ok = false; break; }
+          if (s.depth + f->peak > *peak) *peak = s.depth + f->peak;
+          if (f->call_depth + 1 > *call_depth) *call_depth = f->call_depth + 1;
+          n.depth = s.depth + f->delta;
+          for (int r = 0; r < 4; r++) n.r[r] = make_aval(AV_UNKNOWN, 0);
+          break;
+        }
+        ulp_lstate_t t = n;
+        t.pos = target;
+        ok = push_state(pending, &num_pending, &t);
+        fallthrough = conditional;
+        break;
+      }
+      default:
+        break;
+    }
+    if (!ok) break;
+    if (fallthrough) {
+      if (next < 0) { ok = false; break; }                        // Fell off the end of the program
+      n.pos = next;
+      ok = push_state(pending, &num_pending, &n);
+    }
+  }
+  if (!is_main && !returned) ok = false;
+  free(pending); free(visited);
+  return ok;
+}
+
+bool ulp_stack_usage(const ulp_insn_t* program, size_t size, ulp_stack_info_t* info) {
+  ulp_layout_t* ctx = (ulp_layout_t*)calloc(1, sizeof(ulp_layout_t));
+  if (ctx == NULL) return false;
+  ctx->prog = program;
+  ctx->size = size;
+  int entry = skip_macros(ctx, 0), peak, delta, call_depth;
+  bool ok = entry >= 0 && analyze_func(ctx, entry, true, &peak, &delta, &call_depth);
+  if (ok) {
+    info->stack_words = peak;
+    info->call_depth = call_depth;
+  }
+  free(ctx);
+  return ok;
+}
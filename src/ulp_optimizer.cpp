@@ -0,0 +1,574 @@
+/*
+ * ulp_optimizer.cpp
+ *
+ * Copyright 2021 Victor Chew
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Peephole optimizer for the ULP program, run on the macro stream (M_LABEL/M_BRANCH/M_LABELPC still
+// present) before patched_ulp_process_macros_and_load() relocates it.
+//
+// The X_* macros in ulpdefs.h are written to be self-contained, so back-to-back macros reload R3 with
+// the same variable address, rebuild constants in R2, re-read VAR_STACK_PTR right after storing it, and
+// X_BNE() branches over an unconditional branch. The passes below remove that redundancy:
+//
+//   1. Forward value tracking (reset at every label): drop I_MOVI of a value the register already
+//      holds, forward a stored register to a following I_LD of the same address, and fold
+//      "I_MOVI(Rz, addr); I_LD/I_ST(.., Rz, 0)" into an offset from another register that already
+//      holds a nearby address.
+//   2. Dead code elimination of ALU/LD instructions whose result is never read.
+//   3. Removal of jumps to the next instruction and threading of jumps to jumps.
+//   4. Folding of X_BNE()'s "branch over branch" into I_BL/I_BGE on R0 where the value compared can be
+//      loaded straight into R0.
+//
+// Every transformation is checked against a global liveness analysis of R0-R3 and the ALU flags, so
+// the scratch-register conventions documented on the X_* macros are not relied upon.
+
+#include <stdlib.h>
+#include <string.h>
+#include "ulpdefs.h"
+
+#define ULP_OPT_MAX_ROUNDS      16
+#define ULP_MAX_LD_ST_OFFSET    1023                              // Keep clear of the sign bit of the 11-bit LD/ST offset
+#define ULP_MAX_BRANCH_OFFSET   125                               // I_BL/I_BGE reach is 127 words; leave a little slack
+
+// Liveness bits
+#define LIVE_R(reg)             (1 << (reg))
+#define LIVE_FLAGS              (1 << 4)
+#define LIVE_ALL                0x1f
+
+#define SUCC_NONE               -1                                // No successor
+
+typedef struct {
+  size_t pos;                                                     // Position in macro stream
+  int macro;                                                      // Position of attached M_BRANCH/M_LABELPC macro or -1
+  bool labelled;                                                  // Preceded by at least one M_LABEL
+  uint16_t section;                                               // Last top-level label (< LBL_NEXT) seen
+  int succ[2];                                                    // Real instruction successors (SUCC_NONE if unused)
+  bool returns;                                                   // I_BXR: successors are all M_MOVL return points
+  uint8_t use, def, live_in, live_out;
+} ulp_node_t;
+
+typedef struct {
+  uint16_t label;
+  int node;
+} ulp_label_t;
+
+typedef struct {
+  ulp_insn_t* prog;
+  size_t size;
+  bool* dead;
+  ulp_node_t* nodes;
+  int num_nodes;
+  ulp_label_t* labels;
+  int num_labels;
+  int* retpoints;
+  int num_retpoints;
+} ulp_opt_t;
+
+// Execution time in RTC_FAST_CLK cycles, as given in the ESP32 TRM (ULP coprocessor instruction set)
+uint32_t ulp_insn_cycles(ulp_insn_t insn) {
+  switch (insn.macro.opcode) {
+    case OPCODE_ALU:    return 6;
+    case OPCODE_LD:     return 8;
+    case OPCODE_ST:     return 8;
+    case OPCODE_BRANCH: return 4;
+    case OPCODE_DELAY:  return insn.delay.cycles;
+    case OPCODE_RD_REG: return 4;
+    case OPCODE_WR_REG: return 8;
+    case OPCODE_ADC:    return 500;
+    case OPCODE_HALT:   return 2;
+    case OPCODE_END:    return 2;
+    default:            return 4;
+  }
+}
+
+static bool is_macro(ulp_insn_t insn) {
+  return insn.macro.opcode == OPCODE_MACRO;
+}
+
+static bool is_alu(ulp_insn_t insn, int sub_opcode, int sel) {
+  return insn.alu_imm.opcode == OPCODE_ALU && insn.alu_imm.sub_opcode == sub_opcode && insn.alu_imm.sel == sel;
+}
+
+static bool is_bx(ulp_insn_t insn, int type) {
+  return insn.bx.opcode == OPCODE_BRANCH && insn.bx.sub_opcode == SUB_OPCODE_BX && insn.bx.reg == 0 && insn.bx.type == type;
+}
+
+// Registers (and ALU flags) read and written by an instruction
+static void insn_use_def(ulp_insn_t insn, uint8_t* use, uint8_t* def) {
+  *use = 0; *def = 0;
+  switch (insn.macro.opcode) {
+    case OPCODE_ALU:
+      if (insn.alu_reg.sub_opcode == SUB_OPCODE_ALU_REG) {
+        *use = LIVE_R(insn.alu_reg.sreg);
+        if (insn.alu_reg.sel != ALU_SEL_MOV) *use |= LIVE_R(insn.alu_reg.treg);
+        *def = LIVE_R(insn.alu_reg.dreg) | LIVE_FLAGS;
+      } else if (insn.alu_imm.sub_opcode == SUB_OPCODE_ALU_IMM) {
+        if (insn.alu_imm.sel != ALU_SEL_MOV) *use = LIVE_R(insn.alu_imm.sreg);
+        *def = LIVE_R(insn.alu_imm.dreg) | LIVE_FLAGS;
+      }
+      break;                                                      // Stage counter ops touch neither
+    case OPCODE_LD:
+      *use = LIVE_R(insn.ld.sreg);
+      *def = LIVE_R(insn.ld.dreg);
+      break;
+    case OPCODE_ST:
+      *use = LIVE_R(insn.st.sreg) | LIVE_R(insn.st.dreg);
+      break;
+    case OPCODE_BRANCH:
+      if (insn.bx.sub_opcode == SUB_OPCODE_BX) {
+        if (insn.bx.reg) *use |= LIVE_R(insn.bx.dreg);
+        if (insn.bx.type != BX_JUMP_TYPE_DIRECT) *use |= LIVE_FLAGS;
+      } else if (insn.b.sub_opcode == SUB_OPCODE_B) {
+        *use = LIVE_R(R0);
+      }
+      break;
+    case OPCODE_RD_REG:
+      *def = LIVE_R(R0);
+      break;
+    case OPCODE_ADC:
+      *def = LIVE_R(insn.adc.dreg);
+      break;
+    case OPCODE_WR_REG: case OPCODE_DELAY: case OPCODE_HALT: case OPCODE_END:
+      break;
+    default:
+      *use = LIVE_ALL;                                            // Unknown instruction; assume it reads everything
+      break;
+  }
+}
+
+static int find_label(ulp_opt_t* opt, uint16_t label) {
+  int lo = 0, hi = opt->num_labels - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (opt->labels[mid].label == label) return opt->labels[mid].node;
+    if (opt->labels[mid].label < label) lo = mid + 1; else hi = mid - 1;
+  }
+  return SUCC_NONE;
+}
+
+static int label_cmp(const void* lhs, const void* rhs) {
+  return (int)((const ulp_label_t*)lhs)->label - (int)((const ulp_label_t*)rhs)->label;
+}
+
+// Compact the stream, then rebuild nodes, labels, control flow and liveness.
+// Returns false if the program uses a construct the optimizer does not understand.
+static bool analyze(ulp_opt_t* opt) {
+  size_t w = 0;
+  for (size_t r = 0; r < opt->size; r++) {
+    if (!opt->dead[r]) opt->prog[w++] = opt->prog[r];
+  }
+  opt->size = w;
+  memset(opt->dead, 0, opt->size * sizeof(bool));
+
+  // Nodes and labels
+  opt->num_nodes = 0; opt->num_labels = 0; opt->num_retpoints = 0;
+  int pending_macro = -1;
+  bool pending_label = false;
+  uint16_t section = 0;
+  for (size_t i = 0; i < opt->size; i++) {
+    ulp_insn_t insn = opt->prog[i];
+    if (is_macro(insn)) {
+      if (insn.macro.sub_opcode == SUB_OPCODE_MACRO_LABEL) {
+        opt->labels[opt->num_labels].label = insn.macro.label;
+        opt->labels[opt->num_labels].node = opt->num_nodes;
+        opt->num_labels++;
+        pending_label = true;
+        if (insn.macro.label < LBL_NEXT) section = insn.macro.label;
+      } else {
+        pending_macro = i;
+      }
+      continue;
+    }
+    ulp_node_t* node = &opt->nodes[opt->num_nodes++];
+    node->pos = i;
+    node->macro = pending_macro;
+    node->labelled = pending_label;
+    node->section = section;
+    pending_macro = -1; pending_label = false;
+  }
+  if (pending_macro >= 0 || pending_label || opt->num_nodes == 0) return false;
+  qsort(opt->labels, opt->num_labels, sizeof(ulp_label_t), label_cmp);
+  for (int k = 0; k < opt->num_nodes; k++) {
+    ulp_node_t* node = &opt->nodes[k];
+    if (node->macro >= 0 && opt->prog[node->macro].macro.sub_opcode == SUB_OPCODE_MACRO_LABELPC) {
+      int target = find_label(opt, opt->prog[node->macro].macro.label);
+      if (target == SUCC_NONE) return false;
+      opt->retpoints[opt->num_retpoints++] = target;
+    }
+  }
+
+  // Control flow
+  for (int k = 0; k < opt->num_nodes; k++) {
+    ulp_node_t* node = &opt->nodes[k];
+    ulp_insn_t insn = opt->prog[node->pos];
+    int next = k + 1 < opt->num_nodes ? k + 1 : SUCC_NONE;
+    node->succ[0] = next; node->succ[1] = SUCC_NONE; node->returns = false;
+    insn_use_def(insn, &node->use, &node->def);
+    if (insn.macro.opcode == OPCODE_HALT) {
+      node->succ[0] = 0;                                          // Next ULP wakeup starts from the top
+    } else if (insn.macro.opcode == OPCODE_BRANCH) {
+      bool relocated = node->macro >= 0 && opt->prog[node->macro].macro.sub_opcode == SUB_OPCODE_MACRO_BRANCH;
+      if (insn.bx.sub_opcode == SUB_OPCODE_BX && insn.bx.reg) {
+        node->returns = true;
+        if (insn.bx.type == BX_JUMP_TYPE_DIRECT) node->succ[0] = SUCC_NONE;
+      } else {
+        if (!relocated) return false;                             // Hand-computed offsets; leave program alone
+        node->succ[1] = find_label(opt, opt->prog[node->macro].macro.label);
+        if (node->succ[1] == SUCC_NONE) return false;
+        if (insn.bx.sub_opcode == SUB_OPCODE_BX && insn.bx.type == BX_JUMP_TYPE_DIRECT) node->succ[0] = SUCC_NONE;
+      }
+    }
+  }
+
+  // Liveness, iterated backwards to a fixed point
+  for (int k = 0; k < opt->num_nodes; k++) opt->nodes[k].live_in = opt->nodes[k].live_out = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int k = opt->num_nodes - 1; k >= 0; k--) {
+      ulp_node_t* node = &opt->nodes[k];
+      uint8_t out = 0;
+      for (int s = 0; s < 2; s++) {
+        if (node->succ[s] != SUCC_NONE) out |= opt->nodes[node->succ[s]].live_in;
+      }
+      if (node->returns) {
+        for (int r = 0; r < opt->num_retpoints; r++) out |= opt->nodes[opt->retpoints[r]].live_in;
+      }
+      uint8_t in = node->use | (out & ~node->def);
+      if (in != node->live_in || out != node->live_out) {
+        node->live_in = in; node->live_out = out;
+        changed = true;
+      }
+    }
+  }
+  return true;
+}
+
+static void kill_node(ulp_opt_t* opt, int k) {
+  opt->dead[opt->nodes[k].pos] = true;
+  if (opt->nodes[k].macro >= 0) opt->dead[opt->nodes[k].macro] = true;
+}
+
+// Values known to be held by registers, and registers known to hold the content of an address
+typedef struct {
+  bool known[4];
+  uint16_t value[4];
+  int mem_addr[4];                                                // mem_addr[reg] = address whose content reg holds, or -1
+} ulp_values_t;
+
+static void forget_all(ulp_values_t* v) {
+  for (int r = 0; r < 4; r++) { v->known[r] = false; v->mem_addr[r] = -1; }
+}
+
+static void forget_reg(ulp_values_t* v, int reg) {
+  v->known[reg] = false;
+  v->mem_addr[reg] = -1;
+}
+
+static void forget_addr(ulp_values_t* v, int addr) {
+  for (int r = 0; r < 4; r++) if (addr < 0 || v->mem_addr[r] == addr) v->mem_addr[r] = -1;
+}
+
+static int holder_of(ulp_values_t* v, int addr) {
+  for (int r = 0; r < 4; r++) if (v->mem_addr[r] == addr) return r;
+  return -1;
+}
+
+// Register other than skip holding the largest known value <= addr within LD/ST offset reach
+static int base_for(ulp_values_t* v, int addr, int skip) {
+  int best = -1;
+  for (int r = 0; r < 4; r++) {
+    if (r == skip || !v->known[r] || v->value[r] > addr || addr - v->value[r] > ULP_MAX_LD_ST_OFFSET) continue;
+    if (best < 0 || v->value[r] > v->value[best]) best = r;
+  }
+  return best;
+}
+
+static uint16_t alu_eval(int sel, uint16_t a, uint16_t b) {
+  switch (sel) {
+    case ALU_SEL_ADD: return a + b;
+    case ALU_SEL_SUB: return a - b;
+    case ALU_SEL_AND: return a & b;
+    case ALU_SEL_OR:  return a | b;
+    case ALU_SEL_MOV: return b;
+    case ALU_SEL_LSH: return b >= 16 ? 0 : a << b;
+    default:          return b >= 16 ? 0 : a >> b;
+  }
+}
+
+// Pass 1: forward value tracking
+static bool pass_values(ulp_opt_t* opt) {
+  bool changed = false;
+  ulp_values_t v;
+  forget_all(&v);
+  for (int k = 0; k < opt->num_nodes; k++) {
+    ulp_node_t* node = &opt->nodes[k];
+    ulp_insn_t* insn = &opt->prog[node->pos];
+    if (node->labelled) forget_all(&v);
+    bool flags_dead = !(node->live_out & LIVE_FLAGS);
+    bool relocated = node->macro >= 0;
+
+    if (!relocated && is_alu(*insn, SUB_OPCODE_ALU_IMM, ALU_SEL_MOV)) {
+      int z = insn->alu_imm.dreg;
+      uint16_t c = insn->alu_imm.imm;
+      // Register already holds this value
+      if (flags_dead && v.known[z] && v.value[z] == c) {
+        kill_node(opt, k);
+        changed = true;
+        continue;
+      }
+      // I_MOVI(Rz, addr) feeding the address of the next LD/ST
+      ulp_node_t* mem = k + 1 < opt->num_nodes ? &opt->nodes[k+1] : NULL;
+      ulp_insn_t* m = mem ? &opt->prog[mem->pos] : NULL;
+      if (flags_dead && mem && !mem->labelled && m->ld.opcode == OPCODE_LD && m->ld.sreg == z) {
+        int addr = c + m->ld.offset, w = m->ld.dreg;
+        bool z_dead_after = w == z || !(mem->live_out & LIVE_R(z));
+        int x = holder_of(&v, addr);
+        if (z_dead_after && x == w) {
+          // Register already holds the content of this address
+          kill_node(opt, k); kill_node(opt, k+1);
+          k++;
+          changed = true;
+          continue;
+        }
+        int y = base_for(&v, addr, w == z ? -1 : z);
+        if (z_dead_after && y >= 0) {
+          m->ld.sreg = y;
+          m->ld.offset = addr - v.value[y];
+          kill_node(opt, k);
+          changed = true;
+          forget_reg(&v, w);
+          v.mem_addr[w] = addr;
+          k++;
+          continue;
+        }
+      }
+      if (flags_dead && mem && !mem->labelled && m->st.opcode == OPCODE_ST && m->st.sub_opcode == SUB_OPCODE_ST &&
+          m->st.dreg == z && m->st.sreg != z && !(mem->live_out & LIVE_R(z))) {
+        int addr = c + m->st.offset;
+        int y = base_for(&v, addr, -1);
+        if (y >= 0) {
+          m->st.dreg = y;
+          m->st.offset = addr - v.value[y];
+          kill_node(opt, k);
+          changed = true;
+          forget_addr(&v, addr);
+          v.mem_addr[m->st.sreg] = addr;
+          k++;
+          continue;
+        }
+      }
+    }
+
+    // Load from an address whose content a register already holds
+    if (insn->ld.opcode == OPCODE_LD && v.known[insn->ld.sreg]) {
+      int addr = v.value[insn->ld.sreg] + insn->ld.offset, w = insn->ld.dreg;
+      int x = holder_of(&v, addr);
+      if (x == w) {
+        kill_node(opt, k);
+        changed = true;
+        continue;
+      }
+      if (x >= 0 && flags_dead) {
+        *insn = (ulp_insn_t)I_MOVR((uint32_t)w, (uint32_t)x);
+        forget_reg(&v, w);
+        v.mem_addr[w] = addr;
+        changed = true;
+        continue;
+      }
+    }
+
+    // Update knowledge
+    switch (insn->macro.opcode) {
+      case OPCODE_ALU:
+        if (insn->alu_imm.sub_opcode == SUB_OPCODE_ALU_IMM) {
+          int d = insn->alu_imm.dreg, s = insn->alu_imm.sreg, sel = insn->alu_imm.sel;
+          bool known = !relocated && (sel == ALU_SEL_MOV || v.known[s]);
+          uint16_t value = known ? alu_eval(sel, v.value[s], insn->alu_imm.imm) : 0;
+          forget_reg(&v, d);
+          v.known[d] = known; v.value[d] = value;
+        } else if (insn->alu_reg.sub_opcode == SUB_OPCODE_ALU_REG) {
+          int d = insn->alu_reg.dreg, s = insn->alu_reg.sreg, t = insn->alu_reg.treg, sel = insn->alu_reg.sel;
+          bool known = v.known[s] && (sel == ALU_SEL_MOV || v.known[t]);
+          uint16_t value = known ? (sel == ALU_SEL_MOV ? v.value[s] : alu_eval(sel, v.value[s], v.value[t])) : 0;
+          int addr = sel == ALU_SEL_MOV ? v.mem_addr[s] : -1;
+          forget_reg(&v, d);
+          v.known[d] = known; v.value[d] = value; v.mem_addr[d] = addr;
+        }
+        break;
+      case OPCODE_LD: {
+        int s = insn->ld.sreg, d = insn->ld.dreg;
+        int addr = v.known[s] ? v.value[s] + insn->ld.offset : -1;
+        forget_reg(&v, d);
+        v.mem_addr[d] = addr;
+        break;
+      }
+      case OPCODE_ST: {
+        int addr = v.known[insn->st.dreg] ? v.value[insn->st.dreg] + insn->st.offset : -1;
+        forget_addr(&v, addr);
+        if (addr >= 0) v.mem_addr[insn->st.sreg] = addr;
+        break;
+      }
+      case OPCODE_RD_REG:
+        forget_reg(&v, R0);
+        break;
+      case OPCODE_ADC:
+        forget_reg(&v, insn->adc.dreg);
+        break;
+      case OPCODE_BRANCH:
+        if (node->succ[0] == SUCC_NONE || node->succ[0] != k + 1) forget_all(&v);
+        break;
+      case OPCODE_HALT:
+        forget_all(&v);
+        break;
+    }
+  }
+  return changed;
+}
+
+// Pass 2: remove ALU/LD instructions whose results are never read
+static bool pass_dead_code(ulp_opt_t* opt) {
+  bool changed = false;
+  for (int k = 0; k < opt->num_nodes; k++) {
+    ulp_node_t* node = &opt->nodes[k];
+    ulp_insn_t insn = opt->prog[node->pos];
+    if (node->macro >= 0) continue;
+    bool removable = insn.macro.opcode == OPCODE_LD ||
+      (insn.macro.opcode == OPCODE_ALU && insn.alu_imm.sub_opcode != SUB_OPCODE_ALU_CNT);
+    if (removable && node->def && !(node->def & node->live_out)) {
+      kill_node(opt, k);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Pass 3: drop jumps to the next instruction, thread jumps to unconditional jumps
+static bool pass_jumps(ulp_opt_t* opt) {
+  bool changed = false;
+  for (int k = 0; k < opt->num_nodes; k++) {
+    ulp_node_t* node = &opt->nodes[k];
+    ulp_insn_t insn = opt->prog[node->pos];
+    if (node->macro < 0 || insn.macro.opcode != OPCODE_BRANCH || node->succ[1] == SUCC_NONE) continue;
+    int target = node->succ[1];
+    if (target == k + 1) {
+      kill_node(opt, k);
+      changed = true;
+      continue;
+    }
+    if (insn.bx.sub_opcode != SUB_OPCODE_BX) continue;            // Relative branches may not reach a threaded target
+    ulp_node_t* tnode = &opt->nodes[target];
+    if (target != k && tnode->macro >= 0 && is_bx(opt->prog[tnode->pos], BX_JUMP_TYPE_DIRECT) &&
+        tnode->succ[1] != target && tnode->succ[1] != k) {
+      opt->prog[node->macro].macro.label = opt->prog[tnode->macro].macro.label;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Pass 4: fold X_BNE()'s "I_MOVR(R3, Rx), I_SUBI(R3, R3, v), M_BXZ(m), M_BX(label), M_LABEL(m)"
+// into "M_BL(label, v), M_BGE(label, v+1)" (just "M_BGE(label, 1)" for v == 0) on R0
+static bool pass_fold_bne(ulp_opt_t* opt) {
+  bool changed = false;
+  for (int k = 1; k + 4 < opt->num_nodes; k++) {
+    ulp_node_t* n = &opt->nodes[k];
+    ulp_insn_t mov = opt->prog[n[0].pos], sub = opt->prog[n[1].pos], bxz = opt->prog[n[2].pos], bx = opt->prog[n[3].pos];
+    if (!is_alu(mov, SUB_OPCODE_ALU_REG, ALU_SEL_MOV) || mov.alu_reg.dreg != R3) continue;
+    if (!is_alu(sub, SUB_OPCODE_ALU_IMM, ALU_SEL_SUB) || sub.alu_imm.dreg != R3 || sub.alu_imm.sreg != R3) continue;
+    if (!is_bx(bxz, BX_JUMP_TYPE_ZERO) || !is_bx(bx, BX_JUMP_TYPE_DIRECT) || n[2].macro < 0 || n[3].macro < 0) continue;
+    if (n[0].macro >= 0 || n[1].labelled || n[2].labelled || n[3].labelled || n[2].succ[1] != k + 4) continue;
+    int target = n[3].succ[1];
+    uint8_t live = opt->nodes[target].live_in | opt->nodes[k+4].live_in;
+    int x = mov.alu_reg.sreg;
+    uint16_t v = sub.alu_imm.imm;
+    if (v == 0xffff || (live & (LIVE_R(R3) | LIVE_FLAGS))) continue;
+    int distance = abs((int)target - (k + 1));
+    if (distance > ULP_MAX_BRANCH_OFFSET) continue;
+    if (x != R0) {
+      // Compared value must come from an I_LD right before, which can load into R0 instead
+      ulp_insn_t ld = opt->prog[opt->nodes[k-1].pos];
+      if (n[0].labelled || ld.ld.opcode != OPCODE_LD || ld.ld.dreg != x || (live & (LIVE_R(x) | LIVE_R(R0)))) continue;
+      opt->prog[opt->nodes[k-1].pos].ld.dreg = R0;
+    }
+    // Reuse the MOVR/SUBI/M_BRANCH/BXZ slots; drop the M_BRANCH/BX pair
+    uint16_t label = opt->prog[n[3].macro].macro.label;
+    ulp_insn_t fold[] = { M_BL(label, v), M_BGE(label, (uint32_t)v+1) };
+    if (v == 0) {
+      opt->prog[n[0].pos] = fold[2];
+      opt->prog[n[1].pos] = fold[3];
+      opt->dead[n[2].macro] = true; opt->dead[n[2].pos] = true;
+    } else {
+      opt->prog[n[0].pos] = fold[0];
+      opt->prog[n[1].pos] = fold[1];
+      opt->prog[n[2].macro] = fold[2];
+      opt->prog[n[2].pos] = fold[3];
+    }
+    opt->dead[n[3].macro] = true; opt->dead[n[3].pos] = true;
+    changed = true;
+    k += 4;
+  }
+  return changed;
+}
+
+// Static cycle count and word count per top-level section (straight-line cost of each labelled path)
+static void section_stats(ulp_opt_t* opt, ulp_opt_stats_t* stats, bool after) {
+  for (int k = 0; k < opt->num_nodes; k++) {
+    ulp_node_t* node = &opt->nodes[k];
+    int s = 0;
+    while (s < stats->num_sections && stats->sections[s].label != node->section) s++;
+    if (s == stats->num_sections) {
+      if (s == ULP_OPT_MAX_SECTIONS) continue;
+      memset(&stats->sections[s], 0, sizeof(ulp_opt_section_t));
+      stats->sections[s].label = node->section;
+      stats->num_sections++;
+    }
+    ulp_opt_section_t* section = &stats->sections[s];
+    uint32_t cycles = ulp_insn_cycles(opt->prog[node->pos]);
+    if (after) { section->words_after++; section->cycles_after += cycles; }
+    else { section->words_before++; section->cycles_before += cycles; }
+  }
+  if (after) stats->words_after = opt->num_nodes; else stats->words_before = opt->num_nodes;
+}
+
+size_t ulp_optimize(ulp_insn_t* program, size_t size, ulp_opt_stats_t* stats) {
+  ulp_opt_t opt;
+  memset(&opt, 0, sizeof(opt));
+  memset(stats, 0, sizeof(ulp_opt_stats_t));
+  opt.prog = program;
+  opt.size = size;
+  opt.dead = (bool*)calloc(size, sizeof(bool));
+  opt.nodes = (ulp_node_t*)calloc(size, sizeof(ulp_node_t));
+  opt.labels = (ulp_label_t*)calloc(size, sizeof(ulp_label_t));
+  opt.retpoints = (int*)calloc(size, sizeof(int));
+  if (opt.dead && opt.nodes && opt.labels && opt.retpoints && analyze(&opt)) {
+    section_stats(&opt, stats, false);
+    for (int round = 0; round < ULP_OPT_MAX_ROUNDS; round++) {
+      bool changed = pass_values(&opt);
+      if (changed && !analyze(&opt)) break;
+      if (pass_dead_code(&opt)) { changed = true; if (!analyze(&opt)) break; }
+      if (pass_jumps(&opt)) { changed = true; if (!analyze(&opt)) break; }
+      if (!changed) break;
+    }
+    if (pass_fold_bne(&opt)) {
+      analyze(&opt);
+      while (pass_dead_code(&opt) && analyze(&opt));
+    }
+    section_stats(&opt, stats, true);
+  }
+  free(opt.dead); free(opt.nodes); free(opt.labels); free(opt.retpoints);
+  return opt.size;
+}
@@ -44,18 +44,22 @@ const ulp_insn_t ulp_code[] = {
     M_BX(LBL_STRESS_TEST+LBL_NEXT*5),
     // Reverse tick A
   M_LABEL(LBL_STRESS_TEST+LBL_NEXT*3),
+#if REV_TICK_REGIONS == 2
     X_RTC_BLI(LBL_STRESS_TEST+LBL_NEXT*7, VAR_CLK_SS, REV_TICKA_LO),
     X_RTC_BGEI(LBL_STRESS_TEST+LBL_NEXT*7, VAR_CLK_SS, REV_TICKA_HI),
+#endif
     X_RTC_GETR(VAR_TICK_DELAY, R0), I_MOVI(R1, REV_COUNT_MASK), X_LSHIFT(R0, R1), X_STACK_PUSHR(R0),
     X_MASK_BNE(LBL_STRESS_TEST+LBL_NEXT*4, REV_COUNT_MASK),
     X_CALL(LBL_FN_REV_TICKA),
     M_BX(LBL_STRESS_TEST+LBL_NEXT*5),
+#if REV_TICK_REGIONS == 2
     // Reverse tick B
   M_LABEL(LBL_STRESS_TEST+LBL_NEXT*7),
     X_RTC_GETR(VAR_TICK_DELAY, R0), I_MOVI(R1, REV_COUNT_MASK), X_LSHIFT(R0, R1), X_STACK_PUSHR(R0),
     X_MASK_BNE(LBL_STRESS_TEST+LBL_NEXT*4, REV_COUNT_MASK),
     X_CALL(LBL_FN_REV_TICKB),
     M_BX(LBL_STRESS_TEST+LBL_NEXT*5),
+#endif
     // No-op - filler wait
   M_LABEL(LBL_STRESS_TEST+LBL_NEXT*4),
     X_DELAY_MS(MAX_PULSE_MS),
@@ -73,6 +77,44 @@ const ulp_insn_t ulp_code[] = {
     X_WAKE(),
 #else // !STRESS_TEST
   /////////////////////////////////////////////////////////////////////////////////
+  // Count the length of the previous ULP call (entry to entry) in the slot length histogram
+  /////////////////////////////////////////////////////////////////////////////////
+  M_LABEL(LBL_SLOT_TIME),
+    // Latch RTC time counter and wait until it can be read
+    I_WR_REG_BIT(RTC_CNTL_TIME_UPDATE_REG, RTC_CNTL_TIME_UPDATE_S, 1),
+  M_LABEL(LBL_SLOT_TIME+LBL_NEXT),
+    I_RD_REG(RTC_CNTL_TIME_UPDATE_REG, RTC_CNTL_TIME_VALID_S, RTC_CNTL_TIME_VALID_S),
+    M_BL(LBL_SLOT_TIME+LBL_NEXT, 1),
+    I_RD_REG(RTC_CNTL_TIME0_REG, SLOT_TIME_SHIFT, SLOT_TIME_SHIFT+15), // R0 = time now
+    X_RTC_GETR(VAR_SLOT_TIME, R1),
+    X_RTC_SETR(VAR_SLOT_TIME, R0),
+    I_SUBR(R1, R0, R1),                                           // R1 = slot length; 16-bit wraparound is harmless
+    // Row of the histogram = tick action of the previous call; calls without one (before the clock first starts) are not counted
+    X_RTC_GETR(VAR_SLOT_ACTION, R0),
+    X_BZ(LBL_SLOT_TIME+LBL_NEXT*9),
+    I_SUBI(R0, R0, 1),
+    I_LSHI(R2, R0, 3),                                            // R2 = (action-1) * SLOT_BUCKETS
+    // R0 = min(max(slot length - VAR_SLOT_BASE, 0) >> SLOT_BUCKET_SHIFT, SLOT_BUCKETS-1)
+    X_RTC_GETR(VAR_SLOT_BASE, R0),
+    I_SUBR(R0, R1, R0),
+    M_BXF(LBL_SLOT_TIME+LBL_NEXT*2),
+    I_RSHI(R0, R0, SLOT_BUCKET_SHIFT),
+    M_BL(LBL_SLOT_TIME+LBL_NEXT*3, SLOT_BUCKETS),
+    I_MOVI(R0, SLOT_BUCKETS-1),
+    M_BX(LBL_SLOT_TIME+LBL_NEXT*3),
+  M_LABEL(LBL_SLOT_TIME+LBL_NEXT*2),
+    I_MOVI(R0, 0),
+    // Increment bucket, saturating at 0xffff
+  M_LABEL(LBL_SLOT_TIME+LBL_NEXT*3),
+    I_ADDR(R0, R0, R2),
+    I_ADDI(R3, R0, RTC_JITTER_START),
+    I_LD(R1, R3, 0),
+    I_ADDI(R1, R1, 1),
+    M_BXF(LBL_SLOT_TIME+LBL_NEXT*9),
+    I_ST(R1, R3, 0),
+  M_LABEL(LBL_SLOT_TIME+LBL_NEXT*9),
+    X_RTC_SETV(VAR_SLOT_ACTION, VAR_TICK_ACTION),
+  /////////////////////////////////////////////////////////////////////////////////
   // Check VDD every second via ADC on voltage divider
   /////////////////////////////////////////////////////////////////////////////////
   M_LABEL(LBL_CHECK_VDD),
@@ -88,6 +130,7 @@ const ulp_insn_t ulp_code[] = {
     X_RTC_SETR(VAR_ADC_VDD, R0),
     X_RTC_BGEV(LBL_CHECK_VDD+LBL_NEXT*9, VAR_ADC_VDD, VAR_ADC_VDDL),
     X_RTC_SETI(VAR_PAUSE_CLOCK, 1),
+    X_TRACE(TRACE_CHECK_VDD)
     M_BX(LBL_COMMON_HALT),
     // If (old ADC_VDD < ADC_VDDL), check that we are going high and need to start clock again
   M_LABEL(LBL_CHECK_VDD+LBL_NEXT),
@@ -114,6 +157,8 @@ const ulp_insn_t ulp_code[] = {
     // Reset button press detected when VAR_PAUSE_CLOCK == 1; pause clock and inform main core
   M_LABEL(LBL_CHECK_RESETBTN+LBL_NEXT),
     X_RTC_SETI(VAR_PAUSE_CLOCK, 1),
+    X_TRACE(TRACE_CHECK_RESETBTN)
+    X_RTC_ORI(VAR_WAKE_JOBS, JOB_BUTTON),
     X_RTC_SETI(VAR_WAKE_REASON, WAKE_RESET_BUTTON),
     M_BX(LBL_COMMON_WAKE), 
     // Reset button press detected when VAR_PAUSE_CLOCK == 2; restart clock
@@ -128,12 +173,14 @@ const ulp_insn_t ulp_code[] = {
   /////////////////////////////////////////////////////////////////////////////////
   M_LABEL(LBL_CHECK_PAUSE_CLOCK),
     X_RTC_BEQI(LBL_CHECK_PAUSE_CLOCK+LBL_NEXT*9, VAR_PAUSE_CLOCK, 0),
+    X_TRACE(TRACE_CHECK_PAUSE_CLOCK)                              // Repeats overwrite the same record
     M_BX(LBL_COMMON_HALT), 
   M_LABEL(LBL_CHECK_PAUSE_CLOCK+LBL_NEXT*9),
   /////////////////////////////////////////////////////////////////////////////////
   // Perform tick action
   /////////////////////////////////////////////////////////////////////////////////
   M_LABEL(LBL_DO_TICK_ACTION),
+    X_TRACE(TRACE_DO_TICK_ACTION)
     // Only proceed if VAR_TICK_DELAY == 0; otherwise decrement delay counter, execute filler delay and halt
     X_RTC_BEQI(LBL_DO_TICK_ACTION+LBL_NEXT, VAR_TICK_DELAY, 0),
     X_RTC_DEC(VAR_TICK_DELAY),
@@ -141,6 +188,7 @@ const ulp_insn_t ulp_code[] = {
     M_BX(LBL_COMMON_HALT), 
     // Decide which tick action to perform
   M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT),
+    X_RTC_BEQI(LBL_DO_TICK_ACTION+LBL_NEXT*5, VAR_TICK_ACTION, TICK_HOLD), // TICK_HOLD: filler delay only
     X_RTC_BEQI(LBL_DO_TICK_ACTION+LBL_NEXT*3, VAR_TICK_ACTION, TICK_FWD),
     X_RTC_BEQI(LBL_DO_TICK_ACTION+LBL_NEXT*4, VAR_TICK_ACTION, TICK_REV),
     // TICK_NORMAL
@@ -150,21 +198,31 @@ const ulp_insn_t ulp_code[] = {
     M_BX(LBL_DO_TICK_ACTION+LBL_NEXT*6),
     // TICK_FWD
   M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*3),
+#if FWD_COUNT_MASK != 0
     X_MASK_BNE(LBL_DO_TICK_ACTION+LBL_NEXT*5, FWD_COUNT_MASK),    // Do not proceed if (VAR_ULP_CALL_COUNT & FWD_COUNT_MASK) != 0
+#endif
     X_CALL(LBL_FN_FWD_TICK),                                      // Generate tick pulse
     M_BX(LBL_DO_TICK_ACTION+LBL_NEXT*6),
     // TICKA_REV
   M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*4),
+#if REV_TICK_REGIONS == 2
     X_RTC_BLI(LBL_DO_TICK_ACTION+LBL_NEXT*7, VAR_CLK_SS, REV_TICKA_LO),
     X_RTC_BGEI(LBL_DO_TICK_ACTION+LBL_NEXT*7, VAR_CLK_SS, REV_TICKA_HI),
+#endif
+#if REV_COUNT_MASK != 0
     X_MASK_BNE(LBL_DO_TICK_ACTION+LBL_NEXT*5, REV_COUNT_MASK),    // Do not proceed if (VAR_ULP_CALL_COUNT & REV_COUNT_MASK) != 0
+#endif
     X_CALL(LBL_FN_REV_TICKA),                                     // Generate tick pulse
     M_BX(LBL_DO_TICK_ACTION+LBL_NEXT*6),
+#if REV_TICK_REGIONS == 2
     // TICKB_REV
   M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*7),
+  #if REV_COUNT_MASK != 0
     X_MASK_BNE(LBL_DO_TICK_ACTION+LBL_NEXT*5, REV_COUNT_MASK),    // Do not proceed if (VAR_ULP_CALL_COUNT & REV_COUNT_MASK) != 0
+  #endif
     X_CALL(LBL_FN_REV_TICKB),                                     // Generate tick pulse
     M_BX(LBL_DO_TICK_ACTION+LBL_NEXT*6),
+#endif
     // Filler delay
   M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*5),
     X_DELAY_MS(MAX_PULSE_MS),
@@ -173,10 +231,38 @@ const ulp_insn_t ulp_code[] = {
     X_MASK_BNE(LBL_DO_TICK_ACTION+LBL_NEXT*9, NORM_COUNT_MASK), 
     X_STACK_PUSHI(VAR_NET_SS), X_STACK_PUSHI(VAR_NET_MM), X_STACK_PUSHI(VAR_NET_HH), X_CALL(LBL_FN_INC_CLOCK),
     X_RTC_INC(VAR_SLEEP_COUNT),
+    // Drift correction: add VAR_DRIFT_RATE to VAR_DRIFT_ACC, and on carry make this sec one ULP call shorter or longer
+    X_RTC_GETR(VAR_DRIFT_RATE, R1),
+    X_RTC_GETR(VAR_DRIFT_ACC, R0),
+    I_ADDR(R0, R0, R1),
+    M_BXF(LBL_DO_TICK_ACTION+LBL_NEXT*11),
+    X_RTC_SETR(VAR_DRIFT_ACC, R0),
+    M_BX(LBL_DO_TICK_ACTION+LBL_NEXT*12),
+  M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*11),
+    X_RTC_SETR(VAR_DRIFT_ACC, R0),
+    X_RTC_BNEI(LBL_DO_TICK_ACTION+LBL_NEXT*13, VAR_DRIFT_DIR, 0),
+    X_RTC_INC(VAR_ULP_CALL_COUNT),                                // Skip a call
+    M_BX(LBL_DO_TICK_ACTION+LBL_NEXT*12),
+  M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*13),
+    X_RTC_SETI(VAR_DRIFT_SLIP, 1),                                // Repeat a call; see LBL_COMMON_HALT
+  M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*12),
+    X_RTC_BEQI(LBL_DO_TICK_ACTION+LBL_NEXT*8, VAR_HOLD_SECS, 0),
+    X_RTC_DEC(VAR_HOLD_SECS),
+  M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*8),
+    X_RTC_BEQI(LBL_DO_TICK_ACTION+LBL_NEXT*10, VAR_DST_COUNT, 0),
+    X_RTC_DEC(VAR_DST_COUNT),
+    X_RTC_BNEI(LBL_DO_TICK_ACTION+LBL_NEXT*10, VAR_DST_COUNT, 0),
+    X_RTC_ORI(VAR_WAKE_JOBS, JOB_DST),                            // Other jobs falling due in the same sec add their bits
+    X_RTC_SETI(VAR_WAKE_REASON, WAKE_DST_TRANSITION),
+    X_TRACE(TRACE_WAKE_DST)
+    I_WAKE(),
+  M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*10),
     X_RTC_BEQI(LBL_DO_TICK_ACTION+LBL_NEXT*9, VAR_UPDATE_PENDING, 0),
     X_RTC_DEC(VAR_UPDATE_PENDING),
     X_RTC_BNEI(LBL_DO_TICK_ACTION+LBL_NEXT*9, VAR_UPDATE_PENDING, 0),
+    X_RTC_ORI(VAR_WAKE_JOBS, JOB_SYNC),
     X_RTC_SETI(VAR_WAKE_REASON, WAKE_UPDATE_NETTIME),
+    X_TRACE(TRACE_WAKE_SYNC)
     I_WAKE(),
   M_LABEL(LBL_DO_TICK_ACTION+LBL_NEXT*9),
   /////////////////////////////////////////////////////////////////////////////////
@@ -213,8 +299,18 @@ const ulp_insn_t ulp_code[] = {
     X_RTC_SETI(VAR_TICK_ACTION, TICK_FWD),
     X_RTC_SETI(VAR_DEBUG, TICK_FWD),
     M_BX(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*9),
-    // Tick action = TICK_REV
+    // Tick action = TICK_HOLD if the hands are held (eg. DST fall back) or diff(clock, net) >= VAR_HOLD_DIFF
   M_LABEL(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*5),
+    X_RTC_BNEI(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*8, VAR_HOLD_SECS, 0),
+    X_RTC_GETR(VAR_DIFF_PACKED, R0),
+    X_RTC_GETR(VAR_HOLD_DIFF, R1),
+    I_SUBR(R0, R0, R1),
+    M_BXF(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*10),                   // Clock too far ahead to wait for net time
+  M_LABEL(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*8),
+    X_RTC_SETI(VAR_TICK_ACTION, TICK_HOLD),
+    M_BX(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*9),
+    // Tick action = TICK_REV
+  M_LABEL(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*10),
     X_RTC_BEQI(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*6, VAR_PREV_TACTION, TICK_REV), // If previous tick action is TICK_REV, then proceed
     X_RTC_GETR(VAR_DIFF_PACKED, R0),
     M_BL(LBL_COMPUTE_TICK_ACTION+LBL_NEXT*9, TOLERANCE_SS),                 // Do not start TICK_REV if ABS(diff(clock, net)) < tolerance
@@ -232,6 +328,7 @@ const ulp_insn_t ulp_code[] = {
   // Check whether we need to wake up MCU to tune the ULP timer
   /////////////////////////////////////////////////////////////////////////////////
   M_LABEL(LBL_CHECK_TUNE_ULP_TIMER),
+    X_TRACE(TRACE_CHECK_TUNE_ULP_TIMER)
     X_RTC_BGEV(LBL_CHECK_TUNE_ULP_TIMER+LBL_NEXT, VAR_SLEEP_COUNT, VAR_SLEEP_INTERVAL),
     M_BX(LBL_COMMON_HALT),
   M_LABEL(LBL_CHECK_TUNE_ULP_TIMER+LBL_NEXT),
@@ -242,15 +339,21 @@ const ulp_insn_t ulp_code[] = {
     M_BX(LBL_COMMON_HALT),
   M_LABEL(LBL_CHECK_TUNE_ULP_TIMER+LBL_NEXT*2),
     X_RTC_SETI(VAR_SLEEP_COUNT, 0),
+    X_RTC_ORI(VAR_WAKE_JOBS, JOB_TUNE),
     X_RTC_SETI(VAR_WAKE_REASON, WAKE_TUNE_ULP_TIMER),
+    X_TRACE(TRACE_WAKE_TUNE)
     M_BX(LBL_COMMON_WAKE),
   /////////////////////////////////////////////////////////////////////////////////
   // Common exit point to reset counters and refresh network time
   /////////////////////////////////////////////////////////////////////////////////
   M_LABEL(LBL_COMMON_RESTART_CLOCK),
+    X_TRACE(TRACE_RESTART_CLOCK)
     X_RTC_SETI(VAR_PAUSE_CLOCK, 0),
+    X_RTC_SETI(VAR_HOLD_SECS, 0),                                 // Net time stood still while paused; the update below plans again
+    X_RTC_SETI(VAR_DST_COUNT, 0),
     X_RTC_SETI(VAR_ULP_CALL_COUNT, 0),
     X_RTC_SETI(VAR_SLEEP_COUNT, 0),                               
+    X_RTC_ORI(VAR_WAKE_JOBS, JOB_SYNC),
     X_RTC_SETI(VAR_WAKE_REASON, WAKE_UPDATE_NETTIME),
     X_WAKE(),
   /////////////////////////////////////////////////////////////////////////////////
@@ -258,6 +361,12 @@ const ulp_insn_t ulp_code[] = {
   /////////////////////////////////////////////////////////////////////////////////
   M_LABEL(LBL_COMMON_HALT),
     X_INC_ULP_CALL_COUNT(),
+    // Drift correction: once past the call that set VAR_DRIFT_SLIP, count the next call as 1 again
+    X_RTC_BEQI(LBL_COMMON_HALT+LBL_NEXT, VAR_DRIFT_SLIP, 0),
+    X_RTC_BEQI(LBL_COMMON_HALT+LBL_NEXT, VAR_ULP_CALL_COUNT, 1),
+    X_RTC_SETI(VAR_ULP_CALL_COUNT, 1),
+    X_RTC_SETI(VAR_DRIFT_SLIP, 0),
+  M_LABEL(LBL_COMMON_HALT+LBL_NEXT),
     I_HALT(),
   /////////////////////////////////////////////////////////////////////////////////
   // Common exit point to update VAR_ULP_COUNT and wake main core
@@ -266,6 +375,46 @@ const ulp_insn_t ulp_code[] = {
     X_INC_ULP_CALL_COUNT(),
     X_WAKE(),
 #endif // STRESS_TEST
+#ifdef ULP_TRACE
+  /////////////////////////////////////////////////////////////////////////////////
+  // Subroutine - Record a trace point in the ULP trace ring buffer
+  //   R0 - trace point ID << 12 (see X_TRACE())
+  //   record = ID | VAR_ULP_CALL_COUNT << 9 | VAR_TICK_ACTION << 6 | secs of VAR_DIFF_PACKED
+  /////////////////////////////////////////////////////////////////////////////////
+  M_LABEL(LBL_FN_TRACE),
+    // Build record in R0
+    X_RTC_GETR(VAR_ULP_CALL_COUNT, R1),
+    I_ANDI(R1, R1, 7),
+    I_LSHI(R1, R1, 9),
+    I_ORR(R0, R0, R1),
+    X_RTC_GETR(VAR_TICK_ACTION, R1),
+    I_ANDI(R1, R1, 7),
+    I_LSHI(R1, R1, 6),
+    I_ORR(R0, R0, R1),
+    X_RTC_GETR(VAR_DIFF_PACKED, R1),
+    I_ANDI(R1, R1, 0x3f),
+    I_ORR(R0, R0, R1),
+    // R1 = slot of the last record; if it has the same ID, it is overwritten so that a long pause does not flush the buffer
+    X_RTC_GETR(VAR_TRACE_POS, R1),
+    I_SUBI(R1, R1, 1),
+    I_ANDI(R1, R1, RTC_TRACE_WORDS-1),
+    I_ADDI(R2, R1, RTC_TRACE_START),
+    I_LD(R2, R2, 0),
+    I_RSHI(R2, R2, 12),
+    I_RSHI(R3, R0, 12),
+    I_SUBR(R2, R2, R3),
+    M_BXZ(LBL_FN_TRACE+LBL_NEXT),
+    I_ADDI(R1, R1, 1),
+    I_ANDI(R1, R1, RTC_TRACE_WORDS-1),
+    // Store record and advance VAR_TRACE_POS past it
+  M_LABEL(LBL_FN_TRACE+LBL_NEXT),
+    I_ADDI(R2, R1, RTC_TRACE_START),
+    I_ST(R0, R2, 0),
+    I_ADDI(R1, R1, 1),
+    I_ANDI(R1, R1, RTC_TRACE_WORDS-1),
+    X_RTC_SETR(VAR_TRACE_POS, R1),
+    X_RETURN(0),
+#endif // ULP_TRACE
   /////////////////////////////////////////////////////////////////////////////////
   // Subroutine - Generate a normal tick
   //   params - none
@@ -343,6 +492,7 @@ const ulp_insn_t ulp_code[] = {
     // Decrement clock time
     X_STACK_PUSHI(VAR_CLK_SS), X_STACK_PUSHI(VAR_CLK_MM), X_STACK_PUSHI(VAR_CLK_HH), X_CALL(LBL_FN_DEC_CLOCK),
     X_RETURN(0),
+#if REV_TICK_REGIONS == 2
   /////////////////////////////////////////////////////////////////////////////////
   // Subroutine - Generate a reverse tick (region B)
   //   params - none
@@ -376,6 +526,7 @@ const ulp_insn_t ulp_code[] = {
     // Decrement clock time
     X_STACK_PUSHI(VAR_CLK_SS), X_STACK_PUSHI(VAR_CLK_MM), X_STACK_PUSHI(VAR_CLK_HH), X_CALL(LBL_FN_DEC_CLOCK),
     X_RETURN(0),
+#endif // REV_TICK_REGIONS
   /////////////////////////////////////////////////////////////////////////////////
   // Subroutine - Increment HH:MM:SS
   //   params1 - VAR_CLOCK_HH or VAR_NET_SS
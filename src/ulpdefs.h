@@ -29,10 +29,69 @@
 // Workaround to enable loading of ULP code that is > 128 words
 esp_err_t patched_ulp_process_macros_and_load(uint32_t load_addr, const ulp_insn_t* program, size_t* psize);
 
+// Peephole optimizer for ULP code (see ulp_optimizer.cpp)
+#define ULP_OPT_MAX_SECTIONS    32
+typedef struct {
+  uint16_t label;                                                 // Top-level label (< LBL_NEXT) the section starts with
+  uint16_t words_before, words_after;
+  uint32_t cycles_before, cycles_after;                           // Sum of instruction cycles over the section
+} ulp_opt_section_t;
+typedef struct {
+  size_t words_before, words_after;
+  int num_sections;
+  ulp_opt_section_t sections[ULP_OPT_MAX_SECTIONS];
+} ulp_opt_stats_t;
+size_t ulp_optimize(ulp_insn_t* program, size_t size, ulp_opt_stats_t* stats);
+uint32_t ulp_insn_cycles(ulp_insn_t insn);
+
+// Worst-case stack usage of ULP code (see ulp_layout.cpp)
+typedef struct {
+  int stack_words;                                                // Peak number of words above VAR_STACK_REGION
+  int call_depth;                                                 // Deepest X_CALL() nesting
+} ulp_stack_info_t;
+bool ulp_stack_usage(const ulp_insn_t* program, size_t size, ulp_stack_info_t* info);
+
 // Constants
 #include "clock38cm.h"
-#define ULP_PROG_START          200                               // ULP code starts here; region before this reserved for variables and stack
+#define ULP_PROG_START          200                               // Fallback load address for ULP code if its stack usage cannot be computed
+#define ULP_MEM_END             1800                              // End of reserved ULP memory (ULP_RESERVE_MEM in expressif_ulp_macro.cpp)
+#define ULP_STACK_CANARY        0x5aa5                            // Stored in the word right after the stack; overwritten if ULP stack overflows
+#define RTC_TUNE_WORDS          1                                 // Time since the last sync (see tune.h)
+#define RTC_TUNE_START          (ULP_MEM_END-RTC_TUNE_WORDS)      // Main CPU data is allocated downwards from ULP_MEM_END
+#define RTC_PROFILE_WORDS       68                                // Wake phase profiler ring buffers (see profile.h)
+#define RTC_PROFILE_START       (RTC_TUNE_START-RTC_PROFILE_WORDS)
+#define RTC_LOG_WORDS           (320-RTC_TRACE_WORDS)             // Syslog record buffer (see netlog.h); a ULP_TRACE build gives up room for the trace
+#define RTC_LOG_START           (RTC_PROFILE_START-RTC_LOG_WORDS)
+#define RTC_EVENT_WORDS         256                               // Binary event log (see eventlog.h)
+#define RTC_EVENT_START         (RTC_LOG_START-RTC_EVENT_WORDS)
+#define RTC_SESSION_WORDS       2                                 // Network session overruns (see session.h)
+#define RTC_SESSION_START       (RTC_EVENT_START-RTC_SESSION_WORDS)
+#define RTC_OTA_WORDS           1                                 // Firmware update check interval (see ota.h)
+#define RTC_OTA_START           (RTC_SESSION_START-RTC_OTA_WORDS)
+#define RTC_FLEET_WORDS         1                                 // Peer time sharing channel and role (see fleet.h)
+#define RTC_FLEET_START         (RTC_OTA_START-RTC_FLEET_WORDS)
+#define RTC_JOBS_WORDS          1                                 // Jobs of the last batch and wakes saved (see jobs.h)
+#define RTC_JOBS_START          (RTC_FLEET_START-RTC_JOBS_WORDS)
+#define RTC_JITTER_WORDS        (4*SLOT_BUCKETS)                  // ULP slot length histogram, written by the ULP (see jitter.h)
+#define RTC_AWAKE_WORDS         3                                 // Forced sleeps and jobs skipped by the awake time governor (see awake.h)
+#define RTC_AWAKE_START         (RTC_JOBS_START-RTC_AWAKE_WORDS)
+#define RTC_ACCURACY_WORDS      17                                // Displayed time error summary (see accuracy.h)
+#define RTC_ACCURACY_START      (RTC_AWAKE_START-RTC_ACCURACY_WORDS)
+#define RTC_BACKOFF_WORDS       1                                 // Failed tunes in a row (see backoff.h)
+#define RTC_BACKOFF_START       (RTC_ACCURACY_START-RTC_BACKOFF_WORDS)
+#define RTC_JITTER_START        (RTC_BACKOFF_START-RTC_JITTER_WORDS)
+#ifdef ULP_TRACE
+  #define RTC_TRACE_WORDS       64                                // ULP trace ring buffer (see trace.h); must be a power of 2
+#else
+  #define RTC_TRACE_WORDS       0
+#endif
+#define RTC_TRACE_START         (RTC_JITTER_START-RTC_TRACE_WORDS)
+#define ULP_CODE_END            RTC_TRACE_START                   // ULP code must end before this
 #define ULP_CALL_PER_SEC        8                                 // Number of times ULP is called per sec
+#define SLOT_TIME_SHIFT         4                                 // Slot lengths are measured in units of 16 RTC_SLOW_CLK cycles (~107us) ...
+#define SLOT_BUCKET_SHIFT       4                                 // ... and bucketed 16 units (~1.7ms) wide
+#define SLOT_BUCKETS            8                                 // Buckets per tick action; the first and last take everything beyond them
+#define SLOT_NOMINAL_BUCKET     2                                 // Bucket centred on 1000/ULP_CALL_PER_SEC ms
 #define TICKPIN1_GPIO           GPIO_NUM_25 
 #define TICKPIN2_GPIO           GPIO_NUM_27 
 #define RESETBTN_PIN_GPIO       GPIO_NUM_4
@@ -48,11 +107,17 @@ esp_err_t patched_ulp_process_macros_and_load(uint32_t load_addr, const ulp_insn
 #define REV_TICKA_FILLER_MS     (MAX_PULSE_MS-REV_TICKA_T1_MS-REV_TICKA_T2_MS-REV_TICKA_T3_MS) // Length to filler in msecs for rest of reverse tick cycle
 #define REV_TICKB_FILLER_MS     (MAX_PULSE_MS-REV_TICKB_T1_MS-REV_TICKB_T2_MS-REV_TICKB_T3_MS) // Length to filler in msecs for rest of reverse tick cycle
 
+// The ULP program is specialized for the clock profile by the preprocessor: if both reverse tick regions use the same
+// pulses, there is only LBL_FN_REV_TICKA and the second hand is not checked against REV_TICKA_LO/HI; a tick rate mask
+// of 0 (8 ticks/sec) is not checked against VAR_ULP_CALL_COUNT at all
+#define REV_TICK_REGIONS        ((REV_TICKA_T1_MS == REV_TICKB_T1_MS && REV_TICKA_T2_MS == REV_TICKB_T2_MS && \
+                                  REV_TICKA_T3_MS == REV_TICKB_T3_MS && REV_TICKA_ON_US == REV_TICKB_ON_US) ? 1 : 2)
+
 // Branch labels
 enum {
-  LBL_STRESS_TEST, LBL_CHECK_VDD, LBL_CHECK_RESETBTN, LBL_CHECK_PAUSE_CLOCK, LBL_DO_TICK_ACTION, LBL_COMPUTE_TICK_ACTION, LBL_CHECK_TUNE_ULP_TIMER, 
+  LBL_STRESS_TEST, LBL_SLOT_TIME, LBL_CHECK_VDD, LBL_CHECK_RESETBTN, LBL_CHECK_PAUSE_CLOCK, LBL_DO_TICK_ACTION, LBL_COMPUTE_TICK_ACTION, LBL_CHECK_TUNE_ULP_TIMER, 
   LBL_FN_NORM_TICK, LBL_FN_FWD_TICK, LBL_FN_REV_TICKA, LBL_FN_REV_TICKB, LBL_FN_INC_CLOCK, LBL_FN_DEC_CLOCK, LBL_FN_CALC_TIME_DIFF, LBL_FN_IS_DIFF_LESS_THAN,
-  LBL_COMMON_RESTART_CLOCK, LBL_COMMON_HALT, LBL_COMMON_WAKE,
+  LBL_COMMON_RESTART_CLOCK, LBL_COMMON_HALT, LBL_COMMON_WAKE, LBL_FN_TRACE,
   LBL_NEXT = 100, LBL_MARKER = 2000, LBL_MARKER_NEXT = 1000,
 };
 
@@ -85,10 +150,26 @@ enum {
   VAR_DIFF_PACKED,        // Stores result from LBL_FN_TIME_DIFF in 16-bit HHHHMMMMMMSSSSSS packed format 
   VAR_UPDATE_PENDING,     // If >0, decrement every sec. When decremented to 0, wake main CPU with WAKE_UPDATE_NETTIME
   VAR_DEBUG,
+  VAR_HOLD_SECS,          // If >0, hold the hands (TICK_HOLD) whatever the lead and decrement every sec; see dst.h
+  VAR_DST_COUNT,          // If >0, decrement every sec. When decremented to 0, wake main CPU with WAKE_DST_TRANSITION
+  VAR_DST_SHIFT,          // Change in UTC offset (signed, mins) at the transition planned in VAR_DST_COUNT
+  VAR_HOLD_DIFF,          // Packed diff(clock, net) from which TICK_HOLD is chosen over TICK_REV; see hold.h
+  VAR_DRIFT_RATE,         // Added to VAR_DRIFT_ACC every sec; each carry shortens or lengthens that sec by one ULP call; see drift.h
+  VAR_DRIFT_DIR,          // 0 = shorten (ULP timer runs slow), 1 = lengthen (ULP timer runs fast)
+  VAR_DRIFT_ACC,          // Drift correction accumulator
+  VAR_DRIFT_SLIP,         // If 1, the ULP call after the current sec repeats its VAR_ULP_CALL_COUNT to lengthen the sec
+  VAR_WAKE_JOBS,          // JOB_* bits of the jobs that fell due since the main CPU last ran; cleared by the main CPU, see jobs.h
+  VAR_TRACE_POS,          // Slot in the ULP trace ring buffer for the next record (ULP_TRACE only); see trace.h
+  VAR_SLOT_TIME,          // RTC time counter (bits SLOT_TIME_SHIFT and up) when the current ULP call began; see jitter.h
+  VAR_SLOT_ACTION,        // VAR_TICK_ACTION when the current ULP call began; its length is counted under this action
+  VAR_SLOT_BASE,          // Start of the first bucket in SLOT_TIME_SHIFT units (shorter slots go in it too); set by the main CPU
+  VAR_STACK_LIMIT,        // Address of stack canary word that ends the stack; ULP code is loaded right after it
   VAR_STACK_PTR,          // Pointer to stack that begins at VAR_LAST
   VAR_STACK_REGION,       // Start of stack
 };
 
+#define SNAPSHOT_VERSION        1                                 // Of the RTC snapshots in snapshot.h; bump whenever VAR_* above change
+
 // Wake reasons
 enum {
   WAKE_NONE,
@@ -96,6 +177,33 @@ enum {
   WAKE_UPDATE_NETTIME,
   WAKE_TUNE_ULP_TIMER,
   WAKE_DEBUG,
+  WAKE_DST_TRANSITION,
+  WAKE_COUNT,             // Number of wake reasons; sizes the per-reason budgets in session.h and awake.h
+};
+
+// Jobs for the main CPU; the ULP sets the bit of each job as it falls due, in the same sec as VAR_WAKE_REASON
+enum {
+  JOB_BUTTON      = 0x01, // Reset button pressed (WAKE_RESET_BUTTON)
+  JOB_SYNC        = 0x02, // Net time update (WAKE_UPDATE_NETTIME)
+  JOB_TUNE        = 0x04, // ULP timer tuning, which includes a net time update (WAKE_TUNE_ULP_TIMER)
+  JOB_DST         = 0x08, // Change of UTC offset (WAKE_DST_TRANSITION)
+  JOB_OTA_CHECK   = 0x10, // Jobs from here on are never woken for, and only run with the batch of a hard job
+  JOB_SAVE_CONFIG = 0x20,
+  JOB_FLUSH_LOG   = 0x40,
+};
+
+// ULP trace points; the ID is stored in the top 4 bits of each trace record (see X_TRACE() and trace.h)
+enum {
+  TRACE_NONE,                   // Empty slot
+  TRACE_CHECK_VDD,              // Clock paused for low VDD
+  TRACE_CHECK_RESETBTN,         // Reset button pressed while the clock runs
+  TRACE_CHECK_PAUSE_CLOCK,      // Halted because the clock is paused
+  TRACE_DO_TICK_ACTION,         // Before the tick action of this call
+  TRACE_CHECK_TUNE_ULP_TIMER,   // After the next tick action has been computed
+  TRACE_WAKE_TUNE,              // Main CPU woken for a tune
+  TRACE_WAKE_DST,               // Main CPU woken for a DST transition
+  TRACE_WAKE_SYNC,              // Main CPU woken for a net time update
+  TRACE_RESTART_CLOCK,          // Clock restarted after a pause
 };
 
 // Tick actions
@@ -104,6 +212,7 @@ enum {
   TICK_NORMAL,
   TICK_FWD,
   TICK_REV,
+  TICK_HOLD,
 };
 
 /**
@@ -175,6 +284,28 @@ enum {
     X_RTC_GETR(src_var, R2), \
     X_RTC_SETR(dest_var, R2)
 
+/**
+ * Set the bits of constant value in RTCMEM[var].
+ * Uses R2 - R3 for operation
+ */
+#define X_RTC_ORI(var, value) \
+    X_RTC_GETR(var, R2), \
+    I_ORI(R2, R2, value), \
+    X_RTC_SETR(var, R2)
+
+/**
+ * Record trace point id in the ULP trace ring buffer (ULP_TRACE only; see LBL_FN_TRACE).
+ * Expands to nothing otherwise, so it carries its own comma and is written without one.
+ * Uses R0 - R3 for operation
+ */
+#ifdef ULP_TRACE
+  #define X_TRACE(id) \
+    I_MOVI(R0, (id) << 12), \
+    X_CALL(LBL_FN_TRACE),
+#else
+  #define X_TRACE(id)
+#endif
+
 /**
  * Increment RTCMEM[var] by 1.
  * Uses R3 for operation